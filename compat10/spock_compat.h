@@ -20,6 +20,9 @@
 
 #define	SPKDoCopy(stmt, queryString, processed) DoCopy(NULL, stmt, -1, 0, processed)
 
+#define SPKBasicOpenFile(fileName, fileFlags) \
+	BasicOpenFile(fileName, fileFlags, S_IRUSR | S_IWUSR)
+
 #define pg_analyze_and_rewrite(parsetree, query_string, paramTypes, numParams) \
 	pg_analyze_and_rewrite(parsetree, query_string, paramTypes, numParams, NULL)
 
@@ -65,6 +65,9 @@
 
 #define	SPKDoCopy(stmt, queryString, processed) DoCopy(NULL, stmt, -1, 0, processed)
 
+#define SPKBasicOpenFile(fileName, fileFlags) \
+	BasicOpenFile(fileName, fileFlags)
+
 #define SPKReplicationSlotCreate(name, db_specific, persistency) ReplicationSlotCreate(name, db_specific, persistency)
 
 #ifndef rbtxn_has_catalog_changes
@@ -218,12 +218,33 @@ CREATE TABLE spock.queue (
     message json NOT NULL
 );
 
+CREATE TABLE spock.apply_errors (
+    sub_id oid NOT NULL,
+    remote_xid xid,
+    remote_commit_lsn pg_lsn,
+    remote_commit_time timestamp with time zone,
+    action text NOT NULL,
+    nspname name,
+    relname name,
+    remote_tuple json,
+    error_sqlstate text NOT NULL,
+    error_message text NOT NULL,
+    error_detail text,
+    logged_at timestamp with time zone NOT NULL
+);
+
 CREATE FUNCTION spock.replicate_ddl_command(command text, replication_sets text[] DEFAULT '{ddl_sql}')
 RETURNS boolean STRICT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_replicate_ddl_command';
 
 CREATE OR REPLACE FUNCTION spock.queue_truncate()
 RETURNS trigger LANGUAGE c AS 'MODULE_PATHNAME', 'spock_queue_truncate';
 
+CREATE FUNCTION spock.local_node_insert()
+RETURNS trigger LANGUAGE c AS 'MODULE_PATHNAME', 'spock_local_node_insert';
+
+CREATE TRIGGER local_node_insert AFTER INSERT ON spock.local_node
+	FOR EACH STATEMENT EXECUTE PROCEDURE spock.local_node_insert();
+
 CREATE FUNCTION spock.spock_node_info(OUT node_id oid, OUT node_name text, OUT sysid text, OUT dbname text, OUT replication_sets text)
 RETURNS record
 STABLE STRICT LANGUAGE c AS 'MODULE_PATHNAME';
@@ -247,11 +268,91 @@ LANGUAGE c AS 'MODULE_PATHNAME';
 CREATE FUNCTION
 spock.wait_slot_confirm_lsn(slotname name, target pg_lsn)
 RETURNS void LANGUAGE c AS 'spock','spock_wait_slot_confirm_lsn';
+CREATE FUNCTION spock.queue_pruned_rows()
+RETURNS bigint STABLE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_queue_pruned_rows';
+
+CREATE FUNCTION spock.get_subscription_stats(
+    OUT sub_id oid, OUT pid integer, OUT xact_commits bigint,
+    OUT inserts bigint, OUT updates bigint, OUT deletes bigint,
+    OUT multi_insert_batches bigint, OUT noop_updates bigint,
+    OUT conflicts_insert_insert bigint, OUT conflicts_update_update bigint,
+    OUT conflicts_update_delete bigint, OUT conflicts_delete_delete bigint,
+    OUT resolved_apply_remote bigint, OUT resolved_keep_local bigint,
+    OUT resolved_skip bigint, OUT apply_errors bigint,
+    OUT bytes_received bigint,
+    OUT last_commit_lsn pg_lsn, OUT last_commit_time timestamptz,
+    OUT last_apply_time timestamptz, OUT apply_lag interval,
+    OUT receive_time double precision, OUT decode_time double precision,
+    OUT execute_time double precision, OUT conflict_time double precision,
+    OUT commit_time double precision, OUT xact_latency_histogram bigint[],
+    OUT stats_reset timestamptz)
+RETURNS SETOF record VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_subscription_stats';
+
+CREATE VIEW spock.stat_subscription AS
+    SELECT s.sub_name, st.*
+      FROM spock.get_subscription_stats() st
+      JOIN spock.subscription s ON s.sub_id = st.sub_id;
+
+CREATE FUNCTION spock.reset_subscription_stats(subscription_name name DEFAULT NULL)
+RETURNS void CALLED ON NULL INPUT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_reset_subscription_stats';
+
+CREATE FUNCTION spock.get_subscription_lag(
+    OUT sub_id oid,
+    OUT commit_count bigint, OUT commit_lag_p50 double precision,
+    OUT commit_lag_p99 double precision, OUT commit_lag_p999 double precision,
+    OUT commit_lag_max double precision,
+    OUT flush_count bigint, OUT flush_lag_p50 double precision,
+    OUT flush_lag_p99 double precision, OUT flush_lag_p999 double precision,
+    OUT flush_lag_max double precision)
+RETURNS SETOF record VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_subscription_lag';
+
+CREATE VIEW spock.stat_subscription_lag AS
+    SELECT s.sub_name, st.*
+      FROM spock.get_subscription_lag() st
+      JOIN spock.subscription s ON s.sub_id = st.sub_id;
+
+CREATE FUNCTION spock.get_sync_progress(
+    OUT sub_id oid, OUT pid integer, OUT worker_type text, OUT phase text,
+    OUT phase_start timestamptz, OUT nspname name, OUT relname name,
+    OUT tables_done integer, OUT tables_total integer,
+    OUT bytes_copied bigint, OUT rows_copied bigint,
+    OUT table_size_estimate bigint, OUT table_rows_estimate bigint,
+    OUT total_bytes_copied bigint, OUT copy_throughput double precision,
+    OUT catchup_lsn pg_lsn, OUT replay_stop_lsn pg_lsn,
+    OUT catchup_remaining bigint)
+RETURNS SETOF record VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_sync_progress';
+
+CREATE VIEW spock.sync_progress AS
+    SELECT s.sub_name, st.*
+      FROM spock.get_sync_progress() st
+      JOIN spock.subscription s ON s.sub_id = st.sub_id;
+
+CREATE FUNCTION spock.get_relation_stats(
+    OUT relid oid, OUT changes_decoded bigint, OUT changes_filtered bigint,
+    OUT bytes_sent bigint, OUT inserts bigint, OUT updates bigint,
+    OUT deletes bigint, OUT conflicts bigint, OUT apply_time double precision)
+RETURNS SETOF record VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_relation_stats';
+
+CREATE VIEW spock.stat_relation AS
+    SELECT st.relid, n.nspname, c.relname,
+           st.changes_decoded, st.changes_filtered, st.bytes_sent,
+           st.inserts, st.updates, st.deletes, st.conflicts, st.apply_time
+      FROM spock.get_relation_stats() st
+      LEFT JOIN pg_catalog.pg_class c ON c.oid = st.relid
+      LEFT JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace;
+
+CREATE FUNCTION spock.reset_relation_stats(relation regclass DEFAULT NULL)
+RETURNS void CALLED ON NULL INPUT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_reset_relation_stats';
+
 CREATE FUNCTION spock.wait_for_subscription_sync_complete(subscription_name name)
 RETURNS void RETURNS NULL ON NULL INPUT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_wait_for_subscription_sync_complete';
 
 CREATE FUNCTION spock.wait_for_table_sync_complete(subscription_name name, relation regclass)
 RETURNS void RETURNS NULL ON NULL INPUT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_wait_for_table_sync_complete';
 
+CREATE FUNCTION spock.wait_for_apply(node_name name, target_lsn pg_lsn DEFAULT NULL,
+    target_time timestamptz DEFAULT NULL, timeout integer DEFAULT 0)
+RETURNS boolean CALLED ON NULL INPUT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_wait_for_apply';
+
 CREATE FUNCTION spock.xact_commit_timestamp_origin("xid" xid, OUT "timestamp" timestamptz, OUT "roident" oid)
 RETURNS record RETURNS NULL ON NULL INPUT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_xact_commit_timestamp_origin';
@@ -48,12 +48,15 @@
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 #include "pgstat.h"
 
 #include "spock_executor.h"
 #include "spock_node.h"
 #include "spock_conflict.h"
+#include "spock_monitoring.h"
+#include "spock_relay.h"
 #include "spock_worker.h"
 #include "spock.h"
 
@@ -90,11 +93,18 @@ bool	spock_synchronous_commit = false;
 char   *spock_temp_directory = "";
 bool	spock_use_spi = false;
 bool	spock_batch_inserts = true;
+bool	spock_isolate_apply_errors = false;
+int		spock_apply_prefetch_depth = 0;
 static char *spock_temp_directory_config;
 
 void _PG_init(void);
 void spock_supervisor_main(Datum main_arg);
 char *spock_extra_connection_options;
+int		spock_queue_min_retention = 3600;
+int		spock_database_rescan_interval = 0;
+bool	spock_track_apply_timing = false;
+int		spock_apply_multiplex = 0;
+int		spock_apply_multiplex_promote_rate = 1024;
 
 static PGconn * spock_connect_base(const char *connstr,
 									   const char *appname,
@@ -320,10 +330,15 @@ spock_connect_base(const char *connstr, const char *appname,
 	conn = PQconnectdbParams(keys, vals, /* expand_dbname = */ true);
 	if (PQstatus(conn) != CONNECTION_OK)
 	{
+		char	   *msg = pstrdup(PQerrorMessage(conn));
+
+		/* Don't leak the socket when the caller retries. */
+		PQfinish(conn);
+
 		ereport(ERROR,
 				(errmsg("could not connect to the postgresql server%s: %s",
 						replication ? " in replication mode" : "",
-						PQerrorMessage(conn)),
+						msg),
 				 errdetail("dsn was: %s", s.data)));
 	}
 
@@ -561,6 +576,9 @@ spock_start_replication(PGconn *streamConn, const char *slot_name,
 		appendStringInfoString(&command, quote_literal_cstr(replication_sets));
 	}
 
+	/* We can apply several sequence updates from one queued message. */
+	appendStringInfoString(&command, ", \"spock.sequence_batches\" '1'");
+
 	/* Tell the upstream that we want unbounded metadata cache size */
 	appendStringInfoString(&command, ", \"relmeta_cache_size\" '-1'");
 
@@ -572,36 +590,46 @@ spock_start_replication(PGconn *streamConn, const char *slot_name,
 
 	appendStringInfoChar(&command, ')');
 
+	/*
+	 * Failing here is not FATAL, the apply worker retries the connection
+	 * when e.g. the slot is still held by its previous walsender.
+	 */
 	res = PQexec(streamConn, command.data);
-	sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
 	if (PQresultStatus(res) != PGRES_COPY_BOTH)
-		elog(FATAL, "could not send replication command \"%s\": %s\n, sqlstate: %s",
-			 command.data, PQresultErrorMessage(res), sqlstate);
+	{
+		char	   *message = pstrdup(PQresultErrorMessage(res));
+
+		sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+		sqlstate = sqlstate ? pstrdup(sqlstate) : NULL;
+		PQclear(res);
+		elog(ERROR, "could not send replication command \"%s\": %s\n, sqlstate: %s",
+			 command.data, message, sqlstate);
+	}
 	PQclear(res);
 }
 
 /*
  * Start the manager workers for every db which has a spock node.
  *
- * Note that we start workers that are not necessary here. We do this because
- * we need to check every individual database to check if there is spock
- * node setup and it's not possible to switch connections to different
- * databases within one background worker. The workers that won't find any
- * spock node setup will exit immediately during startup.
- * This behavior can cause issue where we consume all the allowed workers and
- * eventually error out even though the max_worker_processes is set high enough
- * to satisfy the actual needed worker count.
+ * The databases with a spock node are remembered in a registry that
+ * survives restarts. Only when it's not known yet (first start, or the
+ * registry file was lost), or when all_databases is given, do we start a
+ * manager in every database; the managers that won't find any spock node
+ * setup exit immediately during startup, and the ones that do register
+ * their database. New nodes register their database themselves, see
+ * spock_local_node_created().
  *
  * Must be run inside a transaction.
  */
 static void
-start_manager_workers(void)
+start_manager_workers(bool all_databases)
 {
 	Relation	rel;
 	TableScanDesc scan;
 	HeapTuple	tup;
+	List	   *dboids = NIL;
 
-	/* Run manager worker for every connectable database. */
+	/* Run manager worker for every connectable spock database. */
 	rel = table_open(DatabaseRelationId, AccessShareLock);
 	scan = table_beginscan_catalog(rel, 0, NULL);
 
@@ -613,12 +641,18 @@ start_manager_workers(void)
 
 		CHECK_FOR_INTERRUPTS();
 
+		dboids = lappend_oid(dboids, dboid);
+
 		/* Can't run workers on databases which don't allow connection. */
 		if (!pgdatabase->datallowconn)
 			continue;
 
+		/* No spock node there. */
+		if (!all_databases && !spock_database_needs_manager(dboid))
+			continue;
+
 		/* Worker already attached, nothing to do. */
-		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
 		if (spock_worker_running(spock_manager_find(dboid)))
 		{
 			LWLockRelease(SpockCtx->lock);
@@ -633,12 +667,15 @@ start_manager_workers(void)
 		memset(&worker, 0, sizeof(SpockWorker));
 		worker.worker_type = SPOCK_WORKER_MANAGER;
 		worker.dboid = dboid;
+		worker.worker.manager.subscriptions_changed = true;
 
 		spock_worker_register(&worker);
 	}
 
 	table_endscan(scan);
 	table_close(rel, AccessShareLock);
+
+	spock_databases_scanned(dboids);
 }
 
 /*
@@ -647,6 +684,8 @@ start_manager_workers(void)
 void
 spock_supervisor_main(Datum main_arg)
 {
+	TimestampTz	last_full_scan;
+
 	/* Establish signal handlers. */
 	pqsignal(SIGTERM, handle_sigterm);
 	BackgroundWorkerUnblockSignals();
@@ -668,6 +707,8 @@ spock_supervisor_main(Datum main_arg)
 
 	elog(LOG, "starting spock supervisor");
 
+	spock_databases_load();
+
 	VALGRIND_PRINTF("SPOCK: supervisor\n");
 
 	/* Setup connection to pinned catalogs (we only ever read pg_database). */
@@ -677,12 +718,29 @@ spock_supervisor_main(Datum main_arg)
 	BackgroundWorkerInitializeConnection(NULL, NULL);
 #endif
 
+	last_full_scan = GetCurrentTimestamp();
+
 	/* Main wait loop. */
 	while (!got_SIGTERM)
     {
 		int rc;
+		long		timeout = 180000L;
+		bool		full_scan = false;
+
+		/*
+		 * Databases copied from a template that has a spock node never ran
+		 * any code that would register them. If asked to, look at all
+		 * databases now and then to find them.
+		 */
+		if (spock_database_rescan_interval > 0)
+		{
+			full_scan = TimestampDifferenceExceeds(last_full_scan,
+												   GetCurrentTimestamp(),
+												   spock_database_rescan_interval * 1000);
+			timeout = Min(timeout, spock_database_rescan_interval * 1000L);
+		}
 
-		if (SpockCtx->subscriptions_changed)
+		if (SpockCtx->subscriptions_changed || full_scan)
 		{
 			/*
 			 * No need to lock here, since we'll take account of all sub
@@ -691,13 +749,16 @@ spock_supervisor_main(Datum main_arg)
 			 */
 			SpockCtx->subscriptions_changed = false;
 			StartTransactionCommand();
-			start_manager_workers();
+			start_manager_workers(full_scan);
 			CommitTransactionCommand();
+
+			if (full_scan)
+				last_full_scan = GetCurrentTimestamp();
 		}
 
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   180000L);
+					   timeout);
 
         ResetLatch(&MyProc->procLatch);
 
@@ -791,6 +852,28 @@ _PG_init(void)
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("spock.isolate_apply_errors",
+							 "Apply each change in a subtransaction and skip the failing ones",
+							 "Changes that fail to apply are recorded in "
+							 "spock.apply_errors and the rest of the "
+							 "transaction is applied.",
+							 &spock_isolate_apply_errors,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.apply_prefetch_depth",
+							"Number of received changes the apply worker prefetches ahead",
+							"Rows targeted by upcoming UPDATEs and DELETEs are "
+							"looked up in the REPLICA IDENTITY index and their "
+							"heap pages prefetched. 0 disables prefetching.",
+							&spock_apply_prefetch_depth,
+							0, 0, 1024,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
 	/*
 	 * We can't use the temp_tablespace safely for our dumps, because Pg's
 	 * crash recovery is very careful to delete only particularly formatted
@@ -815,12 +898,88 @@ _PG_init(void)
 							   0,
 							   NULL, NULL, NULL);
 
+	DefineCustomIntVariable("spock.queue_min_retention",
+							"Minimum time to keep rows in the queue table",
+							"Rows already decoded by all local logical slots "
+							"are removed once they are older than this. "
+							"-1 disables removal.",
+							&spock_queue_min_retention,
+							3600, -1, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.database_rescan_interval",
+							"Interval at which the supervisor looks for spock nodes in all databases",
+							"Needed only for databases created from a template "
+							"database that has a spock node. 0 disables the "
+							"rescan.",
+							&spock_database_rescan_interval,
+							0, 0, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.track_apply_timing",
+							 "Collect timing of the individual apply phases",
+							 NULL,
+							 &spock_track_apply_timing,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.stat_max_relations",
+							"Maximum number of relations tracked in relation statistics",
+							NULL,
+							&spock_stat_max_relations,
+							1000, 100, INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.apply_multiplex",
+							"Number of subscriptions applied by one multiplexed apply worker",
+							"Subscriptions without pending synchronization or "
+							"apply delay share apply workers in groups of up to "
+							"this size. 0 or 1 gives every subscription its own "
+							"apply worker.",
+							&spock_apply_multiplex,
+							0, 0, SPOCK_APPLY_GROUP_MAX_SUBS,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("spock.apply_multiplex_promote_rate",
+							"Data received per second above which a multiplexed subscription gets a dedicated apply worker",
+							NULL,
+							&spock_apply_multiplex_promote_rate,
+							1024, 1, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("spock.relay_log",
+							 "Store received changes in a local relay log before applying them",
+							 "Lets the provider recycle WAL once changes are "
+							 "durable locally. Takes effect when apply workers "
+							 "restart, an existing relay log is drained only "
+							 "after a restart with the setting off.",
+							 &spock_relay_log,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
 	if (IsBinaryUpgrade)
 		return;
 
 	/* Init workers. */
 	spock_worker_shmem_init();
 
+	/* Init shared statistics. */
+	spock_monitoring_shmem_init();
+
 	/* Init executor module */
 	spock_executor_init();
 
@@ -42,7 +42,14 @@ extern bool spock_synchronous_commit;
 extern char *spock_temp_directory;
 extern bool spock_use_spi;
 extern bool spock_batch_inserts;
+extern bool spock_isolate_apply_errors;
+extern int spock_apply_prefetch_depth;
 extern char *spock_extra_connection_options;
+extern int spock_queue_min_retention;
+extern int spock_database_rescan_interval;
+extern bool spock_track_apply_timing;
+extern int spock_apply_multiplex;
+extern int spock_apply_multiplex_promote_rate;
 
 extern char *shorten_hash(const char *str, int maxlen);
 
@@ -19,6 +19,7 @@
 #include "access/htup_details.h"
 #include "access/xact.h"
 
+#include "catalog/indexing.h"
 #include "catalog/namespace.h"
 
 #include "commands/async.h"
@@ -43,7 +44,9 @@
 
 #include "rewrite/rewriteHandler.h"
 
+#include "storage/buffile.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lmgr.h"
 #include "storage/proc.h"
 
@@ -52,15 +55,19 @@
 
 #include "utils/builtins.h"
 #include "utils/int8.h"
+#include "utils/json.h"
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/pg_lsn.h"
 #include "utils/snapmgr.h"
 
 #include "spock_conflict.h"
 #include "spock_executor.h"
+#include "spock_monitoring.h"
 #include "spock_node.h"
 #include "spock_queue.h"
+#include "spock_relay.h"
 #include "spock_relcache.h"
 #include "spock_repset.h"
 #include "spock_rpc.h"
@@ -73,14 +80,53 @@
 
 
 void spock_apply_main(Datum main_arg);
+void spock_apply_group_main(Datum main_arg);
 
 static bool			in_remote_transaction = false;
 static XLogRecPtr	remote_origin_lsn = InvalidXLogRecPtr;
 static RepOriginId	remote_origin_id = InvalidRepOriginId;
 static TimeOffset	apply_delay = 0;
 
+/* Received changes go to the relay log and are applied from there. */
+static bool			use_relay = false;
+
+/* How long to apply from the relay log before receiving again. */
+#define RELAY_APPLY_BATCH_MS	100
+
+/*
+ * Wait between rounds of reconnect attempts once the provider connection is
+ * lost. It doubles every round and the worker gives up past the maximum.
+ */
+#define RECONNECT_MIN_WAIT_MS	100
+#define RECONNECT_MAX_WAIT_MS	10000
+
+/*
+ * Transactions received but waiting for apply_delay to pass. Their messages
+ * are spooled in memory, up to work_mem, and in a temporary file beyond that.
+ */
+typedef struct DelayedXact
+{
+	XLogRecPtr	commit_lsn;		/* Upstream commit record position. */
+	TimestampTz	commit_time;	/* Upstream commit time. */
+	bool		complete;		/* Have we spooled the COMMIT already? */
+} DelayedXact;
+
+static List		   *delayed_xacts = NIL;
+static MemoryContext delay_context = NULL;
+static List		   *delay_mem_msgs = NIL;	/* StringInfo, oldest first */
+static Size			delay_mem_bytes = 0;
+static BufFile	   *delay_file = NULL;		/* Messages newer than delay_mem_msgs */
+static uint64		delay_file_msgs = 0;
+static int			delay_read_fileno = 0;
+static off_t		delay_read_offset = 0;
+static int			delay_write_fileno = 0;
+static off_t		delay_write_offset = 0;
+
 static Oid			QueueRelid = InvalidOid;
 
+/* Relation being decoded by the prefetch look-ahead. */
+static SpockRelation *prefetch_rel = NULL;
+
 static List		   *SyncingTables = NIL;
 
 SpockApplyWorker	   *MyApplyWorker = NULL;
@@ -125,14 +171,35 @@ static bool					use_multi_insert = false;
  */
 static uint32			xact_action_counter;
 
+/* When did we start applying current remote transaction. */
+static instr_time		xact_apply_start;
+
 typedef struct SPKFlushPosition
 {
 	dlist_node node;
 	XLogRecPtr local_end;
 	XLogRecPtr remote_end;
+	TimestampTz commit_time;	/* origin commit time, for lag tracking */
 } SPKFlushPosition;
 
-dlist_head lsn_mapping = DLIST_STATIC_INIT(lsn_mapping);
+/*
+ * State of the replication stream that is kept across transactions. The
+ * multiplexed apply worker has one per subscription.
+ */
+typedef struct SPKStreamState
+{
+	dlist_head	lsn_mapping;	/* SPKFlushPosition of unflushed commits */
+	XLogRecPtr	last_recvpos;	/* Positions last reported to upstream. */
+	XLogRecPtr	last_writepos;
+	XLogRecPtr	last_flushpos;
+} SPKStreamState;
+
+static SPKStreamState default_stream =
+{
+	DLIST_STATIC_INIT(default_stream.lsn_mapping),
+	InvalidXLogRecPtr, InvalidXLogRecPtr, InvalidXLogRecPtr
+};
+static SPKStreamState *apply_stream = &default_stream;
 
 typedef struct ApplyExecState
 {
@@ -152,6 +219,29 @@ struct ActionErrCallbackArg
 struct ActionErrCallbackArg errcallback_arg;
 static TransactionId remote_xid;
 
+#define CATALOG_APPLY_ERRORS	"apply_errors"
+
+#define Natts_apply_errors					12
+#define Anum_apply_errors_sub_id			1
+#define Anum_apply_errors_remote_xid		2
+#define Anum_apply_errors_remote_commit_lsn	3
+#define Anum_apply_errors_remote_commit_time	4
+#define Anum_apply_errors_action			5
+#define Anum_apply_errors_nspname			6
+#define Anum_apply_errors_relname			7
+#define Anum_apply_errors_remote_tuple		8
+#define Anum_apply_errors_error_sqlstate	9
+#define Anum_apply_errors_error_message		10
+#define Anum_apply_errors_error_detail		11
+#define Anum_apply_errors_logged_at			12
+
+/* spock.isolate_apply_errors as of BEGIN of the current remote transaction */
+static bool isolate_xact = false;
+
+/* Backoff of apply_reconnect(), kept across reconnects that fail quickly. */
+static long reconnect_wait_ms = RECONNECT_MIN_WAIT_MS;
+static TimestampTz reconnect_time = 0;
+
 static void multi_insert_finish(void);
 
 static void handle_queued_message(HeapTuple msgtup, bool tx_just_started);
@@ -293,34 +383,131 @@ handle_begin(StringInfo s)
 	replorigin_session_origin_timestamp = commit_time;
 	replorigin_session_origin_lsn = commit_lsn;
 	remote_origin_id = InvalidRepOriginId;
+	isolate_xact = spock_isolate_apply_errors;
 
 	VALGRIND_PRINTF("SPOCK_APPLY: begin %u\n", remote_xid);
 
-	/* don't want the overhead otherwise */
-	if (apply_delay > 0)
-	{
-		TimestampTz		current;
-		current = GetCurrentIntegerTimestamp();
+	/* apply_delay was already waited out by apply_delayed_xacts(). */
+	in_remote_transaction = true;
 
-		/* ensure no weirdness due to clock drift */
-		if (current > replorigin_session_origin_timestamp)
-		{
-			long		sec;
-			int			usec;
+	if (spock_track_apply_timing)
+		INSTR_TIME_SET_CURRENT(xact_apply_start);
 
-			current = TimestampTzPlusMilliseconds(current,
-												  -apply_delay);
+	pgstat_report_activity(STATE_RUNNING, NULL);
+}
 
-			TimestampDifference(current, replorigin_session_origin_timestamp,
-								&sec, &usec);
-			/* FIXME: deal with overflow? */
-			pg_usleep(usec + (sec * USECS_PER_SEC));
-		}
-	}
+/*
+ * Start timing of an apply phase.
+ */
+void
+spock_apply_phase_start(SpockApplyPhase phase, instr_time *start)
+{
+	if (!spock_track_apply_timing)
+		return;
 
-	in_remote_transaction = true;
+	INSTR_TIME_SET_CURRENT(*start);
+}
 
-	pgstat_report_activity(STATE_RUNNING, NULL);
+/*
+ * Finish timing of an apply phase and add the elapsed time to the stats.
+ */
+void
+spock_apply_phase_end(SpockApplyPhase phase, instr_time *start)
+{
+	instr_time	elapsed;
+
+	if (!spock_track_apply_timing || MyApplyWorker == NULL)
+		return;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, *start);
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.phase_time[phase],
+							INSTR_TIME_GET_MICROSEC(elapsed));
+}
+
+/*
+ * Add the apply time of the just finished transaction to the histogram.
+ */
+static void
+xact_latency_report(void)
+{
+	instr_time	elapsed;
+	uint64		usec;
+	int			bucket = 0;
+
+	if (!spock_track_apply_timing || INSTR_TIME_IS_ZERO(xact_apply_start))
+		return;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, xact_apply_start);
+	INSTR_TIME_SET_ZERO(xact_apply_start);
+
+	usec = INSTR_TIME_GET_MICROSEC(elapsed);
+	while (bucket < SPOCK_APPLY_LATENCY_BUCKETS - 1 &&
+		   usec >= (UINT64CONST(2) << bucket))
+		bucket++;
+
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.xact_latency[bucket], 1);
+}
+
+/*
+ * Remember the local end of the just committed transaction, so that the
+ * remote end can be confirmed once it's flushed.
+ */
+static void
+track_flush_position(XLogRecPtr end_lsn, TimestampTz commit_time)
+{
+	SPKFlushPosition *flushpos;
+
+	flushpos = (SPKFlushPosition *)
+		MemoryContextAlloc(TopMemoryContext, sizeof(SPKFlushPosition));
+	flushpos->local_end = XactLastCommitEnd;
+	flushpos->remote_end = end_lsn;
+	flushpos->commit_time = commit_time;
+
+	dlist_push_tail(&apply_stream->lsn_mapping, &flushpos->node);
+}
+
+/*
+ * Update the commit stats and wake up the waiters for the applied commit.
+ */
+static void
+report_xact_commit(XLogRecPtr end_lsn, TimestampTz commit_time)
+{
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.xact_commits, 1);
+	pg_atomic_write_u64(&MyApplyWorker->stats.last_commit_lsn, end_lsn);
+	pg_atomic_write_u64(&MyApplyWorker->stats.last_commit_time,
+						(uint64) commit_time);
+	pg_atomic_write_u64(&MyApplyWorker->stats.last_apply_time,
+						(uint64) GetCurrentTimestamp());
+	xact_latency_report();
+	spock_relstat_flush();
+
+	/* Wake up backends in spock.wait_for_apply(). */
+	if (MyApplyWorker->catchup != NULL)
+		pg_atomic_write_u64(&MyApplyWorker->catchup->commit_time,
+							(uint64) commit_time);
+	ConditionVariableBroadcast(&SpockCtx->apply_commit_cv);
+}
+
+/*
+ * Everything the provider sent up to endpos was applied.
+ *
+ * The origin progress only moves with replicated commits, so without this
+ * spock.wait_for_apply() would wait for a position past the last replicated
+ * transaction forever while the provider has nothing more to send.
+ */
+static void
+report_apply_idle(XLogRecPtr endpos)
+{
+	SpockApplyCatchup  *catchup = MyApplyWorker->catchup;
+
+	if (catchup == NULL ||
+		endpos <= (XLogRecPtr) pg_atomic_read_u64(&catchup->idle_lsn))
+		return;
+
+	pg_atomic_write_u64(&catchup->idle_lsn, endpos);
+	ConditionVariableBroadcast(&SpockCtx->apply_commit_cv);
 }
 
 /*
@@ -342,7 +529,7 @@ handle_commit(StringInfo s)
 
 	if (IsTransactionState())
 	{
-		SPKFlushPosition *flushpos;
+		instr_time		phase_start;
 
 		multi_insert_finish();
 
@@ -351,18 +538,18 @@ handle_commit(StringInfo s)
 		/* We need to write end_lsn to the commit record. */
 		replorigin_session_origin_lsn = end_lsn;
 
+		spock_apply_phase_start(SPOCK_APPLY_PHASE_COMMIT, &phase_start);
 		CommitTransactionCommand();
-		MemoryContextSwitchTo(TopMemoryContext);
-
-		/* Track commit lsn  */
-		flushpos = (SPKFlushPosition *) palloc(sizeof(SPKFlushPosition));
-		flushpos->local_end = XactLastCommitEnd;
-		flushpos->remote_end = end_lsn;
+		spock_apply_phase_end(SPOCK_APPLY_PHASE_COMMIT, &phase_start);
+		spock_lag_hist_add(&MyApplyWorker->stats.commit_lag, commit_time,
+						   GetCurrentTimestamp());
 
-		dlist_push_tail(&lsn_mapping, &flushpos->node);
+		track_flush_position(end_lsn, commit_time);
 		MemoryContextSwitchTo(MessageContext);
 	}
 
+	report_xact_commit(end_lsn, commit_time);
+
 	/*
 	 * If the xact isn't from the immediate upstream, advance the slot of the
 	 * node it originally came from so we start replay of that node's change
@@ -519,12 +706,17 @@ handle_insert(StringInfo s)
 {
 	SpockTupleData	newtup;
 	SpockRelation  *rel;
+	instr_time		start;
+	instr_time		elapsed;
+	instr_time		phase_start;
 	bool				started_tx = ensure_transaction();
 
 	errcallback_arg.action_name = "INSERT";
 	xact_action_counter++;
 
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_DECODE, &phase_start);
 	rel = spock_read_insert(s, RowExclusiveLock, &newtup);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_DECODE, &phase_start);
 	errcallback_arg.rel = rel;
 
 	/* If in list of relations which are being synchronized, skip. */
@@ -534,6 +726,8 @@ handle_insert(StringInfo s)
 		return;
 	}
 
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.inserts, 1);
+
 	/* Handle multi_insert capabilities. */
 	if (use_multi_insert)
 	{
@@ -544,12 +738,19 @@ handle_insert(StringInfo s)
 		}
 		else
 		{
+			spock_apply_phase_start(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+			INSTR_TIME_SET_CURRENT(start);
 			apply_api.multi_insert_add_tuple(rel, &newtup);
+			INSTR_TIME_SET_CURRENT(elapsed);
+			spock_apply_phase_end(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+			INSTR_TIME_SUBTRACT(elapsed, start);
+			spock_relstat_report_apply(RelationGetRelid(rel->rel),
+									   SPOCK_RELSTAT_INSERTS, elapsed);
 			last_insert_rel_cnt++;
 			return;
 		}
 	}
-	else if (spock_batch_inserts &&
+	else if (spock_batch_inserts && !isolate_xact &&
 			 RelationGetRelid(rel->rel) != QueueRelid &&
 			 apply_api.can_multi_insert &&
 			 apply_api.can_multi_insert(rel))
@@ -567,7 +768,14 @@ handle_insert(StringInfo s)
 	}
 
 	/* Normal insert. */
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+	INSTR_TIME_SET_CURRENT(start);
 	apply_api.do_insert(rel, &newtup);
+	INSTR_TIME_SET_CURRENT(elapsed);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	spock_relstat_report_apply(RelationGetRelid(rel->rel),
+							   SPOCK_RELSTAT_INSERTS, elapsed);
 
 	/* if INSERT was into our queue, process the message. */
 	if (RelationGetRelid(rel->rel) == QueueRelid)
@@ -619,6 +827,7 @@ multi_insert_finish(void)
 		errcallback_arg.rel = last_insert_rel;
 
 		apply_api.multi_insert_finish(last_insert_rel);
+		pg_atomic_fetch_add_u64(&MyApplyWorker->stats.multi_inserts, 1);
 		spock_relation_close(last_insert_rel, NoLock);
 		use_multi_insert = false;
 		last_insert_rel = NULL;
@@ -636,6 +845,9 @@ handle_update(StringInfo s)
 	SpockTupleData	newtup;
 	SpockRelation  *rel;
 	bool				hasoldtup;
+	instr_time		start;
+	instr_time		elapsed;
+	instr_time		phase_start;
 
 	errcallback_arg.action_name = "UPDATE";
 	xact_action_counter++;
@@ -644,8 +856,10 @@ handle_update(StringInfo s)
 
 	multi_insert_finish();
 
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_DECODE, &phase_start);
 	rel = spock_read_update(s, RowExclusiveLock, &hasoldtup, &oldtup,
 								&newtup);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_DECODE, &phase_start);
 	errcallback_arg.rel = rel;
 
 	/* If in list of relations which are being synchronized, skip. */
@@ -655,7 +869,15 @@ handle_update(StringInfo s)
 		return;
 	}
 
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+	INSTR_TIME_SET_CURRENT(start);
 	apply_api.do_update(rel, hasoldtup ? &oldtup : &newtup, &newtup);
+	INSTR_TIME_SET_CURRENT(elapsed);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	spock_relstat_report_apply(RelationGetRelid(rel->rel),
+							   SPOCK_RELSTAT_UPDATES, elapsed);
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.updates, 1);
 
 	spock_relation_close(rel, NoLock);
 }
@@ -665,6 +887,9 @@ handle_delete(StringInfo s)
 {
 	SpockTupleData	oldtup;
 	SpockRelation  *rel;
+	instr_time		start;
+	instr_time		elapsed;
+	instr_time		phase_start;
 
 	memset(&errcallback_arg, 0, sizeof(struct ActionErrCallbackArg));
 	xact_action_counter++;
@@ -673,7 +898,9 @@ handle_delete(StringInfo s)
 
 	multi_insert_finish();
 
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_DECODE, &phase_start);
 	rel = spock_read_delete(s, RowExclusiveLock, &oldtup);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_DECODE, &phase_start);
 	errcallback_arg.rel = rel;
 
 	/* If in list of relations which are being synchronized, skip. */
@@ -683,7 +910,15 @@ handle_delete(StringInfo s)
 		return;
 	}
 
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+	INSTR_TIME_SET_CURRENT(start);
 	apply_api.do_delete(rel, &oldtup);
+	INSTR_TIME_SET_CURRENT(elapsed);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_EXECUTE, &phase_start);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	spock_relstat_report_apply(RelationGetRelid(rel->rel),
+							   SPOCK_RELSTAT_DELETES, elapsed);
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.deletes, 1);
 
 	spock_relation_close(rel, NoLock);
 }
@@ -913,8 +1148,39 @@ handle_table_sync(QueuedMessage *queued_message)
 	MyApplyWorker->sync_pending = true;
 }
 
+/*
+ * Set the local sequence to the value received from upstream.
+ */
+static void
+apply_sequence_value(char *nspname, char *relname, char *last_value_raw)
+{
+	int64			last_value;
+	Oid				nspoid;
+	Oid				reloid;
+
+	/* Check if we got both schema and table names. */
+	if (!nspname)
+		elog(ERROR, "missing schema_name in sequence message");
+
+	if (!relname)
+		elog(ERROR, "missing table_name in sequence message");
+
+	if (!last_value_raw)
+		elog(ERROR, "missing last_value in sequence message");
+
+	nspoid = get_namespace_oid(nspname, false);
+	reloid = get_relname_relid(relname, nspoid);
+	scanint8(last_value_raw, false, &last_value);
+
+	DirectFunctionCall2(setval_oid, ObjectIdGetDatum(reloid),
+						Int64GetDatum(last_value));
+}
+
 /*
  * Handle SEQUENCE message comming via queue table.
+ *
+ * The message is either a single sequence object or an array of them when
+ * the upstream batched the updates of a replication set together.
  */
 static void
 handle_sequence(QueuedMessage *queued_message)
@@ -924,29 +1190,34 @@ handle_sequence(QueuedMessage *queued_message)
 	JsonbValue		v;
 	int				r;
 	int				level = 0;
+	int				objlevel = 1;
 	char		   *key = NULL;
 	char		  **parse_res = NULL;
 	char		   *nspname = NULL;
 	char		   *relname = NULL;
 	char		   *last_value_raw = NULL;
-	int64			last_value;
-	Oid				nspoid;
-	Oid				reloid;
 
 	/* Parse and validate the json message. */
-	if (!JB_ROOT_IS_OBJECT(message))
-		elog(ERROR, "malformed message in queued message tuple: root is not object");
+	if (JB_ROOT_IS_SCALAR(message))
+		elog(ERROR, "malformed message in queued message tuple: root is scalar");
+
+	if (JB_ROOT_IS_ARRAY(message))
+		objlevel = 2;
 
 	it = JsonbIteratorInit(&message->root);
 	while ((r = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
 	{
-		if (level == 0 && r != WJB_BEGIN_OBJECT)
-			elog(ERROR, "root element needs to be an object");
-		else if (level == 0 && r == WJB_BEGIN_OBJECT)
+		if (level == 0 && objlevel == 2 && r == WJB_BEGIN_ARRAY)
+			level++;
+		else if (level == 1 && objlevel == 2 && r == WJB_END_ARRAY)
+			level--;
+		else if (level == objlevel - 1 && r != WJB_BEGIN_OBJECT)
+			elog(ERROR, "sequence element needs to be an object");
+		else if (level == objlevel - 1 && r == WJB_BEGIN_OBJECT)
 		{
 			level++;
 		}
-		else if (level == 1 && r == WJB_KEY)
+		else if (level == objlevel && r == WJB_KEY)
 		{
 			if (strncmp(v.val.string.val, "schema_name", v.val.string.len) == 0)
 				parse_res = &nspname;
@@ -960,7 +1231,7 @@ handle_sequence(QueuedMessage *queued_message)
 
 			key = v.val.string.val;
 		}
-		else if (level == 1 && r == WJB_VALUE)
+		else if (level == objlevel && r == WJB_VALUE)
 		{
 			if (!key)
 				elog(ERROR, "in wrong state when parsing key");
@@ -970,38 +1241,25 @@ handle_sequence(QueuedMessage *queued_message)
 
 			*parse_res = pnstrdup(v.val.string.val, v.val.string.len);
 		}
-		else if (level == 1 && r != WJB_END_OBJECT)
+		else if (level == objlevel && r != WJB_END_OBJECT)
 		{
 			elog(ERROR, "unexpected content: %u at level %d", r, level);
 		}
-		else if (r == WJB_END_OBJECT)
+		else if (level == objlevel && r == WJB_END_OBJECT)
 		{
 			level--;
 			parse_res = NULL;
 			key = NULL;
+
+			apply_sequence_value(nspname, relname, last_value_raw);
+			nspname = relname = last_value_raw = NULL;
 		}
 		else
 			elog(ERROR, "unexpected content: %u at level %d", r, level);
 
 	}
-
-	/* Check if we got both schema and table names. */
-	if (!nspname)
-		elog(ERROR, "missing schema_name in sequence message");
-
-	if (!relname)
-		elog(ERROR, "missing table_name in sequence message");
-
-	if (!last_value_raw)
-		elog(ERROR, "missing last_value in sequence message");
-
-	nspoid = get_namespace_oid(nspname, false);
-	reloid = get_relname_relid(relname, nspoid);
-	scanint8(last_value_raw, false, &last_value);
-
-	DirectFunctionCall2(setval_oid, ObjectIdGetDatum(reloid),
-						Int64GetDatum(last_value));
 }
+
 /*
  * Handle SQL message comming via queue table.
  */
@@ -1084,6 +1342,285 @@ handle_queued_message(HeapTuple msgtup, bool tx_just_started)
 	errcallback_arg.is_ddl_or_drop = false;
 }
 
+/*
+ * Format the changed columns of remote tuple as json object.
+ */
+static char *
+remote_tuple_to_json(SpockRelation *rel, SpockTupleData *tup)
+{
+	TupleDesc		desc = RelationGetDescr(rel->rel);
+	StringInfoData	s;
+	bool			first = true;
+	int				i;
+
+	initStringInfo(&s);
+	appendStringInfoChar(&s, '{');
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, i);
+		Oid			typoutput;
+		bool		typisvarlena;
+
+		if (att->attisdropped || !tup->changed[i])
+			continue;
+
+		if (!first)
+			appendStringInfoString(&s, ", ");
+		first = false;
+
+		escape_json(&s, NameStr(att->attname));
+		appendStringInfoString(&s, ": ");
+
+		if (tup->nulls[i])
+		{
+			appendStringInfoString(&s, "null");
+			continue;
+		}
+
+		getTypeOutputInfo(att->atttypid, &typoutput, &typisvarlena);
+		escape_json(&s, OidOutputFunctionCall(typoutput, tup->values[i]));
+	}
+	appendStringInfoChar(&s, '}');
+
+	return s.data;
+}
+
+/*
+ * Decode the failed change again to get its remote tuple as json, the new
+ * tuple for INSERT and UPDATE, the old key for DELETE.
+ *
+ * Returns NULL if the change can't be decoded, which may well be why it
+ * failed in the first place.
+ */
+static char *
+failed_change_to_json(StringInfo s, int start, char action)
+{
+	StringInfoData	msg = *s;
+	MemoryContext	oldctx = CurrentMemoryContext;
+	ResourceOwner	oldowner = CurrentResourceOwner;
+	char	   *volatile result = NULL;
+
+	msg.cursor = start;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldctx);
+
+	PG_TRY();
+	{
+		SpockTupleData *tup = palloc(sizeof(SpockTupleData));
+		SpockRelation  *rel;
+		bool			hasoldtup;
+
+		if (action == 'I')
+			rel = spock_read_insert(&msg, AccessShareLock, tup);
+		else if (action == 'U')
+			rel = spock_read_update(&msg, AccessShareLock, &hasoldtup,
+									palloc(sizeof(SpockTupleData)), tup);
+		else
+			rel = spock_read_delete(&msg, AccessShareLock, tup);
+
+		result = remote_tuple_to_json(rel, tup);
+		spock_relation_close(rel, AccessShareLock);
+
+		ReleaseCurrentSubTransaction();
+	}
+	PG_CATCH();
+	{
+		StringInfoData	peek = *s;
+		SpockRelation  *rel;
+
+		MemoryContextSwitchTo(oldctx);
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+
+		/* Same as in apply_change(). */
+		peek.cursor = start;
+		rel = spock_relation_lookup(spock_peek_change_relid(&peek));
+		if (rel != NULL)
+			rel->rel = NULL;
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldctx);
+	CurrentResourceOwner = oldowner;
+
+	return result;
+}
+
+/*
+ * Record the change which failed to apply in spock.apply_errors, as part of
+ * the remote transaction being applied.
+ */
+static void
+apply_error_record(StringInfo s, int start, char action,
+				   ErrorData *edata)
+{
+	const char *action_name;
+	char	   *nspname = NULL;
+	char	   *relname = NULL;
+	char	   *tuple;
+	RangeVar   *rv;
+	Relation	rel;
+	HeapTuple	tup;
+	Datum		values[Natts_apply_errors];
+	bool		nulls[Natts_apply_errors];
+
+	action_name = action == 'I' ? "INSERT" :
+		action == 'U' ? "UPDATE" : "DELETE";
+
+	if (errcallback_arg.rel != NULL)
+	{
+		nspname = pstrdup(errcallback_arg.rel->nspname);
+		relname = pstrdup(errcallback_arg.rel->relname);
+	}
+
+	tuple = failed_change_to_json(s, start, action);
+
+	ereport(WARNING,
+			(errmsg("skipping %s of remote transaction %u that failed to apply: %s",
+					action_name, remote_xid, edata->message),
+			 errdetail("The change was recorded in %s.%s.",
+					   EXTENSION_NAME, CATALOG_APPLY_ERRORS)));
+
+	memset(nulls, false, sizeof(nulls));
+
+	values[Anum_apply_errors_sub_id - 1] =
+		ObjectIdGetDatum(MyApplyWorker->subid);
+	values[Anum_apply_errors_remote_xid - 1] =
+		TransactionIdGetDatum(remote_xid);
+	values[Anum_apply_errors_remote_commit_lsn - 1] =
+		LSNGetDatum(replorigin_session_origin_lsn);
+	values[Anum_apply_errors_remote_commit_time - 1] =
+		TimestampTzGetDatum(replorigin_session_origin_timestamp);
+	values[Anum_apply_errors_action - 1] = CStringGetTextDatum(action_name);
+	if (nspname != NULL)
+	{
+		values[Anum_apply_errors_nspname - 1] =
+			DirectFunctionCall1(namein, CStringGetDatum(nspname));
+		values[Anum_apply_errors_relname - 1] =
+			DirectFunctionCall1(namein, CStringGetDatum(relname));
+	}
+	else
+	{
+		nulls[Anum_apply_errors_nspname - 1] = true;
+		nulls[Anum_apply_errors_relname - 1] = true;
+	}
+	if (tuple != NULL)
+		values[Anum_apply_errors_remote_tuple - 1] =
+			DirectFunctionCall1(json_in, CStringGetDatum(tuple));
+	else
+		nulls[Anum_apply_errors_remote_tuple - 1] = true;
+	values[Anum_apply_errors_error_sqlstate - 1] =
+		CStringGetTextDatum(unpack_sql_state(edata->sqlerrcode));
+	values[Anum_apply_errors_error_message - 1] =
+		CStringGetTextDatum(edata->message ? edata->message : "");
+	if (edata->detail != NULL)
+		values[Anum_apply_errors_error_detail - 1] =
+			CStringGetTextDatum(edata->detail);
+	else
+		nulls[Anum_apply_errors_error_detail - 1] = true;
+	values[Anum_apply_errors_logged_at - 1] =
+		TimestampTzGetDatum(GetCurrentTimestamp());
+
+	rv = makeRangeVar(EXTENSION_NAME, CATALOG_APPLY_ERRORS, -1);
+	rel = table_openrv(rv, RowExclusiveLock);
+	tup = heap_form_tuple(RelationGetDescr(rel), values, nulls);
+	CatalogTupleInsert(rel, tup);
+	heap_freetuple(tup);
+	table_close(rel, NoLock);
+
+	CommandCounterIncrement();
+
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.apply_errors, 1);
+}
+
+/*
+ * Is the remote relation the queue table, which carries replicated DDL?
+ */
+static bool
+remote_relation_is_queue(SpockRelation *rel)
+{
+	return strcmp(rel->nspname, EXTENSION_NAME) == 0 &&
+		strcmp(rel->relname, "queue") == 0;
+}
+
+/*
+ * Apply INSERT, UPDATE or DELETE message.
+ *
+ * With spock.isolate_apply_errors the change is applied in a subtransaction
+ * and when it fails, it's recorded in spock.apply_errors and skipped rather
+ * than failing the whole remote transaction. Errors which are likely to go
+ * away on retry (deadlocks, cancels, out of resources) still restart the
+ * worker. Inserts into the queue table carry replicated DDL and are never
+ * skipped.
+ */
+static void
+apply_change(void (*handler) (StringInfo), StringInfo s, char action)
+{
+	int				start = s->cursor;
+	ResourceOwner	oldowner;
+	SpockRelation  *rel;
+
+	if (!isolate_xact)
+	{
+		handler(s);
+		return;
+	}
+
+	rel = spock_relation_lookup(spock_peek_change_relid(s));
+	if (rel != NULL && remote_relation_is_queue(rel))
+	{
+		handler(s);
+		return;
+	}
+
+	ensure_transaction();
+	oldowner = CurrentResourceOwner;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(MessageContext);
+
+	PG_TRY();
+	{
+		handler(s);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(MessageContext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+		int			category;
+
+		MemoryContextSwitchTo(MessageContext);
+		edata = CopyErrorData();
+
+		category = ERRCODE_TO_CATEGORY(edata->sqlerrcode);
+		if (category == ERRCODE_TRANSACTION_ROLLBACK ||
+			category == ERRCODE_INSUFFICIENT_RESOURCES ||
+			category == ERRCODE_OPERATOR_INTERVENTION)
+			PG_RE_THROW();
+
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(MessageContext);
+		CurrentResourceOwner = oldowner;
+
+		/*
+		 * The rollback released the relation the handler had open, don't let
+		 * the relation cache hand it out again.
+		 */
+		if (rel != NULL)
+			rel->rel = NULL;
+
+		apply_error_record(s, start, action, edata);
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
 static void
 replication_handler(StringInfo s)
 {
@@ -1118,15 +1655,15 @@ replication_handler(StringInfo s)
 			break;
 		/* INSERT */
 		case 'I':
-			handle_insert(s);
+			apply_change(handle_insert, s, action);
 			break;
 		/* UPDATE */
 		case 'U':
-			handle_update(s);
+			apply_change(handle_update, s, action);
 			break;
 		/* DELETE */
 		case 'D':
-			handle_delete(s);
+			apply_change(handle_delete, s, action);
 			break;
 		/* STARTUP MESSAGE */
 		case 'S':
@@ -1154,28 +1691,331 @@ replication_handler(StringInfo s)
 }
 
 /*
- * Figure out which write/flush positions to report to the walsender process.
- *
- * We can't simply report back the last LSN the walsender sent us because the
- * local transaction might not yet be flushed to disk locally. Instead we
- * build a list that associates local with remote LSNs for every commit. When
- * reporting back the flush position to the sender we iterate that list and
- * check which entries on it are already locally flushed. Those we can report
- * as having been flushed.
- *
- * Returns true if there's no outstanding transactions that need to be
- * flushed.
+ * Add message to the apply delay spool.
  */
-static bool
-get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
+static void
+delay_spool_write(const char *data, int len)
 {
-	dlist_mutable_iter iter;
-	XLogRecPtr	local_flush = GetFlushRecPtr();
+	if (delay_file == NULL &&
+		delay_mem_bytes + len <= (Size) work_mem * 1024L)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(delay_context);
+		StringInfo		msg = makeStringInfo();
 
-	*write = InvalidXLogRecPtr;
-	*flush = InvalidXLogRecPtr;
+		appendBinaryStringInfo(msg, data, len);
+		delay_mem_msgs = lappend(delay_mem_msgs, msg);
+		delay_mem_bytes += len;
 
-	dlist_foreach_modify(iter, &lsn_mapping)
+		MemoryContextSwitchTo(oldctx);
+		return;
+	}
+
+	if (delay_file == NULL)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(delay_context);
+
+		/* Must survive the transactions applied meanwhile. */
+		delay_file = BufFileCreateTemp(true);
+		delay_read_fileno = delay_write_fileno = 0;
+		delay_read_offset = delay_write_offset = 0;
+
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	if (BufFileSeek(delay_file, delay_write_fileno, delay_write_offset,
+					SEEK_SET) != 0 ||
+		BufFileWrite(delay_file, &len, sizeof(len)) != sizeof(len) ||
+		BufFileWrite(delay_file, (void *) data, len) != len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to apply delay spool file: %m")));
+	BufFileTell(delay_file, &delay_write_fileno, &delay_write_offset);
+	delay_file_msgs++;
+}
+
+/*
+ * Read the oldest message from the apply delay spool into buf.
+ */
+static void
+delay_spool_read(StringInfo buf)
+{
+	int			len;
+
+	resetStringInfo(buf);
+
+	if (delay_mem_msgs != NIL)
+	{
+		StringInfo	msg = (StringInfo) linitial(delay_mem_msgs);
+
+		appendBinaryStringInfo(buf, msg->data, msg->len);
+		delay_mem_bytes -= msg->len;
+		delay_mem_msgs = list_delete_first(delay_mem_msgs);
+		pfree(msg->data);
+		pfree(msg);
+		return;
+	}
+
+	Assert(delay_file != NULL && delay_file_msgs > 0);
+
+	if (BufFileSeek(delay_file, delay_read_fileno, delay_read_offset,
+					SEEK_SET) != 0 ||
+		BufFileRead(delay_file, &len, sizeof(len)) != sizeof(len))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from apply delay spool file: %m")));
+
+	enlargeStringInfo(buf, len);
+	if (BufFileRead(delay_file, buf->data, len) != len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from apply delay spool file: %m")));
+	buf->len = len;
+	buf->data[len] = '\0';
+
+	BufFileTell(delay_file, &delay_read_fileno, &delay_read_offset);
+
+	/* Everything spilled was read, new messages can go to memory again. */
+	if (--delay_file_msgs == 0)
+	{
+		BufFileClose(delay_file);
+		delay_file = NULL;
+	}
+}
+
+/*
+ * Throw away all transactions waiting for apply_delay.
+ */
+static void
+delay_spool_reset(void)
+{
+	ListCell   *lc;
+
+	list_free_deep(delayed_xacts);
+	delayed_xacts = NIL;
+
+	foreach (lc, delay_mem_msgs)
+	{
+		StringInfo	msg = (StringInfo) lfirst(lc);
+
+		pfree(msg->data);
+		pfree(msg);
+	}
+	list_free(delay_mem_msgs);
+	delay_mem_msgs = NIL;
+	delay_mem_bytes = 0;
+
+	if (delay_file != NULL)
+	{
+		BufFileClose(delay_file);
+		delay_file = NULL;
+	}
+	delay_file_msgs = 0;
+}
+
+/*
+ * Spool the message if it belongs to a transaction that has to wait for
+ * apply_delay. Returns false if it should be applied right away.
+ */
+static bool
+apply_delay_spool(StringInfo s)
+{
+	char		action = s->data[s->cursor];
+
+	/* Only start delaying at transaction boundary. */
+	if (delayed_xacts == NIL && action != 'B')
+		return false;
+
+	if (action == 'B')
+	{
+		StringInfoData	peek = *s;
+		DelayedXact	   *dx;
+		XLogRecPtr		commit_lsn;
+		TimestampTz		commit_time;
+		TransactionId	xid;
+
+		peek.cursor++;
+		spock_read_begin(&peek, &commit_lsn, &commit_time, &xid);
+
+		/* Nothing to wait for. */
+		if (delayed_xacts == NIL &&
+			GetCurrentTimestamp() >=
+			TimestampTzPlusMilliseconds(commit_time, apply_delay))
+			return false;
+
+		if (delay_context == NULL)
+			delay_context = AllocSetContextCreate(TopMemoryContext,
+												  "ApplyDelayContext",
+												  ALLOCSET_DEFAULT_SIZES);
+
+		dx = MemoryContextAlloc(delay_context, sizeof(DelayedXact));
+		dx->commit_lsn = commit_lsn;
+		dx->commit_time = commit_time;
+		dx->complete = false;
+
+		MemoryContextSwitchTo(delay_context);
+		delayed_xacts = lappend(delayed_xacts, dx);
+		MemoryContextSwitchTo(MessageContext);
+	}
+	else if (action == 'C')
+		((DelayedXact *) llast(delayed_xacts))->complete = true;
+
+	delay_spool_write(s->data + s->cursor, s->len - s->cursor);
+
+	return true;
+}
+
+/*
+ * Apply the spooled transactions whose apply_delay has passed.
+ */
+static void
+apply_delayed_xacts(void)
+{
+	static StringInfo	buf = NULL;
+
+	Assert(!in_remote_transaction);
+
+	while (delayed_xacts != NIL && !got_SIGTERM)
+	{
+		DelayedXact	   *dx = (DelayedXact *) linitial(delayed_xacts);
+		char			action;
+
+		if (!dx->complete ||
+			GetCurrentTimestamp() <
+			TimestampTzPlusMilliseconds(dx->commit_time, apply_delay))
+			break;
+
+		if (buf == NULL)
+		{
+			MemoryContext	oldctx = MemoryContextSwitchTo(delay_context);
+
+			buf = makeStringInfo();
+			MemoryContextSwitchTo(oldctx);
+		}
+
+		do
+		{
+			StringInfoData	s;
+
+			delay_spool_read(buf);
+			action = buf->data[0];
+
+			memset(&s, 0, sizeof(StringInfoData));
+			s.data = buf->data;
+			s.len = buf->len;
+			s.maxlen = -1;
+			s.cursor = 0;
+
+			replication_handler(&s);
+		} while (action != 'C');
+
+		delayed_xacts = list_delete_first(delayed_xacts);
+		pfree(dx);
+	}
+}
+
+/*
+ * Apply the complete transactions from the relay log.
+ *
+ * Returns after a while even if there are more, so that the incoming data
+ * keeps being relayed and acknowledged.
+ */
+static void
+apply_relay_xacts(void)
+{
+	static StringInfo	buf = NULL;
+	TimestampTz			stop_at;
+
+	Assert(!in_remote_transaction);
+
+	if (buf == NULL)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+		buf = makeStringInfo();
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	stop_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										  RELAY_APPLY_BATCH_MS);
+
+	while (!got_SIGTERM && spock_relay_read(buf))
+	{
+		StringInfoData	s;
+		char			action = buf->data[0];
+
+		memset(&s, 0, sizeof(StringInfoData));
+		s.data = buf->data;
+		s.len = buf->len;
+		s.maxlen = -1;
+		s.cursor = 0;
+
+		if (action == 'B')
+		{
+			TimestampTz		now = GetCurrentTimestamp();
+			StringInfoData	peek = s;
+			XLogRecPtr		commit_lsn;
+			TimestampTz		commit_time;
+			TransactionId	xid;
+
+			peek.cursor++;
+			spock_read_begin(&peek, &commit_lsn, &commit_time, &xid);
+
+			if (apply_delay > 0 &&
+				now < TimestampTzPlusMilliseconds(commit_time, apply_delay))
+			{
+				spock_relay_unread();
+				return;
+			}
+
+			/*
+			 * Out of time for this batch, let apply_work() receive and come
+			 * back without waiting for its timeout.
+			 */
+			if (now >= stop_at)
+			{
+				spock_relay_unread();
+				SetLatch(&MyProc->procLatch);
+				return;
+			}
+		}
+
+		replication_handler(&s);
+	}
+
+	/* Relay log stays until everything in it was applied. */
+	if (!spock_relay_log && !in_remote_transaction && spock_relay_drained())
+	{
+		elog(LOG, "relay log of subscription %s applied, receiving changes directly",
+			 MySubscription->name);
+		spock_relay_remove();
+		use_relay = false;
+	}
+}
+
+/*
+ * Figure out which write/flush positions to report to the walsender process.
+ *
+ * We can't simply report back the last LSN the walsender sent us because the
+ * local transaction might not yet be flushed to disk locally. Instead we
+ * build a list that associates local with remote LSNs for every commit. When
+ * reporting back the flush position to the sender we iterate that list and
+ * check which entries on it are already locally flushed. Those we can report
+ * as having been flushed.
+ *
+ * Returns true if there's no outstanding transactions that need to be
+ * flushed.
+ */
+static bool
+get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
+{
+	dlist_mutable_iter iter;
+	XLogRecPtr	local_flush = GetFlushRecPtr();
+	TimestampTz	now = 0;
+
+	*write = InvalidXLogRecPtr;
+	*flush = InvalidXLogRecPtr;
+
+	dlist_foreach_modify(iter, &apply_stream->lsn_mapping)
 	{
 		SPKFlushPosition *pos =
 			dlist_container(SPKFlushPosition, node, iter.cur);
@@ -1184,6 +2024,15 @@ get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
 
 		if (pos->local_end <= local_flush)
 		{
+			/*
+			 * The flush is noticed only here, so the flush lag includes the
+			 * time until the next feedback round.
+			 */
+			if (now == 0)
+				now = GetCurrentTimestamp();
+			spock_lag_hist_add(&MyApplyWorker->stats.flush_lag,
+							   pos->commit_time, now);
+
 			*flush = pos->remote_end;
 			dlist_delete(iter.cur);
 			pfree(pos);
@@ -1196,13 +2045,13 @@ get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
 			 * grab the write position from there.
 			 */
 			pos = dlist_tail_element(SPKFlushPosition, node,
-									 &lsn_mapping);
+									 &apply_stream->lsn_mapping);
 			*write = pos->remote_end;
 			return false;
 		}
 	}
 
-	return dlist_is_empty(&lsn_mapping);
+	return dlist_is_empty(&apply_stream->lsn_mapping);
 }
 
 /*
@@ -1215,19 +2064,28 @@ static bool
 send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 {
 	static StringInfo	reply_message = NULL;
-
-	static XLogRecPtr last_recvpos = InvalidXLogRecPtr;
-	static XLogRecPtr last_writepos = InvalidXLogRecPtr;
-	static XLogRecPtr last_flushpos = InvalidXLogRecPtr;
+	SPKStreamState	   *stream = apply_stream;
 
 	XLogRecPtr writepos;
 	XLogRecPtr flushpos;
 
 	/* It's legal to not pass a recvpos */
-	if (recvpos < last_recvpos)
-		recvpos = last_recvpos;
+	if (recvpos < stream->last_recvpos)
+		recvpos = stream->last_recvpos;
 
-	if (get_flush_position(&writepos, &flushpos))
+	if (use_relay)
+	{
+		/* Applied and locally flushed transactions are not needed anymore. */
+		get_flush_position(&writepos, &flushpos);
+		if (flushpos != InvalidXLogRecPtr)
+			spock_relay_discard(flushpos);
+
+		/* The provider only has to keep what is not durable in relay log. */
+		flushpos = writepos = spock_relay_flush();
+		if (spock_relay_idle())
+			flushpos = writepos = recvpos;
+	}
+	else if (get_flush_position(&writepos, &flushpos))
 	{
 		/*
 		 * No outstanding transactions to flush, we can report the latest
@@ -1236,16 +2094,27 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 		flushpos = writepos = recvpos;
 	}
 
-	if (writepos < last_writepos)
-		writepos = last_writepos;
+	/* Transactions waiting for apply_delay must be sent again on reconnect. */
+	if (delayed_xacts != NIL)
+	{
+		XLogRecPtr	hold = ((DelayedXact *) linitial(delayed_xacts))->commit_lsn;
+
+		if (writepos > hold)
+			writepos = hold;
+		if (flushpos > hold)
+			flushpos = hold;
+	}
 
-	if (flushpos < last_flushpos)
-		flushpos = last_flushpos;
+	if (writepos < stream->last_writepos)
+		writepos = stream->last_writepos;
+
+	if (flushpos < stream->last_flushpos)
+		flushpos = stream->last_flushpos;
 
 	/* if we've already reported everything we're good */
 	if (!force &&
-		writepos == last_writepos &&
-		flushpos == last_flushpos)
+		writepos == stream->last_writepos &&
+		flushpos == stream->last_flushpos)
 		return true;
 
 	if (!reply_message)
@@ -1281,16 +2150,542 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 		return false;
 	}
 
-	if (recvpos > last_recvpos)
-		last_recvpos = recvpos;
-	if (writepos > last_writepos)
-		last_writepos = writepos;
-	if (flushpos > last_flushpos)
-		last_flushpos = flushpos;
+	if (recvpos > stream->last_recvpos)
+		stream->last_recvpos = recvpos;
+	if (writepos > stream->last_writepos)
+		stream->last_writepos = writepos;
+	if (flushpos > stream->last_flushpos)
+		stream->last_flushpos = flushpos;
+
+	return true;
+}
+
+/*
+ * Prefetch the heap pages which the UPDATE or DELETE in given copy data
+ * message is going to modify.
+ *
+ * Returns false for a message the look-ahead must not go past because it
+ * can change how the messages after it are decoded: RELATION, an insert
+ * into the queue table (replicated DDL), the end of the transaction or
+ * anything else that is not a plain row change.
+ */
+static bool
+apply_prefetch_message(char *copybuf, int len)
+{
+	StringInfoData	s;
+	SpockRelation  *rel;
+	SpockTupleData	oldtup;
+	SpockTupleData	newtup;
+	bool			hasoldtup;
+	char			action;
+
+	memset(&s, 0, sizeof(StringInfoData));
+	s.data = copybuf;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 0;
+
+	/* Keepalives don't affect the changes around them. */
+	if (pq_getmsgbyte(&s) != 'w')
+		return true;
+	pq_getmsgint64(&s);		/* start_lsn */
+	pq_getmsgint64(&s);		/* end_lsn */
+	pq_getmsgint64(&s);		/* sendTime */
+
+	action = pq_getmsgbyte(&s);
+	if (action == 'O')
+		return true;
+	if (action != 'I' && action != 'U' && action != 'D')
+		return false;
+
+	/* Relation message may still be ahead of us. */
+	rel = spock_relation_lookup(spock_peek_change_relid(&s));
+	if (rel == NULL)
+		return false;
+
+	if (action == 'I')
+		return !remote_relation_is_queue(rel);
+
+	/*
+	 * Relation still open for the preceding inserts belongs to the apply, it
+	 * must not be closed here.
+	 */
+	if (rel->rel != NULL)
+		return true;
+
+	prefetch_rel = rel;
+	if (action == 'U')
+	{
+		rel = spock_read_update(&s, RowExclusiveLock, &hasoldtup, &oldtup,
+								&newtup);
+		spock_tuple_prefetch_replidx(rel->rel, hasoldtup ? &oldtup : &newtup);
+	}
+	else
+	{
+		rel = spock_read_delete(&s, RowExclusiveLock, &oldtup);
+		spock_tuple_prefetch_replidx(rel->rel, &oldtup);
+	}
+
+	spock_relation_close(rel, NoLock);
+	prefetch_rel = NULL;
+
+	return true;
+}
+
+/*
+ * Prefetch for the messages from bufs[first] on, up to the first one the
+ * look-ahead must not go past. Returns the index of that message, or nbufs.
+ *
+ * Prefetching is only a hint, so it runs in a subtransaction and a message
+ * that fails to decode just ends the look-ahead. The error is raised when
+ * the message is applied, if at all.
+ */
+static int
+apply_prefetch_messages(char **bufs, int *lens, int first, int nbufs)
+{
+	ResourceOwner	oldowner = CurrentResourceOwner;
+	volatile int	i = first;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(MessageContext);
+
+	PG_TRY();
+	{
+		for (; i < nbufs; i++)
+		{
+			if (!apply_prefetch_message(bufs[i], lens[i]))
+				break;
+		}
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(MessageContext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+		int			category;
+
+		MemoryContextSwitchTo(MessageContext);
+		edata = CopyErrorData();
+
+		category = ERRCODE_TO_CATEGORY(edata->sqlerrcode);
+		if (category == ERRCODE_TRANSACTION_ROLLBACK ||
+			category == ERRCODE_INSUFFICIENT_RESOURCES ||
+			category == ERRCODE_OPERATOR_INTERVENTION)
+			PG_RE_THROW();
+
+		FlushErrorState();
+		FreeErrorData(edata);
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(MessageContext);
+		CurrentResourceOwner = oldowner;
+
+		/* The rollback released the relation that was being decoded. */
+		if (prefetch_rel != NULL)
+			prefetch_rel->rel = NULL;
+		prefetch_rel = NULL;
+	}
+	PG_END_TRY();
+
+	return i;
+}
+
+/*
+ * Process one copy data message received from the provider.
+ */
+static void
+apply_process_message(char *copybuf, int len, XLogRecPtr *last_received)
+{
+	int c;
+	StringInfoData s;
+
+	pg_atomic_fetch_add_u64(&MyApplyWorker->stats.bytes_received, len);
+
+	/*
+	 * We're using a StringInfo to wrap existing data here, as a
+	 * cursor. We init it manually to avoid a redundant allocation.
+	 */
+	memset(&s, 0, sizeof(StringInfoData));
+	s.data = copybuf;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 0;
+
+	c = pq_getmsgbyte(&s);
+
+	if (c == 'w')
+	{
+		XLogRecPtr	start_lsn;
+		XLogRecPtr	end_lsn;
+
+		start_lsn = pq_getmsgint64(&s);
+		end_lsn = pq_getmsgint64(&s);
+		pq_getmsgint64(&s); /* sendTime */
+
+		if (*last_received < start_lsn)
+			*last_received = start_lsn;
+
+		if (*last_received < end_lsn)
+			*last_received = end_lsn;
+
+		if (use_relay)
+			spock_relay_append(s.data + s.cursor, s.len - s.cursor);
+		else if (apply_delay <= 0 || !apply_delay_spool(&s))
+			replication_handler(&s);
+	}
+	else if (c == 'k')
+	{
+		XLogRecPtr endpos;
+		bool reply_requested;
+
+		endpos = pq_getmsgint64(&s);
+		/* timestamp = */ pq_getmsgint64(&s);
+		reply_requested = pq_getmsgbyte(&s);
+
+		send_feedback(applyconn, endpos,
+					  GetCurrentTimestamp(),
+					  reply_requested);
+
+		if (*last_received < endpos)
+			*last_received = endpos;
+
+		/* Nothing received is waiting to be applied. */
+		if (!in_remote_transaction && delayed_xacts == NIL &&
+			(!use_relay || spock_relay_drained()))
+			report_apply_idle(endpos);
+	}
+	/* other message types are purposefully ignored */
+}
+
+/*
+ * Process all messages that are available on the connection, remembering
+ * the latest upstream position seen in last_received.
+ *
+ * Up to spock.apply_prefetch_depth messages already buffered by libpq are
+ * read ahead, so that the rows the UPDATEs and DELETEs among them target can
+ * be prefetched while the preceding changes are being applied.
+ *
+ * Returns false if the apply worker lost the stream; the dedicated one
+ * reconnects and the multiplexed one hands the subscription over. Other
+ * workers ERROR.
+ */
+static bool
+apply_read_messages(XLogRecPtr *last_received)
+{
+	static char	  **bufs = NULL;
+	static int	   *lens = NULL;
+	static int		maxbufs = 0;
+	int			depth = Max(spock_apply_prefetch_depth, 1);
+	char	   *copybuf = NULL;
+	int			r;
+
+	if (depth > maxbufs)
+	{
+		MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+		if (bufs != NULL)
+		{
+			pfree(bufs);
+			pfree(lens);
+		}
+		bufs = palloc(sizeof(char *) * depth);
+		lens = palloc(sizeof(int) * depth);
+		maxbufs = depth;
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	for (;;)
+	{
+		int			nbufs = 0;
+		int			prefetched = 0;
+		int			barrier = -1;
+		int			i;
+
+		if (got_SIGTERM)
+			break;
+
+		/* We must not have fallen out of MessageContext by accident */
+		Assert(CurrentMemoryContext == MessageContext);
+
+		do
+		{
+			Assert(copybuf == NULL);
+			r = PQgetCopyData(applyconn, &copybuf, 1);
+
+			if (r > 0)
+			{
+				bufs[nbufs] = copybuf;
+				lens[nbufs++] = r;
+				copybuf = NULL;
+			}
+		} while (r > 0 && nbufs < depth);
+
+		for (i = 0; i < nbufs; i++)
+		{
+			/*
+			 * Changes are only looked at inside of a remote transaction that
+			 * is applied right away, the relay log and apply_delay spool
+			 * them instead. The look-ahead resumes once the message it
+			 * stopped at was applied.
+			 */
+			prefetched = Max(prefetched, i + 1);
+			if (barrier < i && prefetched < nbufs && in_remote_transaction &&
+				IsTransactionState() && !isolate_xact && !use_relay &&
+				apply_delay <= 0)
+			{
+				barrier = apply_prefetch_messages(bufs, lens, prefetched,
+												  nbufs);
+				prefetched = barrier + 1;
+			}
+
+			apply_process_message(bufs[i], lens[i], last_received);
+
+			/* copybuf is malloc'd not palloc'd */
+			PQfreemem(bufs[i]);
+			bufs[i] = NULL;
+		}
+
+		if ((r == -1 || r == -2) &&
+			(MySpockWorker->worker_type == SPOCK_WORKER_APPLY ||
+			 MySpockWorker->worker_type == SPOCK_WORKER_APPLY_GROUP))
+			return false;
+		else if (r == -1)
+		{
+			elog(ERROR, "data stream ended");
+		}
+		else if (r == -2)
+		{
+			elog(ERROR, "could not read COPY data: %s",
+				 PQerrorMessage(applyconn));
+		}
+		else if (r < 0)
+			elog(ERROR, "invalid COPY status %d", r);
+		else if (r == 0)
+		{
+			/* need to wait for new data */
+			break;
+		}
+
+		/* We must not have fallen out of MessageContext by accident */
+		Assert(CurrentMemoryContext == MessageContext);
+	}
+
+	return true;
+}
+
+/*
+ * Start streaming from the provider at startpos.
+ */
+static void
+apply_start_replication(PGconn *conn, XLogRecPtr startpos)
+{
+	char	   *repsets;
+	char	   *origins;
+
+	repsets = stringlist_to_identifierstr(MySubscription->replication_sets);
+	origins = stringlist_to_identifierstr(MySubscription->forward_origins);
+
+	/*
+	 * IDENTIFY_SYSTEM sets up some internal state on walsender so call it even
+	 * if we don't (yet) want to use any of the results.
+     */
+	spock_identify_system(conn, NULL, NULL, NULL, NULL);
+
+	spock_start_replication(conn, MySubscription->slot_name,
+								startpos, origins, repsets, NULL,
+								MySubscription->force_text_transfer);
+	pfree(repsets);
+	pfree(origins);
+}
+
+/*
+ * Forget everything received from the provider that was not applied yet, it
+ * will be sent again when the streaming restarts. Returns the position to
+ * restart at.
+ */
+static XLogRecPtr
+apply_discard_received(void)
+{
+	XLogRecPtr	applied_lsn;
+
+	if (IsTransactionState())
+	{
+		/* Don't leave the multi-insert state of aborted transaction behind. */
+		multi_insert_finish();
+		AbortCurrentTransaction();
+		MemoryContextSwitchTo(MessageContext);
+	}
+
+	in_remote_transaction = false;
+	remote_xid = InvalidTransactionId;
+	xact_action_counter = 0;
+	INSTR_TIME_SET_ZERO(xact_apply_start);
+	replorigin_session_origin_lsn = InvalidXLogRecPtr;
+	replorigin_session_origin_timestamp = 0;
+
+	delay_spool_reset();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	applied_lsn = replorigin_session_get_progress(false);
+	if (use_relay)
+		return spock_relay_rewind(applied_lsn);
+
+	return applied_lsn;
+}
+
+/*
+ * Try to start streaming from the provider using given interface.
+ */
+static bool
+apply_try_connect(SpockInterface *nodeif, XLogRecPtr startpos)
+{
+	MemoryContext	oldctx = CurrentMemoryContext;
+	PGconn	   *volatile conn = NULL;
+	volatile bool	connected = false;
+
+	PG_TRY();
+	{
+		conn = spock_connect_replica(nodeif->dsn, MySubscription->name,
+									 NULL);
+		apply_start_replication(conn, startpos);
+		connected = true;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldctx);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		ereport(LOG,
+				(errmsg("could not reconnect to provider %s using interface %s: %s",
+						MySubscription->origin->name, nodeif->name,
+						edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldctx);
+
+	if (!connected)
+	{
+		if (conn != NULL)
+			PQfinish(conn);
+		return false;
+	}
+
+	applyconn = conn;
 
 	return true;
 }
 
+/*
+ * Connect to the provider again after the connection was lost.
+ *
+ * Unlike a worker restart this keeps the relation cache and the rest of the
+ * worker state. The interface of the subscription is tried first, then the
+ * other interfaces of the origin node, with exponential backoff between the
+ * rounds. If the provider stays unreachable we ERROR out and leave it to the
+ * manager.
+ *
+ * A stream that breaks again soon after we reconnected counts as another
+ * failed round, so a provider which accepts the connection but then keeps
+ * failing the stream doesn't make us reconnect forever.
+ */
+static void
+apply_reconnect(XLogRecPtr *last_received)
+{
+	XLogRecPtr	startpos;
+	List	   *interfaces;
+	ListCell   *lc;
+	bool		wait_first = false;
+
+	/* Only the dedicated apply worker knows how to restart its stream. */
+	if (MySpockWorker->worker_type != SPOCK_WORKER_APPLY)
+		elog(ERROR, "connection to other side has died");
+
+	ereport(LOG,
+			(errmsg("connection to provider %s of subscription %s was lost, reconnecting",
+					MySubscription->origin->name, MySubscription->name),
+			 errdetail("%s", PQerrorMessage(applyconn))));
+
+	PQfinish(applyconn);
+	applyconn = NULL;
+
+	startpos = apply_discard_received();
+	*last_received = startpos;
+
+	StartTransactionCommand();
+	MemoryContextSwitchTo(MessageContext);
+	interfaces = list_make1(MySubscription->origin_if);
+	foreach (lc, get_node_interfaces(MySubscription->origin->id))
+	{
+		SpockInterface *nodeif = (SpockInterface *) lfirst(lc);
+
+		if (nodeif->id != MySubscription->origin_if->id)
+			interfaces = lappend(interfaces, nodeif);
+	}
+	CommitTransactionCommand();
+	MemoryContextSwitchTo(MessageContext);
+
+	if (reconnect_time != 0 &&
+		!TimestampDifferenceExceeds(reconnect_time, GetCurrentTimestamp(),
+									RECONNECT_MAX_WAIT_MS))
+		wait_first = true;
+	else
+		reconnect_wait_ms = RECONNECT_MIN_WAIT_MS;
+
+	for (;;)
+	{
+		int			rc;
+
+		if (!wait_first)
+		{
+			foreach (lc, interfaces)
+			{
+				SpockInterface *nodeif = (SpockInterface *) lfirst(lc);
+
+				if (apply_try_connect(nodeif, startpos))
+				{
+					ereport(LOG,
+							(errmsg("reconnected to provider %s of subscription %s using interface %s at %X/%X",
+									MySubscription->origin->name,
+									MySubscription->name, nodeif->name,
+									(uint32) (startpos >> 32),
+									(uint32) startpos)));
+					reconnect_time = GetCurrentTimestamp();
+					return;
+				}
+			}
+		}
+		wait_first = false;
+
+		if (reconnect_wait_ms > RECONNECT_MAX_WAIT_MS)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("could not reconnect to provider %s of subscription %s",
+							MySubscription->origin->name,
+							MySubscription->name)));
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   reconnect_wait_ms);
+		ResetLatch(&MyProc->procLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_SIGTERM)
+			proc_exit(0);
+
+		reconnect_wait_ms *= 2;
+	}
+}
+
 /*
  * Apply main loop.
  */
@@ -1298,7 +2693,6 @@ void
 apply_work(PGconn *streamConn)
 {
 	int			fd;
-	char	   *copybuf = NULL;
 	XLogRecPtr	last_received = InvalidXLogRecPtr;
 
 	applyconn = streamConn;
@@ -1318,7 +2712,7 @@ apply_work(PGconn *streamConn)
 	while (!got_SIGTERM)
 	{
 		int			rc;
-		int			r;
+		instr_time	phase_start;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
@@ -1326,10 +2720,12 @@ apply_work(PGconn *streamConn)
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
 		 */
+		spock_apply_phase_start(SPOCK_APPLY_PHASE_RECEIVE, &phase_start);
 		rc = WaitLatchOrSocket(&MyProc->procLatch,
 							   WL_SOCKET_READABLE | WL_LATCH_SET |
 							   WL_TIMEOUT | WL_POSTMASTER_DEATH,
 							   fd, 1000L);
+		spock_apply_phase_end(SPOCK_APPLY_PHASE_RECEIVE, &phase_start);
 
 		ResetLatch(&MyProc->procLatch);
 
@@ -1339,112 +2735,33 @@ apply_work(PGconn *streamConn)
 		if (rc & WL_POSTMASTER_DEATH)
 			proc_exit(1);
 
-		if (rc & WL_SOCKET_READABLE)
-			PQconsumeInput(applyconn);
-
-		if (PQstatus(applyconn) == CONNECTION_BAD)
-		{
-			elog(ERROR, "connection to other side has died");
-		}
-
-		Assert(CurrentMemoryContext == MessageContext);
-
-		for (;;)
-		{
-			if (got_SIGTERM)
-				break;
-
-			/* We must not have fallen out of MessageContext by accident */
-			Assert(CurrentMemoryContext == MessageContext);
-
-			Assert(copybuf == NULL);
-			r = PQgetCopyData(applyconn, &copybuf, 1);
-
-			if (r == -1)
-			{
-				elog(ERROR, "data stream ended");
-			}
-			else if (r == -2)
-			{
-				elog(ERROR, "could not read COPY data: %s",
-					 PQerrorMessage(applyconn));
-			}
-			else if (r < 0)
-				elog(ERROR, "invalid COPY status %d", r);
-			else if (r == 0)
-			{
-				/* need to wait for new data */
-				break;
-			}
-			else
-			{
-				int c;
-				StringInfoData s;
-
-				/*
-				 * We're using a StringInfo to wrap existing data here, as a
-				 * cursor. We init it manually to avoid a redundant allocation.
-				 */
-				memset(&s, 0, sizeof(StringInfoData));
-				s.data = copybuf;
-				s.len = r;
-				s.maxlen = -1;
-				s.cursor = 0;
-
-				c = pq_getmsgbyte(&s);
-
-				if (c == 'w')
-				{
-					XLogRecPtr	start_lsn;
-					XLogRecPtr	end_lsn;
-
-					start_lsn = pq_getmsgint64(&s);
-					end_lsn = pq_getmsgint64(&s);
-					pq_getmsgint64(&s); /* sendTime */
-
-					if (last_received < start_lsn)
-						last_received = start_lsn;
-
-					if (last_received < end_lsn)
-						last_received = end_lsn;
-
-					replication_handler(&s);
-				}
-				else if (c == 'k')
-				{
-					XLogRecPtr endpos;
-					bool reply_requested;
-
-					endpos = pq_getmsgint64(&s);
-					/* timestamp = */ pq_getmsgint64(&s);
-					reply_requested = pq_getmsgbyte(&s);
-
-					send_feedback(applyconn, endpos,
-								  GetCurrentTimestamp(),
-								  reply_requested);
-
-					if (last_received < endpos)
-						last_received = endpos;
-				}
-				/* other message types are purposefully ignored */
+		if (rc & WL_SOCKET_READABLE)
+			PQconsumeInput(applyconn);
 
-				/* copybuf is malloc'd not palloc'd */
-				if (copybuf != NULL)
-				{
-					PQfreemem(copybuf);
-					copybuf = NULL;
-				}
-			}
+		if (PQstatus(applyconn) == CONNECTION_BAD ||
+			!apply_read_messages(&last_received))
+		{
+			apply_reconnect(&last_received);
+			fd = PQsocket(applyconn);
+			continue;
+		}
 
-			/* We must not have fallen out of MessageContext by accident */
-			Assert(CurrentMemoryContext == MessageContext);
+		if (!in_remote_transaction)
+		{
+			if (use_relay)
+				apply_relay_xacts();
+			else
+				apply_delayed_xacts();
 		}
 
 		/* confirm all writes at once */
 		send_feedback(applyconn, last_received, GetCurrentTimestamp(), false);
 
+		/* Tables catch up to what was applied, not just relayed. */
 		if (!in_remote_transaction)
-			process_syncing_tables(last_received);
+			process_syncing_tables(use_relay ?
+								   replorigin_session_get_progress(false) :
+								   last_received);
 		
 		/* We must not have switched out of MessageContext by mistake */
 		Assert(CurrentMemoryContext == MessageContext);
@@ -1645,6 +2962,10 @@ process_syncing_tables(XLogRecPtr end_lsn)
 	Assert(CurrentMemoryContext == MessageContext);
 	Assert(!IsTransactionState());
 
+	/* Multiplexed worker hands the subscription to a dedicated one instead. */
+	if (MyApplyWorker->multiplexed)
+		return;
+
 	/* First check if we need to update the cached information. */
 	if (MyApplyWorker->sync_pending)
 	{
@@ -1775,7 +3096,7 @@ process_syncing_tables(XLogRecPtr end_lsn)
 		if (sync->status == SYNC_STATUS_SYNCDONE || sync->status == SYNC_STATUS_READY)
 			continue;
 
-		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
 		workers = spock_sync_find_all(MyDatabaseId, MyApplyWorker->subid);
 		foreach (wlc, workers)
 		{
@@ -1834,22 +3155,12 @@ interval_to_timeoffset(const Interval *interval)
 	return span;
 }
 
-void
-spock_apply_main(Datum main_arg)
+/*
+ * Common setup of the apply workers, once attached to shmem.
+ */
+static void
+apply_worker_init(void)
 {
-	int				slot = DatumGetInt32(main_arg);
-	PGconn		   *streamConn;
-	RepOriginId		originid;
-	XLogRecPtr		origin_startpos;
-	MemoryContext	saved_ctx;
-	char		   *repsets;
-	char		   *origins;
-
-	/* Setup shmem. */
-	spock_worker_attach(slot, SPOCK_WORKER_APPLY);
-	Assert(MySpockWorker->worker_type == SPOCK_WORKER_APPLY);
-	MyApplyWorker = &MySpockWorker->worker.apply;
-
 	/* Establish signal handlers. */
 	pqsignal(SIGTERM, handle_sigterm);
 
@@ -1893,6 +3204,23 @@ spock_apply_main(Datum main_arg)
 	 */
 	SetConfigOption("check_function_bodies", "off",
 					PGC_INTERNAL, PGC_S_OVERRIDE);
+}
+
+void
+spock_apply_main(Datum main_arg)
+{
+	int				slot = DatumGetInt32(main_arg);
+	PGconn		   *streamConn;
+	RepOriginId		originid;
+	XLogRecPtr		origin_startpos;
+	MemoryContext	saved_ctx;
+
+	/* Setup shmem. */
+	spock_worker_attach(slot, SPOCK_WORKER_APPLY);
+	Assert(MySpockWorker->worker_type == SPOCK_WORKER_APPLY);
+	MyApplyWorker = &MySpockWorker->worker.apply;
+
+	apply_worker_init();
 
 	/* Load the subscription. */
 	StartTransactionCommand();
@@ -1929,23 +3257,21 @@ spock_apply_main(Datum main_arg)
 	replorigin_session_origin = originid;
 	origin_startpos = replorigin_session_get_progress(false);
 
+	/*
+	 * Relay log also has to be used when it was just switched off, until
+	 * everything in it is applied.
+	 */
+	if (spock_relay_log || spock_relay_exists(MySubscription->id))
+	{
+		use_relay = true;
+		origin_startpos = spock_relay_open(MySubscription->id,
+										   origin_startpos);
+	}
+
 	/* Start the replication. */
 	streamConn = spock_connect_replica(MySubscription->origin_if->dsn,
 										   MySubscription->name, NULL);
-
-	repsets = stringlist_to_identifierstr(MySubscription->replication_sets);
-	origins = stringlist_to_identifierstr(MySubscription->forward_origins);
-
-	/*
-	 * IDENTIFY_SYSTEM sets up some internal state on walsender so call it even
-	 * if we don't (yet) want to use any of the results.
-     */
-	spock_identify_system(streamConn, NULL, NULL, NULL, NULL);
-
-	spock_start_replication(streamConn, MySubscription->slot_name,
-								origin_startpos, origins, repsets, NULL,
-								MySubscription->force_text_transfer);
-	pfree(repsets);
+	apply_start_replication(streamConn, origin_startpos);
 
 	CommitTransactionCommand();
 
@@ -1959,8 +3285,456 @@ spock_apply_main(Datum main_arg)
 
 	apply_work(streamConn);
 
-	PQfinish(streamConn);
+	/* The connection may have been replaced by a reconnect. */
+	PQfinish(applyconn);
 
 	/* We should only get here if we received sigTERM */
 	proc_exit(0);
 }
+
+/*
+ * Subscription served by the multiplexed apply worker.
+ */
+typedef struct ApplyGroupMember
+{
+	SpockWorker		   *worker;			/* Apply slot of the subscription. */
+	SpockSubscription  *sub;
+	PGconn			   *conn;
+	RepOriginId			originid;
+	XLogRecPtr			last_received;
+	SPKStreamState		stream;
+	uint64				rate_bytes;		/* bytes_received at rate_start */
+	TimestampTz			rate_start;
+} ApplyGroupMember;
+
+/* How often the receive rate of the subscriptions is checked. */
+#define APPLY_GROUP_RATE_INTERVAL	10000L
+/* How long one remote transaction may keep the other subscriptions waiting. */
+#define APPLY_GROUP_MAX_XACT_TIME	5000L
+
+/*
+ * Make the member the one being applied.
+ *
+ * Only called between remote transactions.
+ */
+static void
+apply_group_activate(ApplyGroupMember *member)
+{
+	Assert(!in_remote_transaction);
+
+	MyApplyWorker = &member->worker->worker.apply;
+	MySubscription = member->sub;
+	applyconn = member->conn;
+	apply_stream = &member->stream;
+	spock_relation_cache_set_subscription(member->sub->id);
+
+	if (replorigin_session_origin != member->originid)
+	{
+		if (replorigin_session_origin != InvalidRepOriginId)
+			replorigin_session_reset();
+		replorigin_session_setup(member->originid);
+		replorigin_session_origin = member->originid;
+	}
+}
+
+/*
+ * Start streaming changes of the member's subscription.
+ *
+ * Returns false if the provider can't be reached, the caller hands the
+ * subscription over to a dedicated worker which retries with its own
+ * backoff instead of failing the whole group.
+ */
+static bool
+apply_group_connect(ApplyGroupMember *member)
+{
+	MemoryContext	saved_ctx;
+	XLogRecPtr		origin_startpos;
+	PGconn	   *volatile conn = NULL;
+	volatile bool	connected = false;
+
+	StartTransactionCommand();
+	saved_ctx = MemoryContextSwitchTo(TopMemoryContext);
+	member->sub = get_subscription(member->worker->worker.apply.subid);
+	MemoryContextSwitchTo(saved_ctx);
+
+	elog(LOG, "starting multiplexed apply for subscription %s",
+		 member->sub->name);
+
+	member->originid = replorigin_by_name(member->sub->slot_name, false);
+	origin_startpos = replorigin_get_progress(member->originid, false);
+
+	CommitTransactionCommand();
+
+	dlist_init(&member->stream.lsn_mapping);
+
+	saved_ctx = CurrentMemoryContext;
+	PG_TRY();
+	{
+		char	   *repsets;
+		char	   *origins;
+
+		conn = spock_connect_replica(member->sub->origin_if->dsn,
+									 member->sub->name, NULL);
+
+		repsets = stringlist_to_identifierstr(member->sub->replication_sets);
+		origins = stringlist_to_identifierstr(member->sub->forward_origins);
+
+		spock_identify_system(conn, NULL, NULL, NULL, NULL);
+		spock_start_replication(conn, member->sub->slot_name,
+								origin_startpos, origins, repsets, NULL,
+								member->sub->force_text_transfer);
+		pfree(repsets);
+		pfree(origins);
+		connected = true;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(saved_ctx);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		ereport(LOG,
+				(errmsg("could not connect to provider %s of subscription %s: %s",
+						member->sub->origin->name, member->sub->name,
+						edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	if (!connected)
+	{
+		if (conn != NULL)
+			PQfinish(conn);
+		return false;
+	}
+
+	member->conn = conn;
+	member->last_received = InvalidXLogRecPtr;
+	member->rate_bytes =
+		pg_atomic_read_u64(&member->worker->worker.apply.stats.bytes_received);
+	member->rate_start = GetCurrentTimestamp();
+
+	return true;
+}
+
+/*
+ * Should the active member get a dedicated apply worker?
+ */
+static bool
+apply_group_should_release(ApplyGroupMember *member, TimestampTz now)
+{
+	uint64		bytes;
+	long		secs;
+	int			usecs;
+	double		elapsed;
+
+	if (MyApplyWorker->sync_pending)
+	{
+		elog(LOG, "subscription %s has tables to synchronize",
+			 member->sub->name);
+		return true;
+	}
+
+	if (!TimestampDifferenceExceeds(member->rate_start, now,
+									APPLY_GROUP_RATE_INTERVAL))
+		return false;
+
+	bytes = pg_atomic_read_u64(&MyApplyWorker->stats.bytes_received);
+	TimestampDifference(member->rate_start, now, &secs, &usecs);
+	elapsed = secs + usecs / 1000000.0;
+
+	/* Statistics were reset, start over. */
+	if (bytes < member->rate_bytes)
+		member->rate_bytes = 0;
+
+	if ((bytes - member->rate_bytes) / elapsed >
+		spock_apply_multiplex_promote_rate * 1024.0)
+	{
+		elog(LOG, "subscription %s receives %.0f kB/s",
+			 member->sub->name,
+			 (bytes - member->rate_bytes) / elapsed / 1024.0);
+		return true;
+	}
+
+	member->rate_bytes = bytes;
+	member->rate_start = now;
+
+	return false;
+}
+
+/*
+ * Stop applying the member and let the manager start a dedicated worker for
+ * it. Replay restarts from the replication origin position.
+ */
+static void
+apply_group_release(ApplyGroupMember *member)
+{
+	dlist_mutable_iter iter;
+
+	elog(LOG, "handing subscription %s over to a dedicated apply worker",
+		 member->sub->name);
+
+	/* The dedicated worker needs the replication origin. */
+	if (replorigin_session_origin == member->originid)
+	{
+		replorigin_session_reset();
+		replorigin_session_origin = InvalidRepOriginId;
+	}
+
+	PQfinish(member->conn);
+	member->conn = NULL;
+	applyconn = NULL;
+
+	dlist_foreach_modify(iter, &member->stream.lsn_mapping)
+	{
+		dlist_delete(iter.cur);
+		pfree(dlist_container(SPKFlushPosition, node, iter.cur));
+	}
+	apply_stream = &default_stream;
+
+	spock_worker_release_subscription(member->worker);
+}
+
+/*
+ * The connection of the active member broke. Forget what was received of
+ * its current remote transaction, the subscription goes to a dedicated
+ * worker that reconnects on its own while the rest of the group goes on.
+ */
+static void
+apply_group_connection_lost(ApplyGroupMember *member)
+{
+	ereport(LOG,
+			(errmsg("connection to provider %s of subscription %s was lost",
+					member->sub->origin->name, member->sub->name),
+			 errdetail("%s", PQerrorMessage(applyconn))));
+
+	apply_discard_received();
+}
+
+static WaitEventSet *
+apply_group_wait_set(ApplyGroupMember **members, int nmembers)
+{
+	WaitEventSet   *wes;
+	int				i;
+
+	wes = CreateWaitEventSet(TopMemoryContext, nmembers + 2);
+	AddWaitEventToSet(wes, WL_LATCH_SET, PGINVALID_SOCKET,
+					  &MyProc->procLatch, NULL);
+	AddWaitEventToSet(wes, WL_POSTMASTER_DEATH, PGINVALID_SOCKET,
+					  NULL, NULL);
+	for (i = 0; i < nmembers; i++)
+		AddWaitEventToSet(wes, WL_SOCKET_READABLE, PQsocket(members[i]->conn),
+						  NULL, members[i]);
+
+	return wes;
+}
+
+/*
+ * Entry point of the multiplexed apply worker.
+ *
+ * Serves several low-traffic subscriptions, waiting on all of their
+ * connections at once and switching the replication origin session
+ * between remote transactions. Subscriptions that need table
+ * synchronization, get busy or lose the connection to their provider are
+ * handed over to dedicated workers.
+ */
+void
+spock_apply_group_main(Datum main_arg)
+{
+	int				slot = DatumGetInt32(main_arg);
+	ApplyGroupMember **members;
+	int				nmembers = 0;
+	WaitEventSet   *wes = NULL;
+	WaitEvent	   *events;
+	int				nkept = 0;
+	int				i;
+
+	/* Setup shmem. */
+	spock_worker_attach(slot, SPOCK_WORKER_APPLY_GROUP);
+	Assert(MySpockWorker->worker_type == SPOCK_WORKER_APPLY_GROUP);
+
+	apply_worker_init();
+
+	/* Collect the subscriptions attached to us. */
+	members = MemoryContextAllocZero(TopMemoryContext,
+									 sizeof(ApplyGroupMember *) *
+									 SPOCK_APPLY_GROUP_MAX_SUBS);
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	for (i = 0; i < MySpockWorker->worker.group.nsubs; i++)
+	{
+		SpockWorker *apply;
+
+		apply = spock_apply_find(MySpockWorker->dboid,
+								 MySpockWorker->worker.group.subids[i]);
+		if (apply == NULL || apply->proc != MyProc)
+			continue;
+
+		members[nmembers] = MemoryContextAllocZero(TopMemoryContext,
+												   sizeof(ApplyGroupMember));
+		members[nmembers]->worker = apply;
+		nmembers++;
+	}
+	LWLockRelease(SpockCtx->lock);
+
+	/* Cache the queue relation id. */
+	StartTransactionCommand();
+	QueueRelid = get_queue_table_oid();
+	CommitTransactionCommand();
+
+	/* Providers that can't be reached are left to dedicated workers. */
+	for (i = 0; i < nmembers; i++)
+	{
+		if (apply_group_connect(members[i]))
+			members[nkept++] = members[i];
+		else
+		{
+			apply_group_release(members[i]);
+			pfree(members[i]);
+		}
+	}
+	nmembers = nkept;
+
+	events = MemoryContextAlloc(TopMemoryContext,
+								sizeof(WaitEvent) * (nmembers + 2));
+
+	/* Init the MessageContext which we use for easier cleanup. */
+	MessageContext = AllocSetContextCreate(TopMemoryContext,
+										   "MessageContext",
+										   ALLOCSET_DEFAULT_SIZES);
+
+	MemoryContextSwitchTo(MessageContext);
+
+	/* mark as idle, before starting to loop */
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	while (!got_SIGTERM && nmembers > 0)
+	{
+		int			nevents;
+
+		if (wes == NULL)
+			wes = apply_group_wait_set(members, nmembers);
+
+		nevents = WaitEventSetWait(wes, 1000L, events, nmembers + 2,
+								   PG_WAIT_EXTENSION);
+
+		ResetLatch(&MyProc->procLatch);
+
+		for (i = 0; i < nevents; i++)
+		{
+			/* emergency bailout if postmaster has died */
+			if (events[i].events & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			if (events[i].events & WL_SOCKET_READABLE)
+				PQconsumeInput(((ApplyGroupMember *) events[i].user_data)->conn);
+		}
+
+		for (i = 0; i < nmembers; i++)
+		{
+			ApplyGroupMember *member = members[i];
+			TimestampTz		xact_start;
+			bool			release = false;
+
+			if (got_SIGTERM)
+				break;
+
+			Assert(CurrentMemoryContext == MessageContext);
+
+			apply_group_activate(member);
+
+			if (PQstatus(applyconn) == CONNECTION_BAD ||
+				!apply_read_messages(&member->last_received))
+			{
+				apply_group_connection_lost(member);
+				release = true;
+			}
+
+			/*
+			 * Finish the remote transaction before switching to another
+			 * subscription, the origin session can't change in the middle.
+			 * One that takes too long is abandoned and the subscription goes
+			 * to a dedicated worker, which replays it from the start.
+			 */
+			xact_start = GetCurrentTimestamp();
+			while (!release && in_remote_transaction && !got_SIGTERM)
+			{
+				int			rc;
+				instr_time	phase_start;
+
+				if (TimestampDifferenceExceeds(xact_start, GetCurrentTimestamp(),
+											   APPLY_GROUP_MAX_XACT_TIME))
+				{
+					elog(LOG, "remote transaction of subscription %s takes longer than %ld ms",
+						 member->sub->name, APPLY_GROUP_MAX_XACT_TIME);
+					apply_discard_received();
+					release = true;
+					break;
+				}
+
+				spock_apply_phase_start(SPOCK_APPLY_PHASE_RECEIVE, &phase_start);
+				rc = WaitLatchOrSocket(&MyProc->procLatch,
+									   WL_SOCKET_READABLE | WL_LATCH_SET |
+									   WL_TIMEOUT | WL_POSTMASTER_DEATH,
+									   PQsocket(applyconn), 1000L);
+				spock_apply_phase_end(SPOCK_APPLY_PHASE_RECEIVE, &phase_start);
+
+				ResetLatch(&MyProc->procLatch);
+
+				if (rc & WL_POSTMASTER_DEATH)
+					proc_exit(1);
+
+				if (rc & WL_SOCKET_READABLE)
+					PQconsumeInput(applyconn);
+
+				if (PQstatus(applyconn) == CONNECTION_BAD ||
+					!apply_read_messages(&member->last_received))
+				{
+					apply_group_connection_lost(member);
+					release = true;
+				}
+			}
+
+			if (got_SIGTERM)
+				break;
+
+			/* confirm all writes at once */
+			if (!release)
+				send_feedback(applyconn, member->last_received,
+							  GetCurrentTimestamp(), false);
+
+			/* Cleanup the memory. */
+			MemoryContextResetAndDeleteChildren(MessageContext);
+
+			if (release ||
+				apply_group_should_release(member, GetCurrentTimestamp()))
+			{
+				apply_group_release(member);
+				pfree(member);
+				members[i] = NULL;
+			}
+		}
+
+		/* Drop released subscriptions from the wait set. */
+		nkept = 0;
+		for (i = 0; i < nmembers; i++)
+		{
+			if (members[i] != NULL)
+				members[nkept++] = members[i];
+		}
+
+		if (nkept != nmembers)
+		{
+			FreeWaitEventSet(wes);
+			wes = NULL;
+			nmembers = nkept;
+		}
+	}
+
+	/* We should only get here if we received sigTERM or released everything */
+	for (i = 0; i < nmembers; i++)
+		PQfinish(members[i]->conn);
+
+	proc_exit(0);
+}
@@ -13,8 +13,11 @@
 #ifndef SPOCK_APPLY_H
 #define SPOCK_APPLY_H
 
+#include "portability/instr_time.h"
+
 #include "spock_relcache.h"
 #include "spock_proto_native.h"
+#include "spock_worker.h"
 
 typedef void (*spock_apply_begin_fn) (void);
 typedef void (*spock_apply_commit_fn) (void);
@@ -32,4 +35,7 @@ typedef void (*spock_apply_mi_add_tuple_fn) (SpockRelation *rel,
 												 SpockTupleData *tup);
 typedef void (*spock_apply_mi_finish_fn) (SpockRelation *rel);
 
+extern void spock_apply_phase_start(SpockApplyPhase phase, instr_time *start);
+extern void spock_apply_phase_end(SpockApplyPhase phase, instr_time *start);
+
 #endif /* SPOCK_APPLY_H */
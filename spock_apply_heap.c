@@ -55,12 +55,14 @@
 #include "tcop/utility.h"
 
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/int8.h"
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
 
+#include "spock_apply.h"
 #include "spock_conflict.h"
 #include "spock_executor.h"
 #include "spock_node.h"
@@ -243,6 +245,134 @@ fill_missing_defaults(SpockRelation *rel, EState *estate,
 												NULL);
 }
 
+#if PG_VERSION_NUM >= 120000
+/*
+ * Store the decoded tuple in the slot as virtual tuple.
+ *
+ * No heap tuple is formed here, that only happens when the slot is
+ * materialized, usually by the table AM writing it. Until then the slot
+ * points to the datums of 'tup', which may be in the receive buffer.
+ */
+static void
+store_virtual_tuple(TupleTableSlot *slot, SpockTupleData *tup)
+{
+	int			natts = slot->tts_tupleDescriptor->natts;
+
+	ExecClearTuple(slot);
+	memcpy(slot->tts_values, tup->values, natts * sizeof(Datum));
+	memcpy(slot->tts_isnull, tup->nulls, natts * sizeof(bool));
+	ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * Store the local tuple in 'localslot' with the columns changed by 'newtup'
+ * replaced in the slot as virtual tuple, the equivalent of
+ * heap_modify_tuple().
+ *
+ * The slot also points to the datums of 'localslot', so it has to be
+ * materialized before 'localslot' is cleared.
+ */
+static void
+store_merged_tuple(TupleTableSlot *slot, TupleTableSlot *localslot,
+				   SpockTupleData *newtup)
+{
+	int			natts = slot->tts_tupleDescriptor->natts;
+	int			i;
+
+	slot_getallattrs(localslot);
+
+	ExecClearTuple(slot);
+	for (i = 0; i < natts; i++)
+	{
+		if (newtup->changed[i])
+		{
+			slot->tts_values[i] = newtup->values[i];
+			slot->tts_isnull[i] = newtup->nulls[i];
+		}
+		else
+		{
+			slot->tts_values[i] = localslot->tts_values[i];
+			slot->tts_isnull[i] = localslot->tts_isnull[i];
+		}
+	}
+	ExecStoreVirtualTuple(slot);
+}
+#endif
+
+/*
+ * Check if the tuple in newslot has exactly the same contents as the one in
+ * oldslot.
+ *
+ * Values are compared in their stored form, so this may report a difference
+ * between values which are equal but stored differently (e.g. compressed).
+ */
+static bool
+tuple_is_unchanged(TupleTableSlot *oldslot, TupleTableSlot *newslot)
+{
+	TupleDesc	tupdesc = oldslot->tts_tupleDescriptor;
+	int			i;
+
+	slot_getallattrs(oldslot);
+	slot_getallattrs(newslot);
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute	att = TupleDescAttr(tupdesc, i);
+
+		if (att->attisdropped)
+			continue;
+
+		if (oldslot->tts_isnull[i] != newslot->tts_isnull[i])
+			return false;
+
+		if (!oldslot->tts_isnull[i] &&
+			!datumIsEqual(oldslot->tts_values[i], newslot->tts_values[i],
+						  att->attbyval, att->attlen))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Would the update of the relation fire any AFTER ROW UPDATE trigger that
+ * the user can observe?
+ *
+ * Internal triggers of foreign keys and deferred unique constraints have
+ * nothing to check when the row does not change, so they don't count.
+ */
+static bool
+has_after_update_triggers(ResultRelInfo *relinfo)
+{
+	TriggerDesc	   *trigdesc = relinfo->ri_TrigDesc;
+	int				i;
+
+	if (trigdesc == NULL || !trigdesc->trig_update_after_row)
+		return false;
+
+	for (i = 0; i < trigdesc->numtriggers; i++)
+	{
+		Trigger	   *trigger = &trigdesc->triggers[i];
+
+		if (trigger->tgisinternal ||
+			!TRIGGER_TYPE_MATCHES(trigger->tgtype, TRIGGER_TYPE_ROW,
+								  TRIGGER_TYPE_AFTER, TRIGGER_TYPE_UPDATE))
+			continue;
+
+		if (trigger->tgenabled == TRIGGER_DISABLED)
+			continue;
+
+		if (SessionReplicationRole == SESSION_REPLICATION_ROLE_REPLICA ?
+			trigger->tgenabled == TRIGGER_FIRES_ON_ORIGIN :
+			trigger->tgenabled == TRIGGER_FIRES_ON_REPLICA)
+			continue;
+
+		return true;
+	}
+
+	return false;
+}
+
 static ApplyExecState *
 init_apply_exec_state(SpockRelation *rel)
 {
@@ -298,6 +428,7 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 	HeapTuple			remotetuple;
 	HeapTuple			applytuple;
 	SpockConflictResolution resolution;
+	instr_time			phase_start;
 	List			   *recheckIndexes = NIL;
 	MemoryContext		oldctx;
 	bool				has_before_triggers = false;
@@ -323,17 +454,24 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 	 * only normal columns. This doesn't just check the replica identity index,
 	 * but it'll prefer it and use it first.
 	 */
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_CONFLICT, &phase_start);
 	conflicts_idx_id = spock_tuple_find_conflict(aestate->estate,
 													 newtup,
 													 localslot);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_CONFLICT, &phase_start);
 
 	/* Process and store remote tuple in the slot */
 	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
 	fill_missing_defaults(rel, aestate->estate, newtup);
+#if PG_VERSION_NUM >= 120000
+	MemoryContextSwitchTo(oldctx);
+	store_virtual_tuple(aestate->slot, newtup);
+#else
 	remotetuple = heap_form_tuple(RelationGetDescr(rel->rel),
 								  newtup->values, newtup->nulls);
 	MemoryContextSwitchTo(oldctx);
 	ExecStoreHeapTuple(remotetuple, aestate->slot, true);
+#endif
 
 	if (aestate->resultRelInfo->ri_TrigDesc &&
 		aestate->resultRelInfo->ri_TrigDesc->trig_insert_before_row)
@@ -359,10 +497,8 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 
 	}
 
+#if PG_VERSION_NUM < 120000
 	/* trigger might have changed tuple */
-#if PG_VERSION_NUM >= 120000
-	remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
-#else
 	remotetuple = ExecMaterializeSlot(aestate->slot);
 #endif
 
@@ -375,6 +511,13 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 		bool				apply;
 		bool				local_origin_found;
 
+#if PG_VERSION_NUM >= 120000
+		/*
+		 * Conflict resolution works on heap tuples, only form one when there
+		 * is a conflict and let the table AM take the slot otherwise.
+		 */
+		remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
+#endif
 		local_origin_found = get_tuple_origin(TTS_TUP(localslot), &xmin,
 											  &local_origin, &local_ts);
 
@@ -427,10 +570,8 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 
 			}
 
+#if PG_VERSION_NUM < 120000
 			/* trigger might have changed tuple */
-#if PG_VERSION_NUM >= 120000
-			remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
-#else
 			remotetuple = ExecMaterializeSlot(aestate->slot);
 #endif
 
@@ -510,6 +651,7 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 	HeapTuple			remotetuple;
 	List			   *recheckIndexes = NIL;
 	MemoryContext		oldctx;
+	instr_time			phase_start;
 	Oid					replident_idx_id;
 	bool				has_before_triggers = false;
 
@@ -525,8 +667,10 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 	PushActiveSnapshot(GetTransactionSnapshot());
 
 	/* Search for existing tuple with same key */
-	found = spock_tuple_find_replidx(aestate->estate, oldtup, localslot,
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_CONFLICT, &phase_start);
+	found = spock_tuple_find_replidx(rel, aestate->estate, oldtup, localslot,
 										 &replident_idx_id);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_CONFLICT, &phase_start);
 
 	/*
 	 * Tuple found, update the local tuple.
@@ -546,6 +690,10 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 		/* Process and store remote tuple in the slot */
 		oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
 		fill_missing_defaults(rel, aestate->estate, newtup);
+#if PG_VERSION_NUM >= 120000
+		MemoryContextSwitchTo(oldctx);
+		store_merged_tuple(aestate->slot, localslot, newtup);
+#else
 		remotetuple = heap_modify_tuple(TTS_TUP(localslot),
 										RelationGetDescr(rel->rel),
 										newtup->values,
@@ -553,6 +701,7 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 										newtup->changed);
 		MemoryContextSwitchTo(oldctx);
 		ExecStoreHeapTuple(remotetuple, aestate->slot, true);
+#endif
 
 		if (aestate->resultRelInfo->ri_TrigDesc &&
 			aestate->resultRelInfo->ri_TrigDesc->trig_update_before_row)
@@ -581,10 +730,8 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 			}
 		}
 
+#if PG_VERSION_NUM < 120000
 		/* trigger might have changed tuple */
-#if PG_VERSION_NUM >= 120000
-		remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
-#else
 		remotetuple = ExecMaterializeSlot(aestate->slot);
 #endif
 		local_origin_found = get_tuple_origin(TTS_TUP(localslot), &xmin,
@@ -600,6 +747,10 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 		{
 			SpockConflictResolution resolution;
 
+#if PG_VERSION_NUM >= 120000
+			/* Only conflict resolution needs the heap tuple. */
+			remotetuple = ExecFetchSlotHeapTuple(aestate->slot, true, NULL);
+#endif
 			apply = try_resolve_conflict(rel->rel, TTS_TUP(localslot),
 										 remotetuple, &applytuple,
 										 &resolution);
@@ -617,7 +768,32 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 		else
 		{
 			apply = true;
+#if PG_VERSION_NUM < 120000
 			applytuple = remotetuple;
+#endif
+		}
+
+		/*
+		 * Don't write a new row version if the update doesn't change
+		 * anything. BEFORE triggers have already run at this point and we
+		 * still do the update if there are AFTER triggers to fire.
+		 *
+		 * Skipping leaves the origin and commit timestamp of the local row as
+		 * they were, which later conflict resolution relies on, so only skip
+		 * when the row already comes from this origin or isn't older than
+		 * the remote change.
+		 */
+		if (apply &&
+			(xmin == GetTopTransactionId() ||
+			 local_origin == replorigin_session_origin ||
+			 (local_origin_found &&
+			  local_ts >= replorigin_session_origin_timestamp)) &&
+			tuple_is_unchanged(localslot, aestate->slot) &&
+			!has_after_update_triggers(aestate->resultRelInfo))
+		{
+			apply = false;
+			if (MyApplyWorker != NULL)
+				pg_atomic_fetch_add_u64(&MyApplyWorker->stats.noop_updates, 1);
 		}
 
 		if (apply)
@@ -699,6 +875,8 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 	TupleTableSlot	   *localslot;
 	Oid					replident_idx_id;
 	bool				has_before_triggers = false;
+	bool				found;
+	instr_time			phase_start;
 
 	/* Initialize the executor state. */
 	aestate = init_apply_exec_state(rel);
@@ -711,8 +889,12 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	if (spock_tuple_find_replidx(aestate->estate, oldtup, localslot,
-									 &replident_idx_id))
+	spock_apply_phase_start(SPOCK_APPLY_PHASE_CONFLICT, &phase_start);
+	found = spock_tuple_find_replidx(rel, aestate->estate, oldtup, localslot,
+									 &replident_idx_id);
+	spock_apply_phase_end(SPOCK_APPLY_PHASE_CONFLICT, &phase_start);
+
+	if (found)
 	{
 		if (aestate->resultRelInfo->ri_TrigDesc &&
 			aestate->resultRelInfo->ri_TrigDesc->trig_delete_before_row)
@@ -939,7 +1121,9 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 {
 	MemoryContext	oldctx;
 	ApplyExecState *aestate;
+#if PG_VERSION_NUM < 120000
 	HeapTuple		remotetuple;
+#endif
 	TupleTableSlot *slot;
 
 	spock_apply_heap_mi_start(rel);
@@ -965,12 +1149,28 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 
 	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
 	fill_missing_defaults(rel, aestate->estate, tup);
+#if PG_VERSION_NUM >= 120000
+	MemoryContextSwitchTo(TopTransactionContext);
+
+	/*
+	 * Every buffered tuple needs its own slot. They are created as needed and
+	 * reused by the following batches.
+	 */
+	slot = spkmistate->buffered_tuples[spkmistate->nbuffered_tuples];
+	if (slot == NULL)
+	{
+		slot = table_slot_create(rel->rel, &aestate->estate->es_tupleTable);
+		spkmistate->buffered_tuples[spkmistate->nbuffered_tuples] = slot;
+	}
+	store_virtual_tuple(slot, tup);
+#else
 	remotetuple = heap_form_tuple(RelationGetDescr(rel->rel),
 								  tup->values, tup->nulls);
 	MemoryContextSwitchTo(TopTransactionContext);
 	slot = aestate->slot;
 	/* Store the tuple in slot, but make sure it's not freed. */
 	ExecStoreHeapTuple(remotetuple, slot, false);
+#endif
 
 	if (aestate->resultRelInfo->ri_TrigDesc &&
 		aestate->resultRelInfo->ri_TrigDesc->trig_insert_before_row)
@@ -1001,13 +1201,13 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 		ExecConstraints(aestate->resultRelInfo, slot,
 						aestate->estate);
 
-	spkmistate->buffered_tuples[spkmistate->nbuffered_tuples++] =
 #if PG_VERSION_NUM >= 120000
-		slot
+	/* The received data is gone by the time the buffer is flushed. */
+	ExecMaterializeSlot(slot);
+	spkmistate->nbuffered_tuples++;
 #else
-		remotetuple
+	spkmistate->buffered_tuples[spkmistate->nbuffered_tuples++] = remotetuple;
 #endif
-		;
 	MemoryContextSwitchTo(oldctx);
 }
 
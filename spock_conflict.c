@@ -17,11 +17,13 @@
 #include "miscadmin.h"
 
 #include "access/commit_ts.h"
+#include "access/genam.h"
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/transam.h"
 #include "access/xact.h"
 
+#include "catalog/pg_am.h"
 #include "catalog/pg_type.h"
 
 #include "executor/executor.h"
@@ -46,7 +48,9 @@
 #include "utils/typcache.h"
 
 #include "spock_conflict.h"
+#include "spock_monitoring.h"
 #include "spock_proto_native.h"
+#include "spock_worker.h"
 
 int		spock_conflict_resolver = SPOCK_RESOLVE_APPLY_REMOTE;
 int		spock_conflict_log_level = LOG;
@@ -127,14 +131,152 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, SpockTupleData
 	return hasnulls;
 }
 
+/*
+ * Does the tuple in slot have the same values as 'tup' in all of the
+ * attributes in 'attrs' (zero based)?
+ */
+static bool
+tuple_matches_slot(TupleTableSlot *slot, SpockTupleData *tup,
+				   Bitmapset *attrs)
+{
+	TupleDesc	desc = slot->tts_tupleDescriptor;
+	int			attoff = -1;
+
+	while ((attoff = bms_next_member(attrs, attoff)) >= 0)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, attoff);
+		TypeCacheEntry *typentry;
+		Datum		value;
+		bool		isnull;
+
+		value = slot_getattr(slot, attoff + 1, &isnull);
+
+		if (isnull != tup->nulls[attoff])
+			return false;
+		if (isnull)
+			continue;
+
+		typentry = lookup_type_cache(att->atttypid, TYPECACHE_EQ_OPR_FINFO);
+		if (!DatumGetBool(FunctionCall2Coll(&typentry->eq_opr_finfo,
+											att->attcollation,
+											value,
+											tup->values[attoff])))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Wait for any concurrent transaction that affects the tuple found with the
+ * dirty snapshot 'snap' and lock it with lockmode.
+ *
+ * Returns false if the tuple was concurrently modified and the caller has to
+ * search for it again.
+ */
+static bool
+lock_found_tuple(Relation rel, Snapshot snap, LockTupleMode lockmode,
+				 TupleTableSlot *slot)
+{
+	TransactionId xwait;
+#if PG_VERSION_NUM >= 120000
+	TM_FailureData tmfd;
+	TM_Result res;
+#else
+	Buffer buf;
+	HeapUpdateFailureData hufd;
+	HTSU_Result res;
+	HeapTupleData locktup;
+#endif
+
+	ExecMaterializeSlot(slot);
+
+	/*
+	 * Did any concurrent txn affect the tuple? (See
+	 * HeapTupleSatisfiesDirty for how we get this).
+	 */
+	xwait = TransactionIdIsValid(snap->xmin) ?
+		snap->xmin : snap->xmax;
+
+	if (TransactionIdIsValid(xwait))
+	{
+		/* Wait for the specified transaction to commit or abort */
+		XactLockTableWait(xwait, NULL, NULL, XLTW_None);
+		return false;
+	}
+
+	/* Matching tuple found, no concurrent txns modifying it */
+#if PG_VERSION_NUM < 120000
+	ItemPointerCopy(&slot->tts_tuple->t_self, &locktup.t_self);
+#endif
+
+	PushActiveSnapshot(GetLatestSnapshot());
+
+#if PG_VERSION_NUM >= 120000
+	res = table_tuple_lock(rel, &(slot->tts_tid), GetLatestSnapshot(),
+						   slot,
+						   GetCurrentCommandId(false),
+						   lockmode,
+						   LockWaitBlock,
+						   0 /* don't follow updates */ ,
+						   &tmfd);
+#else
+	res = heap_lock_tuple(rel, &locktup, GetCurrentCommandId(false),
+						  lockmode,
+						  false /* wait */,
+						  false /* don't follow updates */,
+						  &buf, &hufd);
+	/* the tuple slot already has the buffer pinned */
+	ReleaseBuffer(buf);
+#endif
+
+	PopActiveSnapshot();
+
+	switch (res)
+	{
+#if PG_VERSION_NUM >= 120000
+		case TM_Ok:
+#else
+		case HeapTupleMayBeUpdated:
+#endif
+			/* lock was successfully acquired */
+			break;
+#if PG_VERSION_NUM >= 120000
+		case TM_Updated:
+#else
+		case HeapTupleUpdated:
+#endif
+			/*
+			 * We lost a race between when we looked up the tuple and
+			 * checked for concurrent modifying txns and when we tried to
+			 * lock the matched tuple.
+			 *
+			 * XXX: Improve handling here.
+			 */
+			ereport(LOG,
+					(errcode(ERRCODE_T_R_SERIALIZATION_FAILURE),
+					 errmsg("concurrent update, retrying")));
+			return false;
+		default:
+			elog(ERROR, "unexpected HTSU_Result after locking: %u", res);
+			break;
+	}
+
+	return true;
+}
+
 /*
  * Search the index 'idxrel' for a tuple identified by 'skey' in 'rel'.
  *
+ * If 'attrs' is given, only a tuple matching 'tup' in those attributes is
+ * accepted, for indexes that don't cover all of them.
+ *
  * If a matching tuple is found lock it with lockmode, fill the slot with its
  * contents and return true, false is returned otherwise.
  */
 static bool
 find_index_tuple(ScanKey skey, Relation rel, Relation idxrel,
+				 SpockTupleData *tup, Bitmapset *attrs,
 				 LockTupleMode lockmode, TupleTableSlot *slot)
 {
 #if PG_VERSION_NUM < 120000
@@ -143,7 +285,6 @@ find_index_tuple(ScanKey skey, Relation rel, Relation idxrel,
 	bool		found;
 	IndexScanDesc scan;
 	SnapshotData snap;
-	TransactionId xwait;
 
 	/*
 	 * We need SnapshotDirty because we're doing uniqueness lookups that must
@@ -162,140 +303,228 @@ retry:
 				 NULL, 0);
 
 #if PG_VERSION_NUM >= 120000
-	if (index_getnext_slot(scan, ForwardScanDirection, slot))
+	while (index_getnext_slot(scan, ForwardScanDirection, slot))
 #else
-	if ((scantuple = index_getnext(scan, ForwardScanDirection)) != NULL)
+	while ((scantuple = index_getnext(scan, ForwardScanDirection)) != NULL)
 #endif
 	{
-		found = true;
 #if PG_VERSION_NUM < 120000
 		ExecStoreTuple(scantuple, slot, InvalidBuffer, false);
 #endif
-		ExecMaterializeSlot(slot);
-
-		/*
-		 * Did any concurrent txn affect the tuple? (See
-		 * HeapTupleSatisfiesDirty for how we get this).
-		 */
-		xwait = TransactionIdIsValid(snap.xmin) ?
-			snap.xmin : snap.xmax;
+		if (attrs != NULL && !tuple_matches_slot(slot, tup, attrs))
+			continue;
 
-		if (TransactionIdIsValid(xwait))
-		{
-			/* Wait for the specified transaction to commit or abort */
-			XactLockTableWait(xwait, NULL, NULL, XLTW_None);
+		if (!lock_found_tuple(rel, &snap, lockmode, slot))
 			goto retry;
-		}
+
+		found = true;
+		break;
 	}
 
-	/* Matching tuple found, no concurrent txns modifying it */
-	if (found)
-	{
-#if PG_VERSION_NUM >= 120000
-		TM_FailureData tmfd;
-		TM_Result res;
-#else
-		Buffer buf;
-		HeapUpdateFailureData hufd;
-		HTSU_Result res;
-		HeapTupleData locktup;
+	index_endscan(scan);
+
+	return found;
+}
 
-		ItemPointerCopy(&slot->tts_tuple->t_self, &locktup.t_self);
+/*
+ * Search the whole relation 'rel' for a tuple matching 'tup' in 'attrs'.
+ *
+ * Same as find_index_tuple otherwise.
+ */
+static bool
+find_seq_tuple(Relation rel, SpockTupleData *tup, Bitmapset *attrs,
+			   LockTupleMode lockmode, TupleTableSlot *slot)
+{
+#if PG_VERSION_NUM < 120000
+	HeapTuple	scantuple;
 #endif
+	bool		found;
+	TableScanDesc scan;
+	SnapshotData snap;
 
-		PushActiveSnapshot(GetLatestSnapshot());
+	InitDirtySnapshot(snap);
+	scan = table_beginscan(rel, &snap, 0, NULL);
+
+retry:
+	found = false;
 
 #if PG_VERSION_NUM >= 120000
-		res = table_tuple_lock(rel, &(slot->tts_tid), GetLatestSnapshot(),
-							   slot,
-							   GetCurrentCommandId(false),
-							   lockmode,
-							   LockWaitBlock,
-							   0 /* don't follow updates */ ,
-							   &tmfd);
+	table_rescan(scan, NULL);
+	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
 #else
-		res = heap_lock_tuple(rel, &locktup, GetCurrentCommandId(false),
-							  lockmode,
-							  false /* wait */,
-							  false /* don't follow updates */,
-							  &buf, &hufd);
-		/* the tuple slot already has the buffer pinned */
-		ReleaseBuffer(buf);
+	heap_rescan(scan, NULL);
+	while ((scantuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+#endif
+	{
+#if PG_VERSION_NUM < 120000
+		ExecStoreTuple(scantuple, slot, InvalidBuffer, false);
 #endif
+		if (!tuple_matches_slot(slot, tup, attrs))
+			continue;
+
+		if (!lock_found_tuple(rel, &snap, lockmode, slot))
+			goto retry;
+
+		found = true;
+		break;
+	}
+
+	table_endscan(scan);
+
+	return found;
+}
+
+/*
+ * Attributes of the local relation the tuple received for a table without
+ * a local REPLICA IDENTITY index can be matched on.
+ *
+ * These are the remote replica identity attributes present in the tuple,
+ * which for REPLICA IDENTITY FULL on the provider is the whole row. Types
+ * without an equality operator can't be compared and are left out.
+ */
+static Bitmapset *
+replident_match_attrs(SpockRelation *rel, SpockTupleData *tup)
+{
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	Bitmapset  *attrs = NULL;
+	int			i;
+
+	if (rel->attidentity == NULL)
+		return NULL;
+
+	for (i = 0; i < rel->natts; i++)
+	{
+		int			attoff = rel->attmap[i];
+		Form_pg_attribute att = TupleDescAttr(desc, attoff);
+		TypeCacheEntry *typentry;
+
+		if (!rel->attidentity[i] || !tup->changed[attoff] ||
+			att->attisdropped)
+			continue;
+
+		typentry = lookup_type_cache(att->atttypid, TYPECACHE_EQ_OPR);
+		if (!OidIsValid(typentry->eq_opr))
+			continue;
+
+		attrs = bms_add_member(attrs, attoff);
+	}
+
+	return attrs;
+}
+
+/*
+ * Find the best index to search for a tuple matching in 'attrs'.
+ *
+ * Only valid btree indexes without expressions and predicate whose key
+ * columns are all in 'attrs' and not NULL in the tuple can be used. Unique
+ * indexes are preferred, then the ones with more key columns. The index is
+ * returned open, or NULL if there is none usable.
+ */
+static Relation
+find_usable_index(Relation rel, SpockTupleData *tup, Bitmapset *attrs)
+{
+	List	   *indexes = RelationGetIndexList(rel);
+	ListCell   *lc;
+	Relation	best = NULL;
+
+	foreach (lc, indexes)
+	{
+		Relation	idxrel = index_open(lfirst_oid(lc), RowExclusiveLock);
+		Form_pg_index idx = idxrel->rd_index;
+		int			nkeys = IndexRelationGetNumberOfKeyAttributes(idxrel);
+		bool		usable;
+		int			i;
+
+		usable = idx->indisvalid && idx->indislive &&
+			idxrel->rd_rel->relam == BTREE_AM_OID &&
+			spk_heap_attisnull(idxrel->rd_indextuple, Anum_pg_index_indexprs,
+							   NULL) &&
+			spk_heap_attisnull(idxrel->rd_indextuple, Anum_pg_index_indpred,
+							   NULL);
+
+		for (i = 0; usable && i < nkeys; i++)
+		{
+			int			attoff = idx->indkey.values[i] - 1;
 
-		PopActiveSnapshot();
+			if (attoff < 0 || !bms_is_member(attoff, attrs) ||
+				tup->nulls[attoff])
+				usable = false;
+		}
 
-		switch (res)
+		if (usable &&
+			(best == NULL ||
+			 (idx->indisunique && !best->rd_index->indisunique) ||
+			 (idx->indisunique == best->rd_index->indisunique &&
+			  nkeys > IndexRelationGetNumberOfKeyAttributes(best))))
 		{
-#if PG_VERSION_NUM >= 120000
-			case TM_Ok:
-#else
-			case HeapTupleMayBeUpdated:
-#endif
-				/* lock was successfully acquired */
-				break;
-#if PG_VERSION_NUM >= 120000
-			case TM_Updated:
-#else
-			case HeapTupleUpdated:
-#endif
-				/*
-				 * We lost a race between when we looked up the tuple and
-				 * checked for concurrent modifying txns and when we tried to
-				 * lock the matched tuple.
-				 *
-				 * XXX: Improve handling here.
-				 */
-				ereport(LOG,
-						(errcode(ERRCODE_T_R_SERIALIZATION_FAILURE),
-						 errmsg("concurrent update, retrying")));
-				goto retry;
-			default:
-				elog(ERROR, "unexpected HTSU_Result after locking: %u", res);
-				break;
+			if (best != NULL)
+				index_close(best, NoLock);
+			best = idxrel;
 		}
+		else
+			index_close(idxrel, NoLock);
 	}
 
-	index_endscan(scan);
+	list_free(indexes);
 
-	return found;
+	return best;
 }
 
 /*
  * Find tuple using REPLICA IDENTITY index and output it in 'oldslot'
  * if found.
  *
- * The index oid is also output.
+ * Tables without REPLICA IDENTITY index, for example ones with REPLICA
+ * IDENTITY FULL, are searched using the best other usable index and the
+ * candidates are checked against the whole tuple, or sequentially if there
+ * is no such index.
+ *
+ * The oid of the index used is also output, InvalidOid for sequential
+ * search.
  */
 bool
-spock_tuple_find_replidx(EState *estate, SpockTupleData *tuple,
-							 TupleTableSlot *oldslot, Oid *idxrelid)
+spock_tuple_find_replidx(SpockRelation *rel, EState *estate,
+						 SpockTupleData *tuple, TupleTableSlot *oldslot,
+						 Oid *idxrelid)
 {
 	ResultRelInfo  *relinfo = estate->es_result_relation_info;
 	Oid				idxoid;
 	Relation		idxrel;
 	ScanKeyData		index_key[INDEX_MAX_KEYS];
+	Bitmapset	   *attrs = NULL;
 	bool			found;
 
 	/* Open REPLICA IDENTITY index.*/
 	idxoid = RelationGetReplicaIndex(relinfo->ri_RelationDesc);
-	if (!OidIsValid(idxoid))
+	if (OidIsValid(idxoid))
+		idxrel = index_open(idxoid, RowExclusiveLock);
+	else
 	{
-		ereport(ERROR,
-				(errmsg("could not find REPLICA IDENTITY index for table %s with oid %u",
-						get_rel_name(RelationGetRelid(relinfo->ri_RelationDesc)),
-						RelationGetRelid(relinfo->ri_RelationDesc)),
-				 errhint("The REPLICA IDENTITY index is usually the PRIMARY KEY. See the PostgreSQL docs for ALTER TABLE ... REPLICA IDENTITY")));
+		attrs = replident_match_attrs(rel, tuple);
+		if (attrs == NULL)
+			ereport(ERROR,
+					(errmsg("could not find REPLICA IDENTITY index for table %s with oid %u",
+							get_rel_name(RelationGetRelid(relinfo->ri_RelationDesc)),
+							RelationGetRelid(relinfo->ri_RelationDesc)),
+					 errhint("The REPLICA IDENTITY index is usually the PRIMARY KEY. See the PostgreSQL docs for ALTER TABLE ... REPLICA IDENTITY")));
+
+		idxrel = find_usable_index(relinfo->ri_RelationDesc, tuple, attrs);
+		if (idxrel == NULL)
+		{
+			*idxrelid = InvalidOid;
+			return find_seq_tuple(relinfo->ri_RelationDesc, tuple, attrs,
+								  LockTupleExclusive, oldslot);
+		}
+		idxoid = RelationGetRelid(idxrel);
 	}
 	*idxrelid = idxoid;
-	idxrel = index_open(idxoid, RowExclusiveLock);
 
 	/* Build scan key for just opened index*/
 	build_index_scan_key(index_key, relinfo->ri_RelationDesc, idxrel, tuple);
 
 	/* Try to find the row and store any matching row in 'oldslot'. */
 	found = find_index_tuple(index_key, relinfo->ri_RelationDesc, idxrel,
-							 LockTupleExclusive, oldslot);
+							 tuple, attrs, LockTupleExclusive, oldslot);
 
 	/* Don't release lock until commit. */
 	index_close(idxrel, NoLock);
@@ -303,6 +532,49 @@ spock_tuple_find_replidx(EState *estate, SpockTupleData *tuple,
 	return found;
 }
 
+/*
+ * Issue prefetch of the heap pages holding the tuple that a later
+ * spock_tuple_find_replidx() call will be looking for.
+ *
+ * Only the index is read synchronously, the heap pages are read in the
+ * background while the preceding changes are being applied.
+ */
+void
+spock_tuple_prefetch_replidx(Relation rel, SpockTupleData *tuple)
+{
+	Oid				idxoid;
+	Relation		idxrel;
+	ScanKeyData		index_key[INDEX_MAX_KEYS];
+	IndexScanDesc	scan;
+	SnapshotData	snap;
+	ItemPointer		tid;
+
+	idxoid = RelationGetReplicaIndex(rel);
+	if (!OidIsValid(idxoid))
+		return;
+
+	/* Same lock the apply will take, so that there is no lock upgrade. */
+	idxrel = index_open(idxoid, RowExclusiveLock);
+
+	if (!build_index_scan_key(index_key, rel, idxrel, tuple))
+	{
+		InitDirtySnapshot(snap);
+		scan = index_beginscan(rel, idxrel, &snap,
+							   IndexRelationGetNumberOfKeyAttributes(idxrel),
+							   0);
+		index_rescan(scan, index_key,
+					 IndexRelationGetNumberOfKeyAttributes(idxrel), NULL, 0);
+
+		/* Dead versions of the row will be visited by the apply too. */
+		while ((tid = index_getnext_tid(scan, ForwardScanDirection)) != NULL)
+			PrefetchBuffer(rel, MAIN_FORKNUM, ItemPointerGetBlockNumber(tid));
+
+		index_endscan(scan);
+	}
+
+	index_close(idxrel, NoLock);
+}
+
 /*
  * Find the tuple in a table using any index and returns the conflicting
  * index's oid, if any conflict found.
@@ -347,7 +619,7 @@ spock_tuple_find_conflict(EState *estate, SpockTupleData *tuple,
 		Relation	idxrel = index_open(replidxoid, RowExclusiveLock);
 		build_index_scan_key(index_key, relinfo->ri_RelationDesc, idxrel, tuple);
 		found = find_index_tuple(index_key, relinfo->ri_RelationDesc, idxrel,
-							 LockTupleExclusive, outslot);
+								 NULL, NULL, LockTupleExclusive, outslot);
 		index_close(idxrel, NoLock);
 		if (found)
 			return replidxoid;
@@ -405,7 +677,8 @@ spock_tuple_find_conflict(EState *estate, SpockTupleData *tuple,
 
 		/* Try to find conflicting row and store in 'outslot' */
 		found = find_index_tuple(index_key, relinfo->ri_RelationDesc,
-								 idxrel, LockTupleExclusive, outslot);
+								 idxrel, NULL, NULL, LockTupleExclusive,
+								 outslot);
 
 		if (found)
 		{
@@ -659,6 +932,15 @@ spock_report_conflict(SpockConflictType conflict_type,
 	const char *idxname = "(unknown)";
 	const char *qualrelname;
 
+	if (MyApplyWorker != NULL)
+	{
+		pg_atomic_fetch_add_u64(&MyApplyWorker->stats.conflicts[conflict_type],
+								1);
+		pg_atomic_fetch_add_u64(&MyApplyWorker->stats.resolutions[resolution],
+								1);
+	}
+	spock_relstat_report_conflict(RelationGetRelid(rel->rel));
+
 	memset(local_tup_ts_str, 0, MAXDATELEN);
 	if (found_local_origin)
 		strcpy(local_tup_ts_str,
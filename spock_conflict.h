@@ -48,11 +48,14 @@ typedef enum SpockConflictType
 	CONFLICT_DELETE_DELETE
 } SpockConflictType;
 
-extern bool spock_tuple_find_replidx(EState *estate,
+extern bool spock_tuple_find_replidx(SpockRelation *rel, EState *estate,
 										 SpockTupleData *tuple,
 										 TupleTableSlot *oldslot,
 										 Oid *idxrelid);
 
+extern void spock_tuple_prefetch_replidx(Relation rel,
+										 SpockTupleData *tuple);
+
 extern Oid spock_tuple_find_conflict(EState *estate,
 										 SpockTupleData *tuple,
 										 TupleTableSlot *oldslot);
@@ -66,7 +66,9 @@
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/pg_lsn.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 #include "pgstat.h"
 
@@ -74,6 +76,7 @@
 #include "spock_node.h"
 #include "spock_executor.h"
 #include "spock_queue.h"
+#include "spock_relay.h"
 #include "spock_relcache.h"
 #include "spock_repset.h"
 #include "spock_rpc.h"
@@ -108,6 +111,7 @@ PG_FUNCTION_INFO_V1(spock_show_subscription_status);
 
 PG_FUNCTION_INFO_V1(spock_wait_for_subscription_sync_complete);
 PG_FUNCTION_INFO_V1(spock_wait_for_table_sync_complete);
+PG_FUNCTION_INFO_V1(spock_wait_for_apply);
 
 /* Replication set manipulation. */
 PG_FUNCTION_INFO_V1(spock_create_replication_set);
@@ -126,6 +130,7 @@ PG_FUNCTION_INFO_V1(spock_synchronize_sequence);
 /* DDL */
 PG_FUNCTION_INFO_V1(spock_replicate_ddl_command);
 PG_FUNCTION_INFO_V1(spock_queue_truncate);
+PG_FUNCTION_INFO_V1(spock_local_node_insert);
 PG_FUNCTION_INFO_V1(spock_truncate_trigger_add);
 PG_FUNCTION_INFO_V1(spock_dependency_check_trigger);
 
@@ -585,7 +590,7 @@ spock_drop_subscription(PG_FUNCTION_ARGS)
 		}
 
 		/* Kill the apply to unlock the resources. */
-		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
 		apply = spock_apply_find(MyDatabaseId, sub->id);
 		spock_worker_kill(apply);
 		LWLockRelease(SpockCtx->lock);
@@ -595,7 +600,7 @@ spock_drop_subscription(PG_FUNCTION_ARGS)
 		{
 			int rc;
 
-			LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+			LWLockAcquire(SpockCtx->lock, LW_SHARED);
 			apply = spock_apply_find(MyDatabaseId, sub->id);
 			if (!spock_worker_running(apply))
 			{
@@ -615,6 +620,9 @@ spock_drop_subscription(PG_FUNCTION_ARGS)
 			ResetLatch(&MyProc->procLatch);
 		}
 
+		spock_relay_drop(sub->id);
+		spock_apply_catchup_forget(MyDatabaseId, sub->id);
+
 		/*
 		 * Drop the slot on remote side.
 		 *
@@ -669,7 +677,7 @@ spock_alter_subscription_disable(PG_FUNCTION_ARGS)
 					 errmsg("alter_subscription_disable with immediate = true "
 							"cannot be run inside a transaction block")));
 
-		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
 		apply = spock_apply_find(MyDatabaseId, sub->id);
 		spock_worker_kill(apply);
 		LWLockRelease(SpockCtx->lock);
@@ -1113,7 +1121,7 @@ spock_show_subscription_status(PG_FUNCTION_ARGS)
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
 
-		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
 		apply = spock_apply_find(MyDatabaseId, sub->id);
 		if (spock_worker_running(apply))
 		{
@@ -1878,6 +1886,37 @@ spock_queue_truncate(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+/*
+ * Trigger function for rows added to spock.local_node by other means than
+ * spock.create_node() (which bypasses triggers), e.g. restoring a dump.
+ *
+ * Registers the current database so that the supervisor starts a manager
+ * for it once the transaction commits.
+ */
+Datum
+spock_local_node_insert(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = (TriggerData *) fcinfo->context;
+	const char	   *funcname = "local_node_insert";
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						funcname)));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER INSERT",
+						funcname)));
+
+	spock_local_node_created();
+
+	PG_RETURN_VOID();
+}
+
 /*
  * spock_dependency_check_trigger
  *
@@ -2325,6 +2364,12 @@ spock_wait_for_sync_complete(char *subscription_name, char *relnamespace, char *
 		bool					isdone = false;
 		int						rc;
 
+		/*
+		 * Get on the wait list before looking at the status so that a commit
+		 * made after we looked still sets our latch.
+		 */
+		ConditionVariablePrepareToSleep(&SpockCtx->sync_status_cv);
+
 		/* We need to see the latest rows */
 		PushActiveSnapshot(GetLatestSnapshot());
 
@@ -2367,17 +2412,20 @@ spock_wait_for_sync_complete(char *subscription_name, char *relnamespace, char *
 		if (isdone)
 			break;
 
-		CHECK_FOR_INTERRUPTS();
-
-		/* some kind of backoff could be useful here */
+		/* Woken up by any committed sync status change. */
 		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 200L);
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 10000L);
 
 		if (rc & WL_POSTMASTER_DEATH)
 			proc_exit(1);
 
 		ResetLatch(&MyProc->procLatch);
+		ConditionVariableCancelSleep();
+
+		CHECK_FOR_INTERRUPTS();
 	} while (1);
+
+	ConditionVariableCancelSleep();
 }
 
 Datum
@@ -2405,6 +2453,142 @@ spock_wait_for_table_sync_complete(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+/*
+ * Wait until all subscriptions from given origin node have applied the
+ * origin's changes up to target_lsn and/or up to the transaction committed
+ * at target_time.
+ *
+ * Returns false if the timeout (in milliseconds, 0 means no timeout) passed
+ * first.
+ *
+ * The applied commit time survives apply worker restarts but not a restart
+ * of the server, until the next transaction from the origin is applied time
+ * waits can't be satisfied then.
+ */
+Datum
+spock_wait_for_apply(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	target_lsn = InvalidXLogRecPtr;
+	TimestampTz	target_time = 0;
+	int			timeout = 0;
+	SpockNode  *node;
+	List	   *subs;
+	ListCell   *lc;
+	TimestampTz	start = GetCurrentTimestamp();
+	bool		ret = true;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "node_name must be specified");
+	if (!PG_ARGISNULL(1))
+		target_lsn = PG_GETARG_LSN(1);
+	if (!PG_ARGISNULL(2))
+		target_time = PG_GETARG_TIMESTAMPTZ(2);
+	if (!PG_ARGISNULL(3))
+		timeout = PG_GETARG_INT32(3);
+
+	if (XLogRecPtrIsInvalid(target_lsn) && target_time == 0)
+		elog(ERROR, "target_lsn or target_time must be specified");
+	if (timeout < 0)
+		elog(ERROR, "timeout must not be negative");
+
+	node = get_node_by_name(NameStr(*PG_GETARG_NAME(0)), false);
+	subs = get_node_subscriptions(node->id, true);
+	if (subs == NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("no subscription from node \"%s\" found",
+						node->name)));
+
+	for (;;)
+	{
+		bool		done = true;
+		long		sleep_ms = 1000L;
+		int			rc;
+
+		/*
+		 * Get on the wait list before checking the progress so that a commit
+		 * made after we looked still sets our latch.
+		 */
+		ConditionVariablePrepareToSleep(&SpockCtx->apply_commit_cv);
+
+		foreach (lc, subs)
+		{
+			SpockSubscription  *sub = lfirst(lc);
+			SpockApplyCatchup  *catchup;
+			TimestampTz			applied_time = 0;
+			XLogRecPtr			idle_lsn = InvalidXLogRecPtr;
+
+			LWLockAcquire(SpockCtx->lock, LW_SHARED);
+			catchup = spock_apply_catchup_find(MyDatabaseId, sub->id);
+			if (catchup != NULL)
+			{
+				applied_time = (TimestampTz)
+					pg_atomic_read_u64(&catchup->commit_time);
+				idle_lsn = (XLogRecPtr) pg_atomic_read_u64(&catchup->idle_lsn);
+			}
+			LWLockRelease(SpockCtx->lock);
+
+			/*
+			 * A target past the last replicated commit is reached once the
+			 * worker reports it had nothing left to apply at that position.
+			 */
+			if (!XLogRecPtrIsInvalid(target_lsn) && idle_lsn < target_lsn)
+			{
+				RepOriginId	originid = replorigin_by_name(sub->slot_name, true);
+
+				if (originid == InvalidRepOriginId ||
+					replorigin_get_progress(originid, false) < target_lsn)
+				{
+					done = false;
+					break;
+				}
+			}
+
+			if (target_time != 0 && applied_time < target_time)
+			{
+				done = false;
+				break;
+			}
+		}
+
+		if (done)
+			break;
+
+		if (timeout > 0)
+		{
+			long		secs;
+			int			usecs;
+			long		elapsed;
+
+			TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+			elapsed = secs * 1000 + usecs / 1000;
+			if (elapsed >= timeout)
+			{
+				ret = false;
+				break;
+			}
+			sleep_ms = Min(sleep_ms, timeout - elapsed);
+		}
+
+		/* Also recheck now and then in case the apply worker restarted. */
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   sleep_ms);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		ResetLatch(&MyProc->procLatch);
+		ConditionVariableCancelSleep();
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	ConditionVariableCancelSleep();
+
+	PG_RETURN_BOOL(ret);
+}
+
 /*
  * Like pg_xact_commit_timestamp but extended for replorigin
  * too.
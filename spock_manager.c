@@ -29,15 +29,60 @@
 #include "pgstat.h"
 
 #include "spock_node.h"
+#include "spock_queue.h"
+#include "spock_relay.h"
+#include "spock_sync.h"
 #include "spock_worker.h"
 #include "spock.h"
 
 #define INITIAL_SLEEP 10000L
 #define MAX_SLEEP 180000L
 #define MIN_SLEEP 5000L
+#define QUEUE_PRUNE_INTERVAL 60000L
 
 void spock_manager_main(Datum main_arg);
 
+/*
+ * Can the subscription share a multiplexed apply worker?
+ *
+ * Synchronization and apply delay block the whole worker, so those
+ * subscriptions get a dedicated one.
+ */
+static bool
+subscription_can_multiplex(SpockSubscription *sub)
+{
+	SpockSyncStatus	   *sync;
+	SpockApplyCatchup  *catchup;
+	bool				dedicated;
+
+	if (spock_apply_multiplex <= 1)
+		return false;
+
+	/* Got too busy for a multiplexed apply worker before. */
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	catchup = spock_apply_catchup_find(MySpockWorker->dboid, sub->id);
+	dedicated = catchup != NULL && catchup->dedicated;
+	LWLockRelease(SpockCtx->lock);
+
+	if (dedicated)
+		return false;
+
+	/* Only dedicated apply workers use the relay log. */
+	if (spock_relay_log || spock_relay_exists(sub->id))
+		return false;
+
+	if (sub->apply_delay != NULL &&
+		(sub->apply_delay->time != 0 || sub->apply_delay->day != 0 ||
+		 sub->apply_delay->month != 0))
+		return false;
+
+	sync = get_subscription_sync_status(sub->id, true);
+	if (sync == NULL || sync->status != SYNC_STATUS_READY)
+		return false;
+
+	return get_unsynced_tables(sub->id) == NIL;
+}
+
 /*
  * Manage the apply workers - start new ones, kill old ones.
  */
@@ -48,12 +93,13 @@ manage_apply_workers(void)
 	List	   *subscriptions;
 	List	   *workers;
 	List	   *subs_to_start = NIL;
+	List	   *subs_to_group = NIL;
 	ListCell   *slc,
 			   *wlc;
 	bool		ret = true;
 
 	/* Get list of existing workers. */
-	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
 	workers = spock_apply_find_all(MySpockWorker->dboid);
 	LWLockRelease(SpockCtx->lock);
 
@@ -62,7 +108,21 @@ manage_apply_workers(void)
 	/* Get local node, exit if no found. */
 	node = get_local_node(true, true);
 	if (!node)
-		proc_exit(0);
+	{
+		/*
+		 * Forget the database, then check again in case the node was
+		 * created (and registered) after our snapshot was taken.
+		 */
+		spock_database_unregister(MyDatabaseId);
+		CommitTransactionCommand();
+		StartTransactionCommand();
+		node = get_local_node(true, true);
+		if (!node)
+			proc_exit(0);
+	}
+
+	/* Make sure the supervisor starts us after restart. */
+	spock_database_register(MyDatabaseId);
 
 	/* Get list of subscribers. */
 	subscriptions = get_node_subscriptions(node->node->id, false);
@@ -71,9 +131,7 @@ manage_apply_workers(void)
 	foreach (slc, subscriptions)
 	{
 		SpockSubscription  *sub = (SpockSubscription *) lfirst(slc);
-		SpockWorker		   *apply = NULL;
-		ListCell			   *next,
-							   *prev;
+		SpockWorker		   *apply;
 
 		/*
 		 * Skip if subscriber not enabled.
@@ -84,30 +142,30 @@ manage_apply_workers(void)
 			continue;
 
 		/* Check if the subscriber already has registered worker. */
-		prev = NULL;
-		for (wlc = list_head(workers); wlc; wlc = next)
-		{
-			apply = (SpockWorker *) lfirst(wlc);
-
-			/* We might delete the cell so advance it now. */
-			next = lnext(wlc);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
+		apply = spock_apply_find(MySpockWorker->dboid, sub->id);
+		LWLockRelease(SpockCtx->lock);
 
-			if (apply->worker.apply.subid == sub->id)
-			{
-				workers = list_delete_cell(workers, wlc, prev);
-				break;
-			}
-			else
-				prev = wlc;
-		}
-		/* If the subscriber does not have a registered worker. */
-		if (!wlc)
-			apply = NULL;
+		/* Workers left in the list at the end are not needed. */
+		if (apply)
+			workers = list_delete_ptr(workers, apply);
 
 		/* Skip if the worker was alrady registered. */
 		if (spock_worker_running(apply))
 			continue;
 
+		/* Multiplexed worker handed the subscription over. */
+		if (apply && apply->worker.apply.promoted)
+		{
+			elog(LOG, "starting dedicated apply worker for subscription %s",
+				 sub->name);
+
+			LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+			spock_worker_forget(apply);
+			LWLockRelease(SpockCtx->lock);
+			apply = NULL;
+		}
+
 		/* Check if this is crashed worker and if we want to restart it now. */
 		if (apply)
 		{
@@ -138,6 +196,13 @@ manage_apply_workers(void)
 	{
 		SpockSubscription  *sub = (SpockSubscription *) lfirst(slc);
 		SpockWorker			apply;
+		int					slot;
+
+		if (subscription_can_multiplex(sub))
+		{
+			subs_to_group = lappend(subs_to_group, sub);
+			continue;
+		}
 
 		memset(&apply, 0, sizeof(SpockWorker));
 		apply.worker_type = SPOCK_WORKER_APPLY;
@@ -146,7 +211,41 @@ manage_apply_workers(void)
 		apply.worker.apply.sync_pending = true;
 		apply.worker.apply.replay_stop_lsn = InvalidXLogRecPtr;
 
-		spock_worker_register(&apply);
+		slot = spock_worker_register(&apply);
+
+		/* Retry later if it died before attaching. */
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
+		if (spock_get_worker(slot)->crashed_at != 0)
+			ret = false;
+		LWLockRelease(SpockCtx->lock);
+	}
+
+	/* Start multiplexed workers for the rest. */
+	while (subs_to_group != NIL)
+	{
+		SpockWorker			group;
+		int					slot;
+
+		memset(&group, 0, sizeof(SpockWorker));
+		group.worker_type = SPOCK_WORKER_APPLY_GROUP;
+		group.dboid = MySpockWorker->dboid;
+
+		while (subs_to_group != NIL &&
+			   group.worker.group.nsubs < spock_apply_multiplex)
+		{
+			SpockSubscription  *sub = linitial(subs_to_group);
+
+			group.worker.group.subids[group.worker.group.nsubs++] = sub->id;
+			subs_to_group = list_delete_first(subs_to_group);
+		}
+
+		slot = spock_worker_register(&group);
+
+		/* Retry later if it died before attaching. */
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
+		if (spock_get_worker(slot)->crashed_at != 0)
+			ret = false;
+		LWLockRelease(SpockCtx->lock);
 	}
 
 	CommitTransactionCommand();
@@ -163,8 +262,7 @@ manage_apply_workers(void)
 		{
 			elog(DEBUG2, "cleaning spock worker slot %zu",
 			     (worker - &SpockCtx->workers[0]));
-			worker->worker_type = SPOCK_WORKER_NONE;
-			worker->crashed_at = 0;
+			spock_worker_forget(worker);
 		}
 	}
 	LWLockRelease(SpockCtx->lock);
@@ -172,6 +270,37 @@ manage_apply_workers(void)
 	return ret;
 }
 
+/*
+ * Remove queue table rows which are no longer needed by any local slot.
+ */
+static void
+manage_queue(void)
+{
+	static TimestampTz	last_prune = 0;
+	TimestampTz			now = GetCurrentTimestamp();
+	uint64				pruned;
+
+	if (spock_queue_min_retention < 0 ||
+		!TimestampDifferenceExceeds(last_prune, now, QUEUE_PRUNE_INTERVAL))
+		return;
+
+	last_prune = now;
+
+	StartTransactionCommand();
+	pruned = prune_queue(spock_queue_min_retention);
+	CommitTransactionCommand();
+
+	if (pruned > 0)
+	{
+		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		MySpockWorker->worker.manager.queue_pruned += pruned;
+		LWLockRelease(SpockCtx->lock);
+
+		elog(DEBUG1, "removed " UINT64_FORMAT " rows from queue table",
+			 pruned);
+	}
+}
+
 /*
  * Entry point for manager worker.
  */
@@ -181,6 +310,8 @@ spock_manager_main(Datum main_arg)
 	int			slot = DatumGetInt32(main_arg);
 	Oid			extoid;
 	int			sleep_timer = INITIAL_SLEEP;
+	bool		processed_all = true;
+	TimestampTz	last_workers_check = 0;
 
 	/* Setup shmem. */
 	spock_worker_attach(slot, SPOCK_WORKER_MANAGER);
@@ -195,7 +326,15 @@ spock_manager_main(Datum main_arg)
 	/* If the extension is not installed in this DB, exit. */
 	extoid = get_extension_oid(EXTENSION_NAME, true);
 	if (!OidIsValid(extoid))
-		proc_exit(0);
+	{
+		/* Same dance as in manage_apply_workers(). */
+		spock_database_unregister(MyDatabaseId);
+		CommitTransactionCommand();
+		StartTransactionCommand();
+		extoid = get_extension_oid(EXTENSION_NAME, true);
+		if (!OidIsValid(extoid))
+			proc_exit(0);
+	}
 
 	elog(LOG, "starting spock database manager for database %s",
 		 get_database_name(MyDatabaseId));
@@ -211,10 +350,25 @@ spock_manager_main(Datum main_arg)
 	while (!got_SIGTERM)
     {
 		int		rc;
-		bool	processed_all;
+		bool	check_workers;
+		TimestampTz	now = GetCurrentTimestamp();
 
-		/* Launch the apply workers. */
-		processed_all = manage_apply_workers();
+		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		check_workers = MySpockWorker->worker.manager.subscriptions_changed;
+		MySpockWorker->worker.manager.subscriptions_changed = false;
+		LWLockRelease(SpockCtx->lock);
+
+		/*
+		 * Launch the apply workers. We get signalled when a subscription
+		 * changes or an apply worker exits, the periodic check is just a
+		 * safety net.
+		 */
+		if (check_workers || !processed_all ||
+			TimestampDifferenceExceeds(last_workers_check, now, MAX_SLEEP))
+		{
+			processed_all = manage_apply_workers();
+			last_workers_check = now;
+		}
 
 		/* Handle sequences and update our sleep timer as necessary. */
 		if (synchronize_sequences())
@@ -222,6 +376,9 @@ spock_manager_main(Datum main_arg)
 		else
 			sleep_timer = Max(sleep_timer / 2, MIN_SLEEP);
 
+		/* Cleanup the queue table. */
+		manage_queue();
+
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
 					   processed_all ? sleep_timer : MIN_SLEEP);
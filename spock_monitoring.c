@@ -12,21 +12,73 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
 #include "fmgr.h"
+#include "funcapi.h"
 #include "miscadmin.h"
 
+#include "catalog/pg_type.h"
+
 #include "replication/slot.h"
 
+#include "utils/builtins.h"
 #include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
 
 #include "storage/ipc.h"
 #include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
 
 #include "pgstat.h"
 
 #include "spock.h"
+#include "spock_monitoring.h"
+#include "spock_sync.h"
+#include "spock_worker.h"
 
 PG_FUNCTION_INFO_V1(spock_wait_slot_confirm_lsn);
+PG_FUNCTION_INFO_V1(spock_queue_pruned_rows);
+PG_FUNCTION_INFO_V1(spock_get_subscription_stats);
+PG_FUNCTION_INFO_V1(spock_reset_subscription_stats);
+PG_FUNCTION_INFO_V1(spock_get_relation_stats);
+PG_FUNCTION_INFO_V1(spock_reset_relation_stats);
+PG_FUNCTION_INFO_V1(spock_get_subscription_lag);
+PG_FUNCTION_INFO_V1(spock_get_sync_progress);
+
+typedef struct SpockRelStatsKey
+{
+	Oid			dboid;
+	Oid			relid;
+} SpockRelStatsKey;
+
+typedef struct SpockRelStatsEntry
+{
+	SpockRelStatsKey	key;		/* hash key, must be first */
+	slock_t				mutex;		/* protects the counters */
+	uint64				counters[SPOCK_RELSTAT_NUM_COUNTERS];
+} SpockRelStatsEntry;
+
+/* Counts of this backend not yet added to the shared ones. */
+typedef struct SpockRelStatsPending
+{
+	Oid			relid;				/* hash key, must be first */
+	uint64		counters[SPOCK_RELSTAT_NUM_COUNTERS];
+} SpockRelStatsPending;
+
+int			spock_stat_max_relations = 1000;
+
+static HTAB	   *SpockRelStatsHash = NULL;
+static LWLock  *SpockRelStatsLock = NULL;
+
+static HTAB	   *RelStatsPending = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* Bounds of the polling interval in spock_wait_slot_confirm_lsn, in ms. */
+#define SLOT_CONFIRM_MIN_SLEEP	1
+#define SLOT_CONFIRM_MAX_SLEEP	100
 
 /*
  * Wait for the confirmed_flush_lsn of the specified slot, or all logical slots
@@ -34,12 +86,18 @@ PG_FUNCTION_INFO_V1(spock_wait_slot_confirm_lsn);
  * write position is used.
  *
  * No timeout is offered, use a statement_timeout.
+ *
+ * The walsender advances confirmed_flush without telling anybody, so we
+ * still have to poll. Start with a short sleep and back off while nothing
+ * moves, which keeps the wait short without spinning on the slot array.
  */
 Datum
 spock_wait_slot_confirm_lsn(PG_FUNCTION_ARGS)
 {
 	XLogRecPtr target_lsn;
+	XLogRecPtr last_confirmed_lsn = InvalidXLogRecPtr;
 	Name slot_name;
+	long sleep_ms = SLOT_CONFIRM_MIN_SLEEP;
 	int i;
 
 	if (PG_ARGISNULL(0))
@@ -98,9 +156,15 @@ spock_wait_slot_confirm_lsn(PG_FUNCTION_ARGS)
 		if (oldest_confirmed_lsn >= target_lsn)
 			break;
 
+		if (oldest_confirmed_lsn != last_confirmed_lsn)
+			sleep_ms = SLOT_CONFIRM_MIN_SLEEP;
+		else
+			sleep_ms = Min(sleep_ms * 2, SLOT_CONFIRM_MAX_SLEEP);
+		last_confirmed_lsn = oldest_confirmed_lsn;
+
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   1000);
+					   sleep_ms);
 
         ResetLatch(&MyProc->procLatch);
 
@@ -113,3 +177,854 @@ spock_wait_slot_confirm_lsn(PG_FUNCTION_ARGS)
 
 	PG_RETURN_VOID();
 }
+
+/*
+ * Number of rows the manager of the current database removed from the queue
+ * table since it was started.
+ */
+Datum
+spock_queue_pruned_rows(PG_FUNCTION_ARGS)
+{
+	SpockWorker *manager;
+	uint64		pruned = 0;
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	manager = spock_manager_find(MyDatabaseId);
+	if (manager != NULL)
+		pruned = manager->worker.manager.queue_pruned;
+	LWLockRelease(SpockCtx->lock);
+
+	PG_RETURN_INT64((int64) pruned);
+}
+
+#define SUBSCRIPTION_STATS_COLS	(11 + SPOCK_STAT_CONFLICT_TYPES + \
+								 SPOCK_STAT_RESOLUTIONS + \
+								 SPOCK_APPLY_NUM_PHASES + 5)
+
+/*
+ * Return apply statistics of the apply workers running in current database.
+ */
+Datum
+spock_get_subscription_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	int					i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *w = &SpockCtx->workers[i];
+		SpockApplyStats	   *stats;
+		Datum		values[SUBSCRIPTION_STATS_COLS];
+		bool		nulls[SUBSCRIPTION_STATS_COLS];
+		int			col = 0;
+		int			j;
+		TimestampTz	commit_time;
+		TimestampTz	apply_time;
+		Datum		hist[SPOCK_APPLY_LATENCY_BUCKETS];
+
+		if (w->worker_type != SPOCK_WORKER_APPLY ||
+			w->dboid != MyDatabaseId)
+			continue;
+
+		stats = &w->worker.apply.stats;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[col++] = ObjectIdGetDatum(w->worker.apply.subid);
+		values[col++] = Int32GetDatum(w->proc ? w->proc->pid : 0);
+		if (!w->proc)
+			nulls[col - 1] = true;
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->xact_commits));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->inserts));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->updates));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->deletes));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->multi_inserts));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->noop_updates));
+		for (j = 0; j < SPOCK_STAT_CONFLICT_TYPES; j++)
+			values[col++] = Int64GetDatum((int64)
+				pg_atomic_read_u64(&stats->conflicts[j]));
+		for (j = 0; j < SPOCK_STAT_RESOLUTIONS; j++)
+			values[col++] = Int64GetDatum((int64)
+				pg_atomic_read_u64(&stats->resolutions[j]));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->apply_errors));
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&stats->bytes_received));
+
+		values[col] = LSNGetDatum((XLogRecPtr)
+			pg_atomic_read_u64(&stats->last_commit_lsn));
+		if (XLogRecPtrIsInvalid(DatumGetLSN(values[col])))
+			nulls[col] = true;
+		col++;
+
+		commit_time = (TimestampTz) pg_atomic_read_u64(&stats->last_commit_time);
+		apply_time = (TimestampTz) pg_atomic_read_u64(&stats->last_apply_time);
+		if (commit_time != 0)
+		{
+			values[col++] = TimestampTzGetDatum(commit_time);
+			values[col++] = TimestampTzGetDatum(apply_time);
+			values[col++] = DirectFunctionCall2(timestamp_mi,
+												TimestampTzGetDatum(apply_time),
+												TimestampTzGetDatum(commit_time));
+		}
+		else
+		{
+			nulls[col++] = true;
+			nulls[col++] = true;
+			nulls[col++] = true;
+		}
+
+		/* Phase times are reported in milliseconds. */
+		for (j = 0; j < SPOCK_APPLY_NUM_PHASES; j++)
+			values[col++] = Float8GetDatum((double)
+				pg_atomic_read_u64(&stats->phase_time[j]) / 1000.0);
+
+		for (j = 0; j < SPOCK_APPLY_LATENCY_BUCKETS; j++)
+			hist[j] = Int64GetDatum((int64)
+				pg_atomic_read_u64(&stats->xact_latency[j]));
+		values[col++] = PointerGetDatum(
+			construct_array(hist, SPOCK_APPLY_LATENCY_BUCKETS, INT8OID,
+							sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+
+		values[col++] = TimestampTzGetDatum((TimestampTz)
+			pg_atomic_read_u64(&stats->stats_reset));
+
+		Assert(col == SUBSCRIPTION_STATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(SpockCtx->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Reset apply statistics of given subscription, or of all subscriptions in
+ * current database when NULL is passed.
+ */
+Datum
+spock_reset_subscription_stats(PG_FUNCTION_ARGS)
+{
+	Oid			subid = InvalidOid;
+	int			i;
+
+	if (!PG_ARGISNULL(0))
+		subid = get_subscription_by_name(NameStr(*PG_GETARG_NAME(0)),
+										 false)->id;
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *w = &SpockCtx->workers[i];
+
+		if (w->worker_type != SPOCK_WORKER_APPLY ||
+			w->dboid != MyDatabaseId)
+			continue;
+
+		if (OidIsValid(subid) && w->worker.apply.subid != subid)
+			continue;
+
+		spock_apply_stats_reset(&w->worker.apply.stats, false);
+	}
+	LWLockRelease(SpockCtx->lock);
+
+	PG_RETURN_VOID();
+}
+
+static Size
+relstats_shmem_size(void)
+{
+	return hash_estimate_size(spock_stat_max_relations,
+							  sizeof(SpockRelStatsEntry));
+}
+
+static void
+spock_monitoring_shmem_startup(void)
+{
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook != NULL)
+		prev_shmem_startup_hook();
+
+	SpockRelStatsLock = &(GetNamedLWLockTranche("spock_relstats"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(SpockRelStatsKey);
+	info.entrysize = sizeof(SpockRelStatsEntry);
+	SpockRelStatsHash = ShmemInitHash("spock relation stats",
+									  spock_stat_max_relations,
+									  spock_stat_max_relations,
+									  &info, HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Request shmem resources for the per-relation statistics.
+ */
+void
+spock_monitoring_shmem_init(void)
+{
+	Assert(process_shared_preload_libraries_in_progress);
+
+	RequestAddinShmemSpace(relstats_shmem_size());
+	RequestNamedLWLockTranche("spock_relstats", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = spock_monitoring_shmem_startup;
+}
+
+/*
+ * Add the deltas to the pending counters of given relation.
+ *
+ * They reach the shared statistics at spock_relstat_flush(), so that the
+ * per-row cost is a lookup in a backend-local hash.
+ */
+static void
+relstat_add(Oid relid, const uint64 *deltas)
+{
+	SpockRelStatsPending *pending;
+	bool		found;
+	int			i;
+
+	if (SpockRelStatsHash == NULL)
+		return;
+
+	if (RelStatsPending == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(SpockRelStatsPending);
+		RelStatsPending = hash_create("spock pending relation stats", 64,
+									  &info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	pending = (SpockRelStatsPending *) hash_search(RelStatsPending, &relid,
+												   HASH_ENTER, &found);
+	if (!found)
+		memset(pending->counters, 0, sizeof(pending->counters));
+
+	for (i = 0; i < SPOCK_RELSTAT_NUM_COUNTERS; i++)
+		pending->counters[i] += deltas[i];
+}
+
+/*
+ * Add the pending counts to the shared entry of their relation.
+ *
+ * Returns false if the entry does not exist, it's created only when 'enter'
+ * is set. New relations are silently not tracked once the hash is full.
+ */
+static bool
+relstat_flush_entry(SpockRelStatsPending *pending, bool enter)
+{
+	SpockRelStatsKey	key;
+	SpockRelStatsEntry *entry;
+	bool				found;
+	int					i;
+
+	key.dboid = MyDatabaseId;
+	key.relid = pending->relid;
+
+	entry = (SpockRelStatsEntry *) hash_search(SpockRelStatsHash, &key,
+											   enter ? HASH_ENTER_NULL : HASH_FIND,
+											   &found);
+	if (entry == NULL)
+		return false;
+
+	if (!found)
+	{
+		SpinLockInit(&entry->mutex);
+		memset(entry->counters, 0, sizeof(entry->counters));
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	for (i = 0; i < SPOCK_RELSTAT_NUM_COUNTERS; i++)
+		entry->counters[i] += pending->counters[i];
+	SpinLockRelease(&entry->mutex);
+
+	return true;
+}
+
+/*
+ * Move the counts gathered by this backend to the shared statistics.
+ *
+ * Called once per transaction by the output plugin and the apply worker.
+ */
+void
+spock_relstat_flush(void)
+{
+	HASH_SEQ_STATUS			hash_seq;
+	SpockRelStatsPending   *pending;
+	bool					missing = false;
+
+	if (RelStatsPending == NULL || hash_get_num_entries(RelStatsPending) == 0)
+		return;
+
+	/* Relations already tracked only need the shared lock. */
+	LWLockAcquire(SpockRelStatsLock, LW_SHARED);
+	hash_seq_init(&hash_seq, RelStatsPending);
+	while ((pending = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (relstat_flush_entry(pending, false))
+			hash_search(RelStatsPending, &pending->relid, HASH_REMOVE, NULL);
+		else
+			missing = true;
+	}
+	LWLockRelease(SpockRelStatsLock);
+
+	if (!missing)
+		return;
+
+	/* Need exclusive lock to add the entries. */
+	LWLockAcquire(SpockRelStatsLock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, RelStatsPending);
+	while ((pending = hash_seq_search(&hash_seq)) != NULL)
+	{
+		relstat_flush_entry(pending, true);
+		hash_search(RelStatsPending, &pending->relid, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(SpockRelStatsLock);
+}
+
+/*
+ * Count a change decoded by the output plugin and the bytes sent for it.
+ */
+void
+spock_relstat_report_decode(Oid relid, bool filtered, uint64 bytes)
+{
+	uint64		deltas[SPOCK_RELSTAT_NUM_COUNTERS] = {0};
+
+	deltas[SPOCK_RELSTAT_DECODED] = 1;
+	if (filtered)
+		deltas[SPOCK_RELSTAT_FILTERED] = 1;
+	deltas[SPOCK_RELSTAT_BYTES_SENT] = bytes;
+
+	relstat_add(relid, deltas);
+}
+
+/*
+ * Count a row applied by the apply worker and the time it took.
+ */
+void
+spock_relstat_report_apply(Oid relid, SpockRelStatCounter action,
+						   instr_time elapsed)
+{
+	uint64		deltas[SPOCK_RELSTAT_NUM_COUNTERS] = {0};
+
+	Assert(action == SPOCK_RELSTAT_INSERTS ||
+		   action == SPOCK_RELSTAT_UPDATES ||
+		   action == SPOCK_RELSTAT_DELETES);
+
+	deltas[action] = 1;
+	deltas[SPOCK_RELSTAT_APPLY_TIME] = INSTR_TIME_GET_MICROSEC(elapsed);
+
+	relstat_add(relid, deltas);
+}
+
+/*
+ * Count a conflict on the relation.
+ */
+void
+spock_relstat_report_conflict(Oid relid)
+{
+	uint64		deltas[SPOCK_RELSTAT_NUM_COUNTERS] = {0};
+
+	deltas[SPOCK_RELSTAT_CONFLICTS] = 1;
+
+	relstat_add(relid, deltas);
+}
+
+/*
+ * Return the per-relation statistics of current database.
+ */
+Datum
+spock_get_relation_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	SpockRelStatsEntry *entry;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (SpockRelStatsHash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("spock must be loaded via shared_preload_libraries")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(SpockRelStatsLock, LW_SHARED);
+	hash_seq_init(&hash_seq, SpockRelStatsHash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[SPOCK_RELSTAT_NUM_COUNTERS + 1];
+		bool		nulls[SPOCK_RELSTAT_NUM_COUNTERS + 1];
+		uint64		counters[SPOCK_RELSTAT_NUM_COUNTERS];
+		int			i;
+
+		if (entry->key.dboid != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		memcpy(counters, entry->counters, sizeof(counters));
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(entry->key.relid);
+		for (i = 0; i < SPOCK_RELSTAT_APPLY_TIME; i++)
+			values[i + 1] = Int64GetDatum((int64) counters[i]);
+		/* Time is reported in milliseconds like in pg_stat_* views. */
+		values[SPOCK_RELSTAT_APPLY_TIME + 1] =
+			Float8GetDatum((double) counters[SPOCK_RELSTAT_APPLY_TIME] / 1000.0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(SpockRelStatsLock);
+
+	tuplestore_donestoring(tupstore);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Remove statistics of given relation, or of all relations in current
+ * database when NULL is passed.
+ */
+Datum
+spock_reset_relation_stats(PG_FUNCTION_ARGS)
+{
+	Oid					relid = PG_ARGISNULL(0) ? InvalidOid : PG_GETARG_OID(0);
+	HASH_SEQ_STATUS		hash_seq;
+	SpockRelStatsEntry *entry;
+
+	if (SpockRelStatsHash == NULL)
+		PG_RETURN_VOID();
+
+	LWLockAcquire(SpockRelStatsLock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, SpockRelStatsHash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dboid != MyDatabaseId)
+			continue;
+
+		if (OidIsValid(relid) && entry->key.relid != relid)
+			continue;
+
+		hash_search(SpockRelStatsHash, &entry->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(SpockRelStatsLock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Map lag in microseconds to histogram bucket.
+ */
+static int
+lag_hist_bucket(uint64 usec)
+{
+	int			exp = SPOCK_LAG_HIST_SUB_BITS;
+	int			bucket;
+
+	if (usec < SPOCK_LAG_HIST_SUB)
+		return (int) usec;
+
+	while (exp < 63 && (usec >> (exp + 1)) != 0)
+		exp++;
+
+	bucket = SPOCK_LAG_HIST_SUB +
+		(exp - SPOCK_LAG_HIST_SUB_BITS) * SPOCK_LAG_HIST_SUB +
+		(int) ((usec >> (exp - SPOCK_LAG_HIST_SUB_BITS)) &
+			   (SPOCK_LAG_HIST_SUB - 1));
+
+	return Min(bucket, SPOCK_LAG_HIST_BUCKETS - 1);
+}
+
+/*
+ * Highest value in microseconds counted in given bucket.
+ */
+static uint64
+lag_hist_bucket_upper(int bucket)
+{
+	int			exp;
+	uint64		mantissa;
+
+	if (bucket < SPOCK_LAG_HIST_SUB)
+		return (uint64) bucket;
+
+	exp = (bucket - SPOCK_LAG_HIST_SUB) / SPOCK_LAG_HIST_SUB;
+	mantissa = SPOCK_LAG_HIST_SUB + (bucket - SPOCK_LAG_HIST_SUB) % SPOCK_LAG_HIST_SUB;
+
+	return ((mantissa + 1) << exp) - 1;
+}
+
+/*
+ * Record lag between origin commit and a local event. Only the owning apply
+ * worker adds to the histogram.
+ */
+void
+spock_lag_hist_add(SpockLagHistogram *hist, TimestampTz origin_ts,
+				   TimestampTz local_ts)
+{
+	uint64		usec;
+
+	/* Clock skew between nodes can make the lag negative. */
+	usec = local_ts > origin_ts ? (uint64) (local_ts - origin_ts) : 0;
+
+	pg_atomic_fetch_add_u64(&hist->buckets[lag_hist_bucket(usec)], 1);
+	if (usec > pg_atomic_read_u64(&hist->max))
+		pg_atomic_write_u64(&hist->max, usec);
+}
+
+/*
+ * Fill count, p50, p99, p999 and max of the histogram into values, the
+ * percentiles in milliseconds. Returns number of values filled.
+ */
+static int
+lag_hist_values(SpockLagHistogram *hist, Datum *values, bool *nulls)
+{
+	static const double percentiles[] = {0.5, 0.99, 0.999};
+	uint64		counts[SPOCK_LAG_HIST_BUCKETS];
+	uint64		total = 0;
+	uint64		max = pg_atomic_read_u64(&hist->max);
+	int			i;
+	int			p;
+
+	for (i = 0; i < SPOCK_LAG_HIST_BUCKETS; i++)
+	{
+		counts[i] = pg_atomic_read_u64(&hist->buckets[i]);
+		total += counts[i];
+	}
+
+	values[0] = Int64GetDatum((int64) total);
+	nulls[0] = false;
+
+	for (p = 0; p < lengthof(percentiles); p++)
+	{
+		uint64		rank = (uint64) ceil(percentiles[p] * total);
+		uint64		seen = 0;
+
+		nulls[p + 1] = (total == 0);
+		if (total == 0)
+			continue;
+
+		for (i = 0; i < SPOCK_LAG_HIST_BUCKETS - 1; i++)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+				break;
+		}
+
+		values[p + 1] = Float8GetDatum(
+			(double) Min(lag_hist_bucket_upper(i), max) / 1000.0);
+	}
+
+	values[lengthof(percentiles) + 1] = Float8GetDatum((double) max / 1000.0);
+	nulls[lengthof(percentiles) + 1] = (total == 0);
+
+	return lengthof(percentiles) + 2;
+}
+
+/*
+ * Return the replication lag percentiles of the apply workers in current
+ * database, measured at local commit and at local flush.
+ */
+Datum
+spock_get_subscription_lag(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	int					i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *w = &SpockCtx->workers[i];
+		Datum		values[11];
+		bool		nulls[11];
+		int			col = 0;
+
+		if (w->worker_type != SPOCK_WORKER_APPLY ||
+			w->dboid != MyDatabaseId)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[col++] = ObjectIdGetDatum(w->worker.apply.subid);
+		col += lag_hist_values(&w->worker.apply.stats.commit_lag,
+							   &values[col], &nulls[col]);
+		col += lag_hist_values(&w->worker.apply.stats.flush_lag,
+							   &values[col], &nulls[col]);
+		Assert(col == lengthof(values));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(SpockCtx->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	PG_RETURN_VOID();
+}
+
+static const char *
+sync_phase_name(char phase)
+{
+	switch (phase)
+	{
+		case SYNC_STATUS_INIT:
+			return "init";
+		case SYNC_STATUS_STRUCTURE:
+			return "structure";
+		case SYNC_STATUS_DATA:
+			return "data";
+		case SYNC_STATUS_CONSTAINTS:
+			return "constraints";
+		case SYNC_STATUS_CATCHUP:
+			return "catchup";
+		default:
+			return "unknown";
+	}
+}
+
+#define SYNC_PROGRESS_COLS	18
+
+/*
+ * Return the progress of subscription and table synchronizations running
+ * in current database.
+ */
+Datum
+spock_get_sync_progress(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	TimestampTz			now = GetCurrentTimestamp();
+	int					i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker		   *w = &SpockCtx->workers[i];
+		SpockApplyWorker   *apply = &w->worker.apply;
+		SpockSyncProgress  *progress = &apply->progress;
+		SpockSyncProgress	snap;
+		Datum		values[SYNC_PROGRESS_COLS];
+		bool		nulls[SYNC_PROGRESS_COLS];
+		int			col = 0;
+		uint64		bytes_copied;
+		XLogRecPtr	catchup_lsn;
+
+		if ((w->worker_type != SPOCK_WORKER_APPLY &&
+			 w->worker_type != SPOCK_WORKER_SYNC) ||
+			w->dboid != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&progress->mutex);
+		snap.phase = progress->phase;
+		snap.phase_start = progress->phase_start;
+		snap.nspname = progress->nspname;
+		snap.relname = progress->relname;
+		snap.table_start = progress->table_start;
+		snap.tables_total = progress->tables_total;
+		snap.tables_done = progress->tables_done;
+		snap.table_size = progress->table_size;
+		snap.table_rows = progress->table_rows;
+		snap.catchup_start_lsn = progress->catchup_start_lsn;
+		SpinLockRelease(&progress->mutex);
+
+		if (snap.phase == SYNC_STATUS_NONE)
+			continue;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[col++] = ObjectIdGetDatum(apply->subid);
+		values[col++] = Int32GetDatum(w->proc ? w->proc->pid : 0);
+		if (!w->proc)
+			nulls[col - 1] = true;
+		values[col++] = CStringGetTextDatum(spock_worker_type_name(w->worker_type));
+		values[col++] = CStringGetTextDatum(sync_phase_name(snap.phase));
+		values[col++] = TimestampTzGetDatum(snap.phase_start);
+
+		if (snap.table_start != 0)
+		{
+			values[col++] = NameGetDatum(&snap.nspname);
+			values[col++] = NameGetDatum(&snap.relname);
+		}
+		else
+		{
+			nulls[col++] = true;
+			nulls[col++] = true;
+		}
+		values[col++] = Int32GetDatum(snap.tables_done);
+		values[col++] = Int32GetDatum(snap.tables_total);
+
+		bytes_copied = pg_atomic_read_u64(&progress->bytes_copied);
+		values[col++] = Int64GetDatum((int64) bytes_copied);
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&progress->rows_copied));
+		values[col++] = Int64GetDatum(snap.table_size);
+		values[col++] = Int64GetDatum(snap.table_rows);
+		values[col++] = Int64GetDatum((int64)
+			pg_atomic_read_u64(&progress->total_bytes_copied));
+
+		/* Throughput of the current table copy in bytes per second. */
+		if (snap.phase == SYNC_STATUS_DATA && snap.table_start != 0 &&
+			now > snap.table_start)
+			values[col++] = Float8GetDatum((double) bytes_copied * USECS_PER_SEC /
+										   (double) (now - snap.table_start));
+		else
+			nulls[col++] = true;
+
+		/* Distance of the catch-up replay to the point where it stops. */
+		catchup_lsn = Max((XLogRecPtr) pg_atomic_read_u64(&apply->stats.last_commit_lsn),
+						  snap.catchup_start_lsn);
+		if (snap.phase == SYNC_STATUS_CATCHUP &&
+			!XLogRecPtrIsInvalid(apply->replay_stop_lsn))
+		{
+			values[col++] = LSNGetDatum(catchup_lsn);
+			values[col++] = LSNGetDatum(apply->replay_stop_lsn);
+			values[col++] = Int64GetDatum(apply->replay_stop_lsn > catchup_lsn ?
+										  (int64) (apply->replay_stop_lsn - catchup_lsn) : 0);
+		}
+		else
+		{
+			nulls[col++] = true;
+			nulls[col++] = true;
+			nulls[col++] = true;
+		}
+
+		Assert(col == SYNC_PROGRESS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(SpockCtx->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	PG_RETURN_VOID();
+}
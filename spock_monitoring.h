@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_monitoring.h
+ *		support for monitoring and progress tracking
+ *
+ * Copyright (c) 2017-2020, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		spock_monitoring.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_MONITORING_H
+#define SPOCK_MONITORING_H
+
+#include "portability/instr_time.h"
+
+#include "spock_worker.h"
+
+typedef enum SpockRelStatCounter
+{
+	/* Origin side, counted by the output plugin. */
+	SPOCK_RELSTAT_DECODED,
+	SPOCK_RELSTAT_FILTERED,
+	SPOCK_RELSTAT_BYTES_SENT,
+	/* Subscriber side, counted by the apply worker. */
+	SPOCK_RELSTAT_INSERTS,
+	SPOCK_RELSTAT_UPDATES,
+	SPOCK_RELSTAT_DELETES,
+	SPOCK_RELSTAT_CONFLICTS,
+	SPOCK_RELSTAT_APPLY_TIME,		/* in microseconds */
+	SPOCK_RELSTAT_NUM_COUNTERS
+} SpockRelStatCounter;
+
+extern int spock_stat_max_relations;
+
+extern void spock_monitoring_shmem_init(void);
+
+extern void spock_relstat_report_decode(Oid relid, bool filtered,
+										uint64 bytes);
+extern void spock_relstat_report_apply(Oid relid, SpockRelStatCounter action,
+									   instr_time elapsed);
+extern void spock_relstat_report_conflict(Oid relid);
+extern void spock_relstat_flush(void);
+
+extern void spock_lag_hist_add(SpockLagHistogram *hist, TimestampTz origin_ts,
+							   TimestampTz local_ts);
+
+#endif /* SPOCK_MONITORING_H */
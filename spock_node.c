@@ -351,6 +351,8 @@ create_local_node(Oid nodeid, Oid ifid)
 	table_close(rel, AccessExclusiveLock);
 
 	CommandCounterIncrement();
+
+	spock_local_node_created();
 }
 
 /*
@@ -621,6 +623,50 @@ get_node_interface(Oid ifid)
 	return nodeif;
 }
 
+/*
+ * Get all interfaces of the node from the catalog.
+ */
+List *
+get_node_interfaces(Oid nodeid)
+{
+	RangeVar	   *rv;
+	Relation		rel;
+	SysScanDesc		scan;
+	HeapTuple		tuple;
+	ScanKeyData		key[1];
+	List		   *res = NIL;
+
+	rv = makeRangeVar(EXTENSION_NAME, CATALOG_NODE_INTERFACE, -1);
+	rel = table_openrv(rv, AccessShareLock);
+
+	ScanKeyInit(&key[0],
+				Anum_if_nodeid,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(nodeid));
+
+	scan = systable_beginscan(rel, 0, true, NULL, 1, key);
+
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		NodeInterfaceTuple *iftup = (NodeInterfaceTuple *) GETSTRUCT(tuple);
+		SpockInterface	   *nodeif;
+
+		nodeif = (SpockInterface *) palloc(sizeof(SpockInterface));
+		nodeif->id = iftup->if_id;
+		nodeif->name = pstrdup(NameStr(iftup->if_name));
+		nodeif->nodeid = iftup->if_nodeid;
+		nodeif->dsn = pstrdup(text_to_cstring(&iftup->if_dsn));
+
+		res = lappend(res, nodeif);
+	}
+
+	/* Cleanup. */
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	return res;
+}
+
 /*
  * Get the node interface by name.
  */
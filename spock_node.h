@@ -61,6 +61,7 @@ extern void create_node_interface(SpockInterface *node);
 extern void drop_node_interface(Oid ifid);
 extern void drop_node_interfaces(Oid nodeid);
 extern SpockInterface *get_node_interface(Oid ifid);
+extern List *get_node_interfaces(Oid nodeid);
 extern SpockInterface *get_node_interface_by_name(Oid nodeid,
 													  const char *name,
 													  bool missing_ok);
@@ -70,7 +70,8 @@ enum {
 	PARAM_SPOCK_REPLICATE_ONLY_TABLE,
 	PARAM_HOOKS_SETUP_FUNCTION,
 	PARAM_PG_VERSION,
-	PARAM_NO_TXINFO
+	PARAM_NO_TXINFO,
+	PARAM_SPOCK_SEQUENCE_BATCHES
 } OutputPluginParamKey;
 
 typedef struct {
@@ -100,6 +101,7 @@ static OutputPluginParam param_lookup[] = {
 	{"hooks.setup_function", PARAM_HOOKS_SETUP_FUNCTION},
 	{"pg_version", PARAM_PG_VERSION},
 	{"no_txinfo", PARAM_NO_TXINFO},
+	{"spock.sequence_batches", PARAM_SPOCK_SEQUENCE_BATCHES},
 	{NULL, PARAM_UNRECOGNISED}
 };
 
@@ -282,6 +284,11 @@ process_parameters_v1(List *options, SpockOutputData *data)
 				data->client_no_txinfo = DatumGetBool(val);
 				break;
 
+			case PARAM_SPOCK_SEQUENCE_BATCHES:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_want_sequence_batches = DatumGetBool(val);
+				break;
+
 			/* Backwards compat. */
 			case PARAM_HOOKS_SETUP_FUNCTION:
 				break;
@@ -35,6 +35,7 @@
 #include "spock.h"
 #include "spock_output_config.h"
 #include "spock_executor.h"
+#include "spock_monitoring.h"
 #include "spock_node.h"
 #include "spock_output_proto.h"
 #include "spock_queue.h"
@@ -81,6 +82,15 @@ static HTAB *RelMetaCache = NULL;
 static MemoryContext RelMetaCacheContext = NULL;
 static int InvalidRelMetaCacheCnt = 0;
 
+/*
+ * Resolved oid of replicate_only_table, so that the change filter of a table
+ * sync catch-up session does not have to compare names for every change. Any
+ * relcache invalidation resets it, as a rename or drop of any table may change
+ * what the name resolves to.
+ */
+static Oid	ReplicateOnlyRelid = InvalidOid;
+static bool	ReplicateOnlyRelidValid = false;
+
 static void relmetacache_init(MemoryContext decoding_context);
 static SPKRelMetaCacheEntry *relmetacache_get_relation(SpockOutputData *data,
 													   Relation rel);
@@ -450,6 +460,8 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	 */
 	relmetacache_prune();
 
+	spock_relstat_flush();
+
 	Assert(CurrentMemoryContext == data->context);
 	MemoryContextSwitchTo(old_ctx);
 	MemoryContextReset(data->context);
@@ -468,12 +480,24 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 	{
 		/*
 		 * Special case - we are catching up just one table.
-		 * TODO: performance
+		 *
+		 * The name is resolved in the historic snapshot of the change being
+		 * decoded and remembered until the next relcache invalidation.
 		 */
-		return strcmp(RelationGetRelationName(relation),
-					  data->replicate_only_table->relname) == 0 &&
-			RelationGetNamespace(relation) ==
-				get_namespace_oid(data->replicate_only_table->schemaname, true);
+		if (!ReplicateOnlyRelidValid)
+		{
+			Oid		nspid;
+
+			nspid = get_namespace_oid(data->replicate_only_table->schemaname,
+									  true);
+			ReplicateOnlyRelid = OidIsValid(nspid) ?
+				get_relname_relid(data->replicate_only_table->relname, nspid) :
+				InvalidOid;
+			ReplicateOnlyRelidValid = true;
+		}
+
+		return OidIsValid(ReplicateOnlyRelid) &&
+			RelationGetRelid(relation) == ReplicateOnlyRelid;
 	}
 	else if (RelationGetRelid(relation) == get_queue_table_oid())
 	{
@@ -597,6 +621,7 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 	{
 		EState		   *estate;
 		ExprContext	   *econtext;
+		bool			matches = true;
 		TupleDesc		tupdesc = RelationGetDescr(relation);
 		HeapTuple		oldtup = change->data.tp.oldtuple ?
 			&change->data.tp.oldtuple->tuple : NULL;
@@ -626,15 +651,18 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 			res = ExecEvalExpr(exprstate, econtext, &isnull, NULL);
 
 			/* NULL is same as false for our use. */
-			if (isnull)
-				return false;
-
-			if (!DatumGetBool(res))
-				return false;
+			if (isnull || !DatumGetBool(res))
+			{
+				matches = false;
+				break;
+			}
 		}
 
 		ExecDropSingleTupleTableSlot(econtext->ecxt_scantuple);
 		FreeExecutorState(estate);
+
+		if (!matches)
+			return false;
 	}
 
 	/* Make sure caller is aware of any attribute filter. */
@@ -650,13 +678,22 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	SpockOutputData *data = ctx->output_plugin_private;
 	MemoryContext	old;
 	Bitmapset	   *att_list = NULL;
+	uint64			bytes_sent = 0;
 
 	/* Avoid leaking memory by using and resetting our own context */
 	old = MemoryContextSwitchTo(data->context);
 
-	/* First check the table filter */
+	/*
+	 * First check the table filter. Filtered changes must release their
+	 * per-change memory too, or it piles up until the end of the transaction.
+	 */
 	if (!spock_change_filter(data, relation, change, &att_list))
+	{
+		spock_relstat_report_decode(RelationGetRelid(relation), true, 0);
+		MemoryContextSwitchTo(old);
+		MemoryContextReset(data->context);
 		return;
+	}
 
 	/*
 	 * If the protocol wants to write relation information and the client
@@ -697,6 +734,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 			data->api->write_rel(ctx->out, data, relation, att_list,
 								 nsptarget, reltarget);
 			OutputPluginWrite(ctx, false);
+			bytes_sent += ctx->out->len;
 			cached_relmeta->is_cached = true;
 			pfree(nsptarget);
 			pfree(reltarget);
@@ -707,11 +745,42 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	switch (change->action)
 	{
 		case REORDER_BUFFER_CHANGE_INSERT:
+			if (!data->client_want_sequence_batches &&
+				RelationGetRelid(relation) == get_queue_table_oid())
+			{
+				List	   *split;
+				ListCell   *lc;
+
+				/*
+				 * Older subscribers take one sequence per queued message,
+				 * send them a batch of sequence updates as separate rows.
+				 */
+				LockRelation(relation, AccessShareLock);
+				split = queued_sequences_split(relation,
+											   &change->data.tp.newtuple->tuple);
+				UnlockRelation(relation, AccessShareLock);
+
+				if (split != NIL)
+				{
+					foreach (lc, split)
+					{
+						OutputPluginPrepareWrite(ctx, true);
+						data->api->write_insert(ctx->out, data, relation,
+												(HeapTuple) lfirst(lc),
+												att_list);
+						OutputPluginWrite(ctx, true);
+						bytes_sent += ctx->out->len;
+					}
+					break;
+				}
+			}
+
 			OutputPluginPrepareWrite(ctx, true);
 			data->api->write_insert(ctx->out, data, relation,
 									&change->data.tp.newtuple->tuple,
 									att_list);
 			OutputPluginWrite(ctx, true);
+			bytes_sent += ctx->out->len;
 			break;
 		case REORDER_BUFFER_CHANGE_UPDATE:
 			{
@@ -723,6 +792,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 										&change->data.tp.newtuple->tuple,
 										att_list);
 				OutputPluginWrite(ctx, true);
+				bytes_sent += ctx->out->len;
 				break;
 			}
 		case REORDER_BUFFER_CHANGE_DELETE:
@@ -733,6 +803,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 										&change->data.tp.oldtuple->tuple,
 										att_list);
 				OutputPluginWrite(ctx, true);
+				bytes_sent += ctx->out->len;
 			}
 			else
 				elog(DEBUG1, "didn't send DELETE change because of missing oldtuple");
@@ -741,6 +812,9 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 			Assert(false);
 	}
 
+	spock_relstat_report_decode(RelationGetRelid(relation), false,
+								bytes_sent);
+
 	/* Cleanup */
 	Assert(CurrentMemoryContext == data->context);
 	MemoryContextSwitchTo(old);
@@ -828,6 +902,8 @@ relmetacache_invalidation_cb(Datum arg, Oid relid)
 	struct SPKRelMetaCacheEntry *hentry;
 	Assert (RelMetaCache != NULL);
 
+	ReplicateOnlyRelidValid = false;
+
 	/*
 	 * Nobody keeps pointers to entries in this hash table around outside
 	 * logical decoding callback calls - but invalidation events can come in
@@ -864,6 +940,7 @@ relmetacache_init(MemoryContext decoding_context)
 	int		hash_flags;
 
 	InvalidRelMetaCacheCnt = 0;
+	ReplicateOnlyRelidValid = false;
 
 	if (RelMetaCache == NULL)
 	{
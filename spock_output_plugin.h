@@ -64,6 +64,7 @@ typedef struct SpockOutputData
 	bool		client_binary_intdatetimes_set;
 	bool		client_binary_intdatetimes;
 	bool		client_no_txinfo;
+	bool		client_want_sequence_batches;
 
 	/* List of origin names */
     List	   *forward_origins;
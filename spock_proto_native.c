@@ -39,7 +39,7 @@ static char decide_datum_transfer(Form_pg_attribute att,
 								  bool allow_binary_basetypes);
 
 static void spock_read_attrs(StringInfo in, char ***attrnames,
-								  int *nattrnames);
+								  bool **attidentity, int *nattrnames);
 static void spock_read_tuple(StringInfo in, SpockRelation *rel,
 					  SpockTupleData *tuple);
 
@@ -126,7 +126,9 @@ spock_write_attrs(StringInfo out, Relation rel, Bitmapset *att_list)
 						   att_list))
 			continue;
 
-		if (bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
+		/* With REPLICA IDENTITY FULL the whole row identifies it. */
+		if (rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL ||
+			bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
 						  idattrs))
 			flags |= IS_REPLICA_IDENTITY;
 
@@ -250,18 +252,16 @@ spock_write_update(StringInfo out, SpockOutputData *data,
 	pq_sendint(out, RelationGetRelid(rel), 4);
 
 	/*
-	 * TODO: support whole tuple (O tuple type)
-	 *
-	 * Right now we can only write the key-part since logical decoding
-	 * doesn't know how to record the whole old tuple for us in WAL.
-	 * We can't use REPLICA IDENTITY FULL for this, since that makes
-	 * the key-part the whole tuple, causing issues with conflict
-	 * resultion and index lookups. We need a separate decoding option
-	 * to record whole tuples.
+	 * Logical decoding only records the key-part of the old tuple, unless
+	 * the table has REPLICA IDENTITY FULL, in which case the key-part is
+	 * the whole old tuple.
 	 */
 	if (oldtuple != NULL)
 	{
-		pq_sendbyte(out, 'K');	/* old key follows */
+		if (rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+			pq_sendbyte(out, 'O');	/* old tuple follows */
+		else
+			pq_sendbyte(out, 'K');	/* old key follows */
 		spock_write_tuple(out, data, rel, oldtuple, att_list);
 	}
 
@@ -287,12 +287,11 @@ spock_write_delete(StringInfo out, SpockOutputData *data,
 	/* use Oid as relation identifier */
 	pq_sendint(out, RelationGetRelid(rel), 4);
 
-	/*
-	 * TODO support whole tuple ('O' tuple type)
-	 *
-	 * See notes on update for details
-	 */
-	pq_sendbyte(out, 'K');	/* old key follows */
+	/* See notes on update for details. */
+	if (rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+		pq_sendbyte(out, 'O');	/* old tuple follows */
+	else
+		pq_sendbyte(out, 'K');	/* old key follows */
 	spock_write_tuple(out, data, rel, oldtuple, att_list);
 }
 
@@ -578,6 +577,20 @@ spock_read_origin(StringInfo in, XLogRecPtr *origin_lsn)
 	return pnstrdup(pq_getmsgbytes(in, len), len);
 }
 
+/*
+ * Return remote relation id of INSERT, UPDATE or DELETE message without
+ * consuming anything from the stream.
+ */
+uint32
+spock_peek_change_relid(StringInfo in)
+{
+	StringInfoData	peek = *in;
+
+	/* skip the flags */
+	(void) pq_getmsgbyte(&peek);
+
+	return pq_getmsgint(&peek, 4);
+}
 
 /*
  * Read INSERT from stream.
@@ -820,6 +833,7 @@ spock_read_rel(StringInfo in)
 	char	   *relname;
 	int			natts;
 	char	  **attrnames;
+	bool	   *attidentity;
 
 	/* read the flags */
 	flags = pq_getmsgbyte(in);
@@ -836,24 +850,25 @@ spock_read_rel(StringInfo in)
 	relname = (char *) pq_getmsgbytes(in, len);
 
 	/* Get attribute description */
-	spock_read_attrs(in, &attrnames, &natts);
+	spock_read_attrs(in, &attrnames, &attidentity, &natts);
 
-	spock_relation_cache_update(relid, schemaname, relname, natts, attrnames);
+	spock_relation_cache_update(relid, schemaname, relname, natts, attrnames,
+								attidentity);
 
 	return relid;
 }
 
 /*
  * Read relation attributes from the outputstream.
- *
- * TODO handle flags.
  */
 static void
-spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
+spock_read_attrs(StringInfo in, char ***attrnames, bool **attidentity,
+				 int *nattrnames)
 {
 	int			i;
 	uint16		nattrs;
 	char	  **attrs;
+	bool	   *identity;
 	char		blocktype;
 
 	blocktype = pq_getmsgbyte(in);
@@ -862,6 +877,7 @@ spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
 
 	nattrs = pq_getmsgint(in, 2);
 	attrs = palloc(nattrs * sizeof(char *));
+	identity = palloc(nattrs * sizeof(bool));
 
 	/* read the attributes */
 	for (i = 0; i < nattrs; i++)
@@ -871,8 +887,8 @@ spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
 		blocktype = pq_getmsgbyte(in);		/* column definition follows */
 		if (blocktype != 'C')
 			elog(ERROR, "expected COLUMN, got %c", blocktype);
-		/* read flags (we ignore them so far) */
-		(void) pq_getmsgbyte(in);
+		/* read flags */
+		identity[i] = (pq_getmsgbyte(in) & IS_REPLICA_IDENTITY) != 0;
 
 		blocktype = pq_getmsgbyte(in);		/* column name block follows */
 		if (blocktype != 'N')
@@ -885,5 +901,6 @@ spock_read_attrs(StringInfo in, char ***attrnames, int *nattrnames)
 	}
 
 	*attrnames = attrs;
+	*attidentity = identity;
 	*nattrnames = nattrs;
 }
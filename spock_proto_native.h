@@ -51,6 +51,7 @@ extern void spock_read_commit(StringInfo in, XLogRecPtr *commit_lsn,
 					   XLogRecPtr *end_lsn, TimestampTz *committime);
 extern char *spock_read_origin(StringInfo in, XLogRecPtr *origin_lsn);
 extern uint32 spock_read_rel(StringInfo in);
+extern uint32 spock_peek_change_relid(StringInfo in);
 extern SpockRelation *spock_read_insert(StringInfo in, LOCKMODE lockmode,
 					   SpockTupleData *newtup);
 extern SpockRelation *spock_read_update(StringInfo in, LOCKMODE lockmode, bool *hasoldtup,
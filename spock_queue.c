@@ -18,6 +18,7 @@
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 
 #include "catalog/dependency.h"
 #include "catalog/indexing.h"
@@ -36,6 +37,10 @@
 
 #include "parser/parse_func.h"
 
+#include "replication/slot.h"
+
+#include "storage/spin.h"
+
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
@@ -43,6 +48,7 @@
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
+#include "utils/snapmgr.h"
 #include "utils/timestamp.h"
 
 #include "spock_queue.h"
@@ -168,6 +174,168 @@ queued_message_from_tuple(HeapTuple queue_tup)
 	return res;
 }
 
+/*
+ * Split a queued message with updates of several sequences into queue tuples
+ * for one sequence each, the only form older subscribers understand.
+ *
+ * Returns NIL if the tuple is not such a message. The caller must have the
+ * queue table locked in at least AccessShare mode.
+ */
+List *
+queued_sequences_split(Relation queue_rel, HeapTuple queue_tup)
+{
+	TupleDesc		tupDesc = RelationGetDescr(queue_rel);
+	Datum			values[Natts_queue];
+	bool			nulls[Natts_queue];
+	bool			isnull;
+	Datum			d;
+	Jsonb		   *message;
+	JsonbIterator  *it;
+	JsonbValue		v;
+	int				r;
+	List		   *res = NIL;
+
+	d = fastgetattr(queue_tup, Anum_queue_message_type, tupDesc, &isnull);
+	Assert(!isnull);
+	if (DatumGetChar(d) != QUEUE_COMMAND_TYPE_SEQUENCE)
+		return NIL;
+
+	d = fastgetattr(queue_tup, Anum_queue_message, tupDesc, &isnull);
+	Assert(!isnull);
+	message = DatumGetJsonb(
+		DirectFunctionCall1(jsonb_in, DirectFunctionCall1(json_out, d)));
+	if (!JB_ROOT_IS_ARRAY(message))
+		return NIL;
+
+	heap_deform_tuple(queue_tup, tupDesc, values, nulls);
+
+	it = JsonbIteratorInit(&message->root);
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		char	   *elem;
+
+		if (r != WJB_ELEM)
+			continue;
+
+		if (v.type != jbvBinary)
+			elog(ERROR, "sequence element needs to be an object");
+
+		elem = JsonbToCString(NULL, v.val.binary.data, v.val.binary.len);
+		values[Anum_queue_message - 1] =
+			DirectFunctionCall1(json_in, CStringGetDatum(elem));
+		res = lappend(res, heap_form_tuple(tupDesc, values, nulls));
+	}
+
+	return res;
+}
+
+/*
+ * Check if confirmed_flush of every logical slot in the current database
+ * has reached the given position.
+ */
+static bool
+queue_slots_confirmed(XLogRecPtr lsn)
+{
+	bool		confirmed = true;
+	int			i;
+
+	LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+	for (i = 0; i < max_replication_slots; i++)
+	{
+		ReplicationSlot *s = &ReplicationSlotCtl->replication_slots[i];
+		XLogRecPtr	confirmed_flush;
+
+		if (!s->in_use || !SlotIsLogical(s) ||
+			s->data.database != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&s->mutex);
+		confirmed_flush = s->data.confirmed_flush;
+		SpinLockRelease(&s->mutex);
+
+		/* Slot that is still being created is not consistent yet. */
+		if (XLogRecPtrIsInvalid(confirmed_flush) || confirmed_flush < lsn)
+		{
+			confirmed = false;
+			break;
+		}
+	}
+	LWLockRelease(ReplicationSlotControlLock);
+
+	return confirmed;
+}
+
+/*
+ * Remove rows from the queue table which were already decoded by all the
+ * logical slots in this database.
+ *
+ * The queue table does not record the commit position of the rows, so we
+ * remember the xmin of a fresh snapshot along with the current WAL insert
+ * position on every call. All rows inserted by transactions older than that
+ * xmin committed before that position, so once confirmed_flush of every slot
+ * passes it, a later call can remove them. The mark is only moved forward
+ * after the slots have caught up with it.
+ *
+ * Rows queued less than min_retention seconds ago are always kept.
+ *
+ * Must be called inside a transaction. Returns number of removed rows.
+ */
+uint64
+prune_queue(int min_retention)
+{
+	static TransactionId	prune_xmin = InvalidTransactionId;
+	static XLogRecPtr		prune_lsn = InvalidXLogRecPtr;
+	uint64		pruned = 0;
+
+	if (TransactionIdIsValid(prune_xmin))
+	{
+		RangeVar	   *rv;
+		Relation		rel;
+		TupleDesc		tupDesc;
+		SysScanDesc		scan;
+		HeapTuple		tuple;
+		TimestampTz		cutoff;
+
+		if (!queue_slots_confirmed(prune_lsn))
+			return 0;
+
+		cutoff = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+											 -((int64) min_retention * 1000));
+
+		rv = makeRangeVar(EXTENSION_NAME, CATALOG_QUEUE, -1);
+		rel = table_openrv(rv, RowExclusiveLock);
+		tupDesc = RelationGetDescr(rel);
+
+		scan = systable_beginscan(rel, 0, true, NULL, 0, NULL);
+		while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+		{
+			bool		isnull;
+			Datum		d;
+
+			if (!TransactionIdPrecedes(HeapTupleHeaderGetXmin(tuple->t_data),
+									   prune_xmin))
+				continue;
+
+			d = fastgetattr(tuple, Anum_queue_queued_at, tupDesc, &isnull);
+			Assert(!isnull);
+			if (DatumGetTimestampTz(d) >= cutoff)
+				continue;
+
+			CatalogTupleDelete(rel, &tuple->t_self);
+			pruned++;
+		}
+
+		systable_endscan(scan);
+		table_close(rel, NoLock);
+	}
+
+	/* Remember new mark for the next round. */
+	prune_xmin = GetLatestSnapshot()->xmin;
+	prune_lsn = GetXLogInsertRecPtr();
+
+	return pruned;
+}
+
 /*
  * Get (cached) oid of the queue table.
  */
@@ -33,6 +33,9 @@ extern void queue_message(List *replication_sets, Oid roleoid,
 						  char message_type, char *message);
 
 extern QueuedMessage *queued_message_from_tuple(HeapTuple queue_tup);
+extern List *queued_sequences_split(Relation queue_rel, HeapTuple queue_tup);
+
+extern uint64 prune_queue(int min_retention);
 
 extern Oid get_queue_table_oid(void);
 
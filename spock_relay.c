@@ -0,0 +1,697 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_relay.c
+ * 		local relay log of the changes received by the apply worker
+ *
+ * Copyright (c) 2017-2020, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		  spock_relay.c
+ *
+ * With spock.relay_log enabled the apply worker does not apply the change
+ * stream as it arrives. Every message is appended to segment files in
+ * pg_logical/spock_relay/<subscription oid> instead, the files are fsynced
+ * in batches and the provider is told that everything up to the last durable
+ * commit was flushed, which lets it recycle WAL without waiting for the
+ * apply. Complete transactions are then applied from the files, so a
+ * restarted worker only needs to stream what was not relayed yet.
+ *
+ * Transactions never span segments and a segment is only removed once all
+ * its transactions were applied and the local commits flushed.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "miscadmin.h"
+
+#include "access/xact.h"
+
+#include "storage/fd.h"
+
+#include "utils/memutils.h"
+
+#include "spock_compat.h"
+#include "spock_proto_native.h"
+#include "spock_relay.h"
+
+#define SPOCK_RELAY_DIR				"pg_logical/spock_relay"
+#define SPOCK_RELAY_SEGMENT_SIZE	(16 * 1024 * 1024)
+#define SPOCK_RELAY_WRITE_BUFFER	(64 * 1024)
+
+typedef struct RelayRecordHeader
+{
+	uint32		len;			/* length of the message */
+	XLogRecPtr	commit_end;		/* end_lsn of commit messages */
+} RelayRecordHeader;
+
+typedef struct RelaySegment
+{
+	uint32		segno;
+	XLogRecPtr	last_commit_end;	/* last transaction in the segment */
+} RelaySegment;
+
+bool		spock_relay_log = false;
+
+static char			relay_dir[MAXPGPATH];
+static List		   *relay_segments = NIL;	/* oldest first, never empty */
+
+/* Writing, always to the last segment. */
+static int			write_fd = -1;
+static off_t		write_off = 0;
+static StringInfo	write_buf = NULL;		/* not yet written to write_fd */
+static off_t		complete_off = 0;		/* end of the last commit */
+static XLogRecPtr	received_lsn = InvalidXLogRecPtr;
+static XLogRecPtr	durable_lsn = InvalidXLogRecPtr;
+static bool			write_needs_sync = false;
+
+/* Reading. */
+static int			read_fd = -1;
+static uint32		read_segno = 0;
+static off_t		read_off = 0;
+static off_t		unread_off = 0;
+
+/* Relay logs of subscriptions dropped by the current transaction. */
+static List		   *relay_drop_pending = NIL;
+static bool			relay_xact_callback_registered = false;
+
+static void
+relay_subscription_dir(char *path, Oid subid)
+{
+	snprintf(path, MAXPGPATH, "%s/%u", SPOCK_RELAY_DIR, subid);
+}
+
+static void
+relay_segment_path(char *path, uint32 segno)
+{
+	snprintf(path, MAXPGPATH, "%s/%08X", relay_dir, segno);
+}
+
+static int
+relay_open_segment(uint32 segno, int flags)
+{
+	char		path[MAXPGPATH];
+	int			fd;
+
+	relay_segment_path(path, segno);
+	fd = SPKBasicOpenFile(path, flags | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open relay log file \"%s\": %m", path)));
+
+	return fd;
+}
+
+static void
+relay_seek(int fd, uint32 segno, off_t off)
+{
+	if (lseek(fd, off, SEEK_SET) != off)
+	{
+		char		path[MAXPGPATH];
+
+		relay_segment_path(path, segno);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in relay log file \"%s\": %m", path)));
+	}
+}
+
+/*
+ * Read up to len bytes, returns less only at the end of the file.
+ */
+static size_t
+relay_read_bytes(int fd, uint32 segno, char *data, size_t len)
+{
+	size_t		done = 0;
+
+	while (done < len)
+	{
+		ssize_t		r = read(fd, data + done, len - done);
+
+		if (r < 0)
+		{
+			char		path[MAXPGPATH];
+
+			if (errno == EINTR)
+				continue;
+
+			relay_segment_path(path, segno);
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read relay log file \"%s\": %m",
+							path)));
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+
+	return done;
+}
+
+static void
+relay_write_buffer(void)
+{
+	RelaySegment   *seg = (RelaySegment *) llast(relay_segments);
+
+	if (write_buf->len == 0)
+		return;
+
+	errno = 0;
+	if (write(write_fd, write_buf->data, write_buf->len) != write_buf->len)
+	{
+		char		path[MAXPGPATH];
+
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+
+		relay_segment_path(path, seg->segno);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write relay log file \"%s\": %m", path)));
+	}
+
+	write_off += write_buf->len;
+	resetStringInfo(write_buf);
+	write_needs_sync = true;
+}
+
+static void
+relay_sync(void)
+{
+	if (write_needs_sync)
+	{
+		if (pg_fsync(write_fd) != 0)
+		{
+			char		path[MAXPGPATH];
+
+			relay_segment_path(path,
+							   ((RelaySegment *) llast(relay_segments))->segno);
+			ereport(data_sync_elevel(ERROR),
+					(errcode_for_file_access(),
+					 errmsg("could not fsync relay log file \"%s\": %m",
+							path)));
+		}
+		write_needs_sync = false;
+	}
+
+	durable_lsn = received_lsn;
+}
+
+static void
+relay_new_segment(uint32 segno)
+{
+	MemoryContext	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+	RelaySegment   *seg = palloc(sizeof(RelaySegment));
+
+	write_fd = relay_open_segment(segno, O_WRONLY | O_CREAT | O_TRUNC);
+	write_off = complete_off = 0;
+
+	seg->segno = segno;
+	seg->last_commit_end = InvalidXLogRecPtr;
+	relay_segments = lappend(relay_segments, seg);
+
+	MemoryContextSwitchTo(oldctx);
+
+	fsync_fname(relay_dir, true);
+}
+
+/*
+ * Find the complete transactions in the segment, truncating whatever follows
+ * the last one, and move the read position past the ones already applied.
+ *
+ * Returns the end of the last complete transaction.
+ */
+static off_t
+relay_scan_segment(RelaySegment *seg, XLogRecPtr applied_lsn)
+{
+	int				fd = relay_open_segment(seg->segno, O_RDWR);
+	StringInfoData	data;
+	off_t			off = 0;
+	off_t			complete = 0;
+
+	initStringInfo(&data);
+
+	for (;;)
+	{
+		RelayRecordHeader	hdr;
+
+		if (relay_read_bytes(fd, seg->segno, (char *) &hdr, sizeof(hdr))
+			!= sizeof(hdr))
+			break;
+
+		resetStringInfo(&data);
+		enlargeStringInfo(&data, hdr.len);
+		if (relay_read_bytes(fd, seg->segno, data.data, hdr.len) != hdr.len)
+			break;
+
+		off += sizeof(hdr) + hdr.len;
+
+		if (hdr.len > 0 && data.data[0] == 'C')
+		{
+			complete = off;
+			seg->last_commit_end = hdr.commit_end;
+
+			if (hdr.commit_end <= applied_lsn)
+			{
+				read_segno = seg->segno;
+				read_off = off;
+			}
+		}
+	}
+
+	/* Partially received transaction is streamed again. */
+	if (lseek(fd, 0, SEEK_END) != complete && ftruncate(fd, complete) != 0)
+	{
+		char		path[MAXPGPATH];
+
+		relay_segment_path(path, seg->segno);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not truncate relay log file \"%s\": %m",
+						path)));
+	}
+
+	close(fd);
+	pfree(data.data);
+
+	return complete;
+}
+
+static uint32
+relay_next_segno(uint32 segno)
+{
+	ListCell   *lc;
+
+	foreach (lc, relay_segments)
+	{
+		RelaySegment   *seg = (RelaySegment *) lfirst(lc);
+
+		if (seg->segno > segno)
+			return seg->segno;
+	}
+
+	elog(ERROR, "relay log segment following %08X not found", segno);
+	return 0;					/* keep compiler quiet */
+}
+
+static int
+relay_segno_cmp(const void *a, const void *b)
+{
+	uint32		sa = *(const uint32 *) a;
+	uint32		sb = *(const uint32 *) b;
+
+	return (sa > sb) - (sa < sb);
+}
+
+/*
+ * Does the subscription have a relay log?
+ */
+bool
+spock_relay_exists(Oid subid)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	relay_subscription_dir(path, subid);
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Open (and create if needed) the relay log of the subscription.
+ *
+ * applied_lsn is the replication origin progress, transactions up to it
+ * are not replayed. Returns the position the streaming should start at.
+ */
+XLogRecPtr
+spock_relay_open(Oid subid, XLogRecPtr applied_lsn)
+{
+	DIR			   *dir;
+	struct dirent  *de;
+	uint32		   *segnos;
+	int				nsegnos = 0;
+	int				maxsegnos = 16;
+	int				i;
+	MemoryContext	oldctx;
+
+	relay_subscription_dir(relay_dir, subid);
+	if (pg_mkdir_p(relay_dir, S_IRWXU) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						relay_dir)));
+
+	segnos = palloc(maxsegnos * sizeof(uint32));
+	dir = AllocateDir(relay_dir);
+	while ((de = ReadDir(dir, relay_dir)) != NULL)
+	{
+		if (strlen(de->d_name) != 8 ||
+			strspn(de->d_name, "0123456789ABCDEF") != 8)
+			continue;
+
+		if (nsegnos == maxsegnos)
+		{
+			maxsegnos *= 2;
+			segnos = repalloc(segnos, maxsegnos * sizeof(uint32));
+		}
+		segnos[nsegnos++] = (uint32) strtoul(de->d_name, NULL, 16);
+	}
+	FreeDir(dir);
+
+	qsort(segnos, nsegnos, sizeof(uint32), relay_segno_cmp);
+
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+	write_buf = makeStringInfo();
+	received_lsn = InvalidXLogRecPtr;
+	read_segno = nsegnos > 0 ? segnos[0] : 0;
+	read_off = 0;
+	complete_off = 0;
+
+	for (i = 0; i < nsegnos; i++)
+	{
+		RelaySegment   *seg = palloc(sizeof(RelaySegment));
+
+		seg->segno = segnos[i];
+		seg->last_commit_end = InvalidXLogRecPtr;
+		complete_off = relay_scan_segment(seg, applied_lsn);
+		if (seg->last_commit_end != InvalidXLogRecPtr)
+			received_lsn = seg->last_commit_end;
+
+		relay_segments = lappend(relay_segments, seg);
+	}
+
+	MemoryContextSwitchTo(oldctx);
+	pfree(segnos);
+
+	if (relay_segments == NIL)
+		relay_new_segment(0);
+	else
+	{
+		RelaySegment   *seg = (RelaySegment *) llast(relay_segments);
+
+		write_fd = relay_open_segment(seg->segno, O_WRONLY);
+		relay_seek(write_fd, seg->segno, complete_off);
+		write_off = complete_off;
+	}
+
+	/* The previous worker might have exited before syncing. */
+	write_needs_sync = true;
+	durable_lsn = InvalidXLogRecPtr;
+
+	spock_relay_discard(applied_lsn);
+
+	elog(DEBUG1, "relay log of subscription %u contains transactions up to %X/%X",
+		 subid, (uint32) (received_lsn >> 32), (uint32) received_lsn);
+
+	return Max(received_lsn, applied_lsn);
+}
+
+/*
+ * Remove the relay log of the running worker, which must have been drained.
+ */
+void
+spock_relay_remove(void)
+{
+	Assert(spock_relay_drained());
+
+	if (read_fd >= 0)
+		close(read_fd);
+	read_fd = -1;
+	close(write_fd);
+	write_fd = -1;
+
+	if (!rmtree(relay_dir, true))
+		ereport(WARNING,
+				(errmsg("could not remove relay log directory \"%s\"",
+						relay_dir)));
+
+	list_free_deep(relay_segments);
+	relay_segments = NIL;
+	relay_dir[0] = '\0';
+}
+
+static void
+relay_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			foreach (lc, relay_drop_pending)
+			{
+				char		path[MAXPGPATH];
+
+				relay_subscription_dir(path, lfirst_oid(lc));
+				if (!rmtree(path, true))
+					ereport(WARNING,
+							(errmsg("could not remove relay log directory \"%s\"",
+									path)));
+			}
+			/* fallthrough */
+		case XACT_EVENT_ABORT:
+			list_free(relay_drop_pending);
+			relay_drop_pending = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Remove the relay log of a dropped subscription once the drop commits.
+ */
+void
+spock_relay_drop(Oid subid)
+{
+	MemoryContext	oldctx;
+
+	if (!spock_relay_exists(subid))
+		return;
+
+	if (!relay_xact_callback_registered)
+	{
+		RegisterXactCallback(relay_xact_callback, NULL);
+		relay_xact_callback_registered = true;
+	}
+
+	oldctx = MemoryContextSwitchTo(TopMemoryContext);
+	relay_drop_pending = lappend_oid(relay_drop_pending, subid);
+	MemoryContextSwitchTo(oldctx);
+}
+
+/*
+ * Append message received from the provider.
+ */
+void
+spock_relay_append(const char *data, int len)
+{
+	RelayRecordHeader	hdr;
+
+	hdr.len = len;
+	hdr.commit_end = InvalidXLogRecPtr;
+
+	if (len > 0 && data[0] == 'C')
+	{
+		StringInfoData	s;
+		XLogRecPtr		commit_lsn;
+		TimestampTz		commit_time;
+
+		s.data = (char *) data;
+		s.len = len;
+		s.maxlen = -1;
+		s.cursor = 1;
+		spock_read_commit(&s, &commit_lsn, &hdr.commit_end, &commit_time);
+	}
+
+	appendBinaryStringInfo(write_buf, (char *) &hdr, sizeof(hdr));
+	appendBinaryStringInfo(write_buf, data, len);
+
+	if (hdr.commit_end != InvalidXLogRecPtr)
+	{
+		RelaySegment   *seg = (RelaySegment *) llast(relay_segments);
+
+		/* Complete transactions are readable right away. */
+		relay_write_buffer();
+		complete_off = write_off;
+		received_lsn = seg->last_commit_end = hdr.commit_end;
+
+		if (write_off >= SPOCK_RELAY_SEGMENT_SIZE)
+		{
+			relay_sync();
+			close(write_fd);
+			relay_new_segment(seg->segno + 1);
+		}
+	}
+	else if (write_buf->len >= SPOCK_RELAY_WRITE_BUFFER)
+		relay_write_buffer();
+}
+
+/*
+ * Throw away the partially received transaction at the end of the relay log,
+ * for when the stream is restarted. Returns the position the streaming
+ * should restart at.
+ */
+XLogRecPtr
+spock_relay_rewind(XLogRecPtr applied_lsn)
+{
+	RelaySegment   *seg = (RelaySegment *) llast(relay_segments);
+
+	resetStringInfo(write_buf);
+
+	if (write_off != complete_off)
+	{
+		if (ftruncate(write_fd, complete_off) != 0)
+		{
+			char		path[MAXPGPATH];
+
+			relay_segment_path(path, seg->segno);
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not truncate relay log file \"%s\": %m",
+							path)));
+		}
+		relay_seek(write_fd, seg->segno, complete_off);
+		write_off = complete_off;
+	}
+
+	return Max(received_lsn, applied_lsn);
+}
+
+/*
+ * Make the relay log durable. Returns end of the last durable transaction.
+ */
+XLogRecPtr
+spock_relay_flush(void)
+{
+	relay_sync();
+
+	return durable_lsn;
+}
+
+/*
+ * Is everything received durable, with no transaction received partially?
+ */
+bool
+spock_relay_idle(void)
+{
+	return write_buf->len == 0 && write_off == complete_off &&
+		!write_needs_sync;
+}
+
+/*
+ * Read next message of the complete transactions, returns false if there is
+ * none.
+ */
+bool
+spock_relay_read(StringInfo buf)
+{
+	RelaySegment	   *wseg = (RelaySegment *) llast(relay_segments);
+	RelayRecordHeader	hdr;
+	size_t				r;
+
+	for (;;)
+	{
+		if (read_segno == wseg->segno && read_off >= complete_off)
+			return false;
+
+		if (read_fd < 0)
+		{
+			read_fd = relay_open_segment(read_segno, O_RDONLY);
+			relay_seek(read_fd, read_segno, read_off);
+		}
+
+		r = relay_read_bytes(read_fd, read_segno, (char *) &hdr, sizeof(hdr));
+		if (r > 0 || read_segno == wseg->segno)
+			break;
+
+		/* Finished older segment, continue with the next one. */
+		close(read_fd);
+		read_fd = -1;
+		read_off = 0;
+		read_segno = relay_next_segno(read_segno);
+	}
+
+	if (r != sizeof(hdr))
+		goto truncated;
+
+	resetStringInfo(buf);
+	enlargeStringInfo(buf, hdr.len);
+	if (relay_read_bytes(read_fd, read_segno, buf->data, hdr.len) != hdr.len)
+		goto truncated;
+	buf->len = hdr.len;
+	buf->data[hdr.len] = '\0';
+
+	unread_off = read_off;
+	read_off += sizeof(hdr) + hdr.len;
+
+	return true;
+
+truncated:
+	{
+		char		path[MAXPGPATH];
+
+		relay_segment_path(path, read_segno);
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("relay log file \"%s\" is truncated", path)));
+	}
+	return false;				/* keep compiler quiet */
+}
+
+/*
+ * Step back before the message returned by the last spock_relay_read().
+ */
+void
+spock_relay_unread(void)
+{
+	read_off = unread_off;
+	relay_seek(read_fd, read_segno, read_off);
+}
+
+/*
+ * Was everything received applied?
+ */
+bool
+spock_relay_drained(void)
+{
+	RelaySegment   *wseg = (RelaySegment *) llast(relay_segments);
+
+	return read_segno == wseg->segno && read_off >= complete_off &&
+		write_buf->len == 0 && write_off == complete_off;
+}
+
+/*
+ * Remove the segments whose transactions were all applied and flushed
+ * locally up to applied_lsn.
+ */
+void
+spock_relay_discard(XLogRecPtr applied_lsn)
+{
+	while (list_length(relay_segments) > 1)
+	{
+		RelaySegment   *seg = (RelaySegment *) linitial(relay_segments);
+		char			path[MAXPGPATH];
+
+		if (seg->segno >= read_segno ||
+			seg->last_commit_end > applied_lsn)
+			break;
+
+		relay_segment_path(path, seg->segno);
+		if (unlink(path) != 0 && errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not remove relay log file \"%s\": %m",
+							path)));
+
+		relay_segments = list_delete_first(relay_segments);
+		pfree(seg);
+	}
+}
@@ -0,0 +1,36 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_relay.h
+ * 		local relay log of the changes received by the apply worker
+ *
+ * Copyright (c) 2017-2020, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		spock_relay.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_RELAY_H
+#define SPOCK_RELAY_H
+
+#include "access/xlogdefs.h"
+#include "lib/stringinfo.h"
+
+extern bool spock_relay_log;
+
+extern bool spock_relay_exists(Oid subid);
+extern XLogRecPtr spock_relay_open(Oid subid, XLogRecPtr applied_lsn);
+extern void spock_relay_remove(void);
+extern void spock_relay_drop(Oid subid);
+
+extern void spock_relay_append(const char *data, int len);
+extern XLogRecPtr spock_relay_rewind(XLogRecPtr applied_lsn);
+extern XLogRecPtr spock_relay_flush(void);
+extern bool spock_relay_idle(void);
+
+extern bool spock_relay_read(StringInfo buf);
+extern void spock_relay_unread(void);
+extern bool spock_relay_drained(void);
+extern void spock_relay_discard(XLogRecPtr applied_lsn);
+
+#endif /* SPOCK_RELAY_H */
@@ -31,10 +31,42 @@
 #define SPOCKRELATIONHASH_INITIAL_SIZE 128
 static HTAB *SpockRelationHash = NULL;
 
+/*
+ * Remote relation ids are only unique per upstream, so the cache is keyed by
+ * the subscription as well. Must match the start of SpockRelation.
+ */
+typedef struct SpockRelationKey
+{
+	uint32		remoteid;
+	Oid			subid;
+} SpockRelationKey;
+
+/* Subscription whose mappings are currently being looked up. */
+static Oid	SpockRelcacheSubid = InvalidOid;
+
 
 static void spock_relcache_init(void);
 static int tupdesc_get_att_by_name(TupleDesc desc, const char *attname);
 
+static inline void
+relcache_key_init(SpockRelationKey *key, uint32 remoteid)
+{
+	memset(key, 0, sizeof(SpockRelationKey));
+	key->remoteid = remoteid;
+	key->subid = SpockRelcacheSubid;
+}
+
+/*
+ * Set the subscription used to qualify remote relation ids.
+ *
+ * Workers applying a single subscription never need to call this.
+ */
+void
+spock_relation_cache_set_subscription(Oid subid)
+{
+	SpockRelcacheSubid = subid;
+}
+
 static void
 relcache_free_entry(SpockRelation *entry)
 {
@@ -51,6 +83,9 @@ relcache_free_entry(SpockRelation *entry)
 		pfree(entry->attnames);
 	}
 
+	if (entry->attidentity)
+		pfree(entry->attidentity);
+
 	if (entry->attmap)
 		pfree(entry->attmap);
 
@@ -60,17 +95,36 @@ relcache_free_entry(SpockRelation *entry)
 }
 
 
+/*
+ * Find cache entry of remote relation without opening the local relation.
+ *
+ * Returns NULL if the relation was not received yet.
+ */
+SpockRelation *
+spock_relation_lookup(uint32 remoteid)
+{
+	SpockRelationKey key;
+
+	if (SpockRelationHash == NULL)
+		return NULL;
+
+	relcache_key_init(&key, remoteid);
+	return hash_search(SpockRelationHash, (void *) &key, HASH_FIND, NULL);
+}
+
 SpockRelation *
 spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 {
 	SpockRelation *entry;
+	SpockRelationKey key;
 	bool		found;
 
 	if (SpockRelationHash == NULL)
 		spock_relcache_init();
 
 	/* Search for existing entry. */
-	entry = hash_search(SpockRelationHash, (void *) &remoteid,
+	relcache_key_init(&key, remoteid);
+	entry = hash_search(SpockRelationHash, (void *) &key,
 						HASH_FIND, &found);
 
 	if (!found)
@@ -124,10 +178,12 @@ spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 
 void
 spock_relation_cache_update(uint32 remoteid, char *schemaname,
-								 char *relname, int natts, char **attnames)
+								 char *relname, int natts, char **attnames,
+								 bool *attidentity)
 {
 	MemoryContext		oldcontext;
 	SpockRelation  *entry;
+	SpockRelationKey	key;
 	bool				found;
 	int					i;
 
@@ -137,7 +193,8 @@ spock_relation_cache_update(uint32 remoteid, char *schemaname,
 	/*
 	 * HASH_ENTER returns the existing entry if present or creates a new one.
 	 */
-	entry = hash_search(SpockRelationHash, (void *) &remoteid,
+	relcache_key_init(&key, remoteid);
+	entry = hash_search(SpockRelationHash, (void *) &key,
 						HASH_ENTER, &found);
 
 	if (found)
@@ -151,6 +208,12 @@ spock_relation_cache_update(uint32 remoteid, char *schemaname,
 	entry->attnames = palloc(natts * sizeof(char *));
 	for (i = 0; i < natts; i++)
 		entry->attnames[i] = pstrdup(attnames[i]);
+	entry->attidentity = NULL;
+	if (attidentity != NULL)
+	{
+		entry->attidentity = palloc(natts * sizeof(bool));
+		memcpy(entry->attidentity, attidentity, natts * sizeof(bool));
+	}
 	entry->attmap = palloc(natts * sizeof(int));
 	MemoryContextSwitchTo(oldcontext);
 
@@ -164,6 +227,7 @@ spock_relation_cache_updater(SpockRemoteRel *remoterel)
 {
 	MemoryContext		oldcontext;
 	SpockRelation  *entry;
+	SpockRelationKey	key;
 	bool				found;
 	int					i;
 
@@ -173,7 +237,8 @@ spock_relation_cache_updater(SpockRemoteRel *remoterel)
 	/*
 	 * HASH_ENTER returns the existing entry if present or creates a new one.
 	 */
-	entry = hash_search(SpockRelationHash, (void *) &remoterel->relid,
+	relcache_key_init(&key, remoterel->relid);
+	entry = hash_search(SpockRelationHash, (void *) &key,
 						HASH_ENTER, &found);
 
 	if (found)
@@ -187,6 +252,7 @@ spock_relation_cache_updater(SpockRemoteRel *remoterel)
 	entry->attnames = palloc(remoterel->natts * sizeof(char *));
 	for (i = 0; i < remoterel->natts; i++)
 		entry->attnames[i] = pstrdup(remoterel->attnames[i]);
+	entry->attidentity = NULL;
 	entry->attmap = palloc(remoterel->natts * sizeof(int));
 	MemoryContextSwitchTo(oldcontext);
 
@@ -248,7 +314,7 @@ spock_relcache_init(void)
 
 	/* Initialize the hash table. */
 	MemSet(&ctl, 0, sizeof(ctl));
-	ctl.keysize = sizeof(uint32);
+	ctl.keysize = sizeof(SpockRelationKey);
 	ctl.entrysize = sizeof(SpockRelation);
 	ctl.hcxt = CacheMemoryContext;
 	hashflags = HASH_ELEM | HASH_CONTEXT;
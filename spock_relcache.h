@@ -34,12 +34,16 @@ typedef struct SpockRelation
 {
 	/* Info coming from the remote side. */
 	uint32		remoteid;
+	/* Subscription the mapping was received on, part of the hash key. */
+	Oid			subid;
 	/* the nspanme and relname are always the target names, we don't know origin
 	 * (remote) names */
 	char	   *nspname;
 	char	   *relname;
 	int			natts;
 	char	  **attnames;
+	/* Remote REPLICA IDENTITY attributes, NULL if not known. */
+	bool	   *attidentity;
 
 	/* Mapping to local relation, filled as needed. */
 	Oid			reloid;
@@ -52,14 +56,17 @@ typedef struct SpockRelation
 
 extern void spock_relation_cache_update(uint32 remoteid,
 											 char *schemaname, char *relname,
-											 int natts, char **attnames);
+											 int natts, char **attnames,
+											 bool *attidentity);
 extern void spock_relation_cache_updater(SpockRemoteRel *remoterel);
 
+extern SpockRelation *spock_relation_lookup(uint32 remoteid);
 extern SpockRelation *spock_relation_open(uint32 remoteid,
 												   LOCKMODE lockmode);
 extern void spock_relation_close(SpockRelation * rel,
 									  LOCKMODE lockmode);
 extern void spock_relation_invalidate_cb(Datum arg, Oid reloid);
+extern void spock_relation_cache_set_subscription(Oid subid);
 
 struct SpockTupleData;
 
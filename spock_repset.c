@@ -1039,6 +1039,7 @@ alter_replication_set(SpockRepSet *repset)
 				if (targetrel->rd_indexvalid == 0)
 					RelationGetIndexList(targetrel);
 				if (!OidIsValid(targetrel->rd_replidindex) &&
+					targetrel->rd_rel->relreplident != REPLICA_IDENTITY_FULL &&
 					(repset->replicate_update || repset->replicate_delete))
 					ereport(ERROR,
 							(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
@@ -1302,6 +1303,7 @@ replication_set_add_table(Oid setid, Oid reloid, List *att_list,
 	if (targetrel->rd_indexvalid == 0)
 		RelationGetIndexList(targetrel);
 	if (!OidIsValid(targetrel->rd_replidindex) &&
+		targetrel->rd_rel->relreplident != REPLICA_IDENTITY_FULL &&
 		(repset->replicate_update || repset->replicate_delete))
 		ereport(ERROR,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
@@ -1310,7 +1312,7 @@ replication_set_add_table(Oid setid, Oid reloid, List *att_list,
 				 errdetail("table does not have PRIMARY KEY and given "
 						   "replication set is configured to replicate "
 						   "UPDATEs and/or DELETEs"),
-				 errhint("Add a PRIMARY KEY to the table")));
+				 errhint("Add a PRIMARY KEY to the table or set its REPLICA IDENTITY to FULL")));
 
 	create_truncate_trigger(targetrel);
 
@@ -209,6 +209,115 @@ pg_logical_get_remote_repset_table(PGconn *conn, RangeVar *rv,
 	return tables;
 }
 
+/*
+ * Fetch the row filters defined for a table in the specified replication
+ * sets, deparsed on the origin into a single boolean expression that can be
+ * used in the WHERE clause of a query over the table.
+ *
+ * The filters from all matching replication sets are ANDed together, which
+ * is the same semantics the output plugin and table_data_filtered() use.
+ *
+ * Returns NULL if the table has no row filter in any of the sets.
+ */
+char *
+pg_logical_get_remote_repset_row_filter(PGconn *conn, Oid relid,
+										List *replication_sets)
+{
+	PGresult   *res;
+	int			i;
+	ListCell   *lc;
+	bool		first = true;
+	StringInfoData	query;
+	StringInfoData	repsetarr;
+	StringInfoData	filter;
+
+	initStringInfo(&repsetarr);
+	foreach (lc, replication_sets)
+	{
+		char	   *repset_name = lfirst(lc);
+
+		if (first)
+			first = false;
+		else
+			appendStringInfoChar(&repsetarr, ',');
+
+		appendStringInfo(&repsetarr, "%s",
+						 PQescapeLiteral(conn, repset_name, strlen(repset_name)));
+	}
+
+	/*
+	 * Deparse with pg_get_expr() in the same session that will run the COPY,
+	 * so that any object references are qualified according to the search
+	 * path that the query will be executed with.
+	 */
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT pg_catalog.pg_get_expr(t.set_row_filter, t.set_reloid)"
+					 "  FROM spock.replication_set_table t,"
+					 "       spock.replication_set s,"
+					 "       spock.local_node n"
+					 " WHERE s.set_nodeid = n.node_id AND s.set_id = t.set_id"
+					 "   AND t.set_reloid = %u AND t.set_row_filter IS NOT NULL"
+					 "   AND s.set_name = ANY(ARRAY[%s])",
+					 relid, repsetarr.data);
+
+	res = PQexec(conn, query.data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		elog(ERROR, "could not get row filter for table: %s",
+			 PQresultErrorMessage(res));
+
+	if (PQntuples(res) == 0)
+	{
+		PQclear(res);
+		return NULL;
+	}
+
+	initStringInfo(&filter);
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		if (i > 0)
+			appendStringInfoString(&filter, " AND ");
+		appendStringInfo(&filter, "(%s)", PQgetvalue(res, i, 0));
+	}
+
+	PQclear(res);
+
+	return filter.data;
+}
+
+/*
+ * Get the origin's estimate of table size in bytes and rows.
+ */
+void
+pg_logical_get_remote_table_size(PGconn *conn, Oid relid, int64 *bytes,
+								 int64 *rows)
+{
+	PGresult   *res;
+	StringInfoData	query;
+
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT pg_catalog.pg_relation_size(c.oid),"
+					 "       c.reltuples::bigint"
+					 "  FROM pg_catalog.pg_class c"
+					 " WHERE c.oid = %u", relid);
+
+	res = PQexec(conn, query.data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		elog(ERROR, "could not get size of table: %s",
+			 PQresultErrorMessage(res));
+
+	*bytes = 0;
+	*rows = 0;
+	if (PQntuples(res) > 0)
+	{
+		*bytes = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+		*rows = Max(strtoll(PQgetvalue(res, 0, 1), NULL, 10), 0);
+	}
+
+	PQclear(res);
+}
+
 /*
  * Fetch list of sequences that are grouped in specified replication sets.
  */
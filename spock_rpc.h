@@ -21,6 +21,10 @@ extern List *pg_logical_get_remote_repset_table(PGconn *conn,
 								  RangeVar *rv, List *replication_sets);
 extern List *pg_logical_get_remote_repset_sequences(PGconn *conn,
 									List *replication_sets);
+extern char *pg_logical_get_remote_repset_row_filter(PGconn *conn, Oid relid,
+									List *replication_sets);
+extern void pg_logical_get_remote_table_size(PGconn *conn, Oid relid,
+									int64 *bytes, int64 *rows);
 
 extern bool spock_remote_slot_active(PGconn *conn, const char *slot_name);
 extern void spock_drop_remote_slot(PGconn *conn, const char *slot_name);
@@ -52,6 +52,12 @@ typedef struct SeqTargets {
 	List		*repsets;
 } SeqTargets;
 
+/* Sequence updates collected for a single replication set. */
+typedef struct SeqBatch {
+	char	   *repset_name;
+	StringInfoData json;
+} SeqBatch;
+
 #define Natts_sequence_state			3
 #define Anum_sequence_state_seqoid		1
 #define Anum_sequence_state_cache_size	2
@@ -81,8 +87,53 @@ sequence_get_last_value(Oid seqoid)
 }
 
 
+/*
+ * Add sequence update to the batch for the given replication set.
+ */
+static List *
+seqbatch_add(List *batches, SpockRepSetSeq *t, int64 last_value)
+{
+	SeqBatch   *batch = NULL;
+	ListCell   *lc;
+
+	foreach (lc, batches)
+	{
+		SeqBatch   *b = (SeqBatch *) lfirst(lc);
+
+		if (strcmp(b->repset_name, t->repset_name) == 0)
+		{
+			batch = b;
+			break;
+		}
+	}
+
+	if (batch == NULL)
+	{
+		batch = (SeqBatch *) palloc(sizeof(SeqBatch));
+		batch->repset_name = pstrdup(t->repset_name);
+		initStringInfo(&batch->json);
+		appendStringInfoChar(&batch->json, '[');
+		batches = lappend(batches, batch);
+	}
+	else
+		appendStringInfoChar(&batch->json, ',');
+
+	appendStringInfoString(&batch->json, "{\"schema_name\": ");
+	escape_json(&batch->json, t->nsptarget);
+	appendStringInfoString(&batch->json, ",\"sequence_name\": ");
+	escape_json(&batch->json, t->seqtarget);
+	appendStringInfo(&batch->json, ",\"last_value\": \""INT64_FORMAT"\"",
+					 last_value);
+	appendStringInfoChar(&batch->json, '}');
+
+	return batches;
+}
+
 /*
  * Process sequence updates.
+ *
+ * Updates of all the sequences in a replication set are sent as single
+ * queued message.
  */
 bool
 synchronize_sequences(void)
@@ -92,6 +143,8 @@ synchronize_sequences(void)
 	SysScanDesc		scan;
 	HeapTuple		tuple;
 	SpockLocalNode	   *local_node;
+	List		   *batches = NIL;
+	ListCell	   *lc;
 	bool			ret = true;
 
 	StartTransactionCommand();
@@ -116,7 +169,6 @@ synchronize_sequences(void)
 		int64			last_value;
 		HeapTuple		newtup;
 		List		   *seqtargets;
-		ListCell	   *lc;
 
 		CHECK_FOR_INTERRUPTS();
 
@@ -149,33 +201,15 @@ synchronize_sequences(void)
 													  oldseq->seqoid);
 		/*
 		 * For the moment, a sequence cannot have more than one target
-		 * per node/replication set. And here we sync one oid at once.
-		 * Still a sequence can have distinct targets on distinct repset
-		 * so we need to figure that here.  See
+		 * per node/replication set. Still a sequence can have distinct
+		 * targets on distinct repset so we need to figure that here.  See
 		 * spock.replication_set_seq CONSTRAINTS
 		 */
 		foreach (lc, seqtargets)
 		{
-			StringInfoData	json;
-			List		*repset_names = NIL;
-			char		*nspname;
-			char		*relname;
 			SpockRepSetSeq *t = (SpockRepSetSeq *) lfirst(lc);
-			nspname = pstrdup(t->nsptarget);
-			relname = pstrdup(t->seqtarget);
-			repset_names = lappend(repset_names, pstrdup(t->repset_name));
 
-			initStringInfo(&json);
-			appendStringInfoString(&json, "{\"schema_name\": ");
-			escape_json(&json, nspname);
-			appendStringInfoString(&json, ",\"sequence_name\": ");
-			escape_json(&json, relname);
-			appendStringInfo(&json, ",\"last_value\": \""INT64_FORMAT"\"",
-							 newseq->last_value);
-			appendStringInfo(&json, "}");
-
-			queue_message(repset_names, GetUserId(),
-						  QUEUE_COMMAND_TYPE_SEQUENCE, json.data);
+			batches = seqbatch_add(batches, t, newseq->last_value);
 		}
 	}
 
@@ -183,6 +217,16 @@ synchronize_sequences(void)
 	systable_endscan(scan);
 	table_close(rel, NoLock);
 
+	/* Send one message per replication set. */
+	foreach (lc, batches)
+	{
+		SeqBatch   *batch = (SeqBatch *) lfirst(lc);
+
+		appendStringInfoChar(&batch->json, ']');
+		queue_message(list_make1(batch->repset_name), GetUserId(),
+					  QUEUE_COMMAND_TYPE_SEQUENCE, batch->json.data);
+	}
+
 	CommitTransactionCommand();
 
 	return ret;
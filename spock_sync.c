@@ -43,6 +43,7 @@
 
 #include "replication/origin.h"
 
+#include "storage/condition_variable.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/proc.h"
@@ -55,6 +56,7 @@
 #include "utils/pg_lsn.h"
 #include "utils/rel.h"
 #include "utils/resowner.h"
+#include "utils/timestamp.h"
 
 #include "spock_relcache.h"
 #include "spock_repset.h"
@@ -80,6 +82,13 @@ void spock_sync_main(Datum main_arg);
 
 static SpockSyncWorker	   *MySyncWorker = NULL;
 
+static bool sync_status_changed = false;
+static bool sync_xact_cb_installed = false;
+
+static void sync_progress_start_table(SpockRemoteRel *remoterel, int64 size,
+									  int64 rows);
+static void sync_progress_end_table(void);
+
 
 static void
 dump_structure(SpockSubscription *sub, const char *destfile,
@@ -427,6 +436,9 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 	bool		first;
 	StringInfoData	query;
 	StringInfoData	attlist;
+	char	   *row_filter = NULL;
+	int64		est_bytes;
+	int64		est_rows;
 	MemoryContext	curctx = CurrentMemoryContext,
 					oldctx;
 
@@ -461,8 +473,29 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 	/*
 	 * If the table is row-filtered we need to run query over the table
 	 * to execute the filter.
+	 *
+	 * We prefer to push the filter into the WHERE clause of the query, so
+	 * that the planner on the origin can use indexes or a parallel scan.
+	 * If the origin didn't give us the filter expression, fall back to
+	 * table_data_filtered() which evaluates the filters in a seqscan.
 	 */
 	if (remoterel->hasRowFilter)
+		row_filter = pg_logical_get_remote_repset_row_filter(origin_conn,
+															 remoterel->relid,
+															 replication_sets);
+
+	if (row_filter != NULL)
+	{
+		appendStringInfo(&query,
+						 "(SELECT %s FROM ONLY %s.%s WHERE %s) ",
+						 list_length(attnamelist) ? attlist.data : "*",
+						 PQescapeIdentifier(origin_conn, remoterel->nspname,
+											strlen(remoterel->nspname)),
+						 PQescapeIdentifier(origin_conn, remoterel->relname,
+											strlen(remoterel->relname)),
+						 row_filter);
+	}
+	else if (remoterel->hasRowFilter)
 	{
 		StringInfoData	relname;
 		StringInfoData	repsetarr;
@@ -512,6 +545,10 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 	}
 	appendStringInfoString(&query, "TO stdout");
 
+	/* Size estimate is only for progress reporting. */
+	pg_logical_get_remote_table_size(origin_conn, remoterel->relid,
+									 &est_bytes, &est_rows);
+	sync_progress_start_table(remoterel, est_bytes, est_rows);
 
 	/* Execute COPY TO. */
 	res = PQexec(origin_conn, query.data);
@@ -555,6 +592,16 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 		}
 		PQfreemem(copybuf);
 
+		/* Text COPY sends exactly one row per message. */
+		if (MyApplyWorker != NULL)
+		{
+			SpockSyncProgress  *progress = &MyApplyWorker->progress;
+
+			pg_atomic_fetch_add_u64(&progress->bytes_copied, bytes);
+			pg_atomic_fetch_add_u64(&progress->rows_copied, 1);
+			pg_atomic_fetch_add_u64(&progress->total_bytes_copied, bytes);
+		}
+
 		CHECK_FOR_INTERRUPTS();
 	}
 
@@ -577,10 +624,80 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 
 	PQclear(res);
 
+	sync_progress_end_table();
+
 	elog(INFO, "finished synchronization of data for table %s.%s",
 		 remoterel->nsptarget, remoterel->reltarget);
 }
 
+/*
+ * Publish the current synchronization step, see spock.sync_progress.
+ */
+static void
+sync_progress_set_phase(char phase)
+{
+	SpockSyncProgress  *progress;
+	TimestampTz			now = GetCurrentTimestamp();
+
+	if (MyApplyWorker == NULL)
+		return;
+
+	progress = &MyApplyWorker->progress;
+	SpinLockAcquire(&progress->mutex);
+	progress->phase = phase;
+	progress->phase_start = now;
+	SpinLockRelease(&progress->mutex);
+}
+
+static void
+sync_progress_add_tables(int ntables)
+{
+	SpockSyncProgress  *progress;
+
+	if (MyApplyWorker == NULL)
+		return;
+
+	progress = &MyApplyWorker->progress;
+	SpinLockAcquire(&progress->mutex);
+	progress->tables_total += ntables;
+	SpinLockRelease(&progress->mutex);
+}
+
+static void
+sync_progress_start_table(SpockRemoteRel *remoterel, int64 size, int64 rows)
+{
+	SpockSyncProgress  *progress;
+	TimestampTz			now = GetCurrentTimestamp();
+
+	if (MyApplyWorker == NULL)
+		return;
+
+	progress = &MyApplyWorker->progress;
+	SpinLockAcquire(&progress->mutex);
+	namestrcpy(&progress->nspname, remoterel->nsptarget);
+	namestrcpy(&progress->relname, remoterel->reltarget);
+	progress->table_start = now;
+	progress->table_size = size;
+	progress->table_rows = rows;
+	pg_atomic_write_u64(&progress->bytes_copied, 0);
+	pg_atomic_write_u64(&progress->rows_copied, 0);
+	SpinLockRelease(&progress->mutex);
+}
+
+static void
+sync_progress_end_table(void)
+{
+	SpockSyncProgress  *progress;
+
+	if (MyApplyWorker == NULL)
+		return;
+
+	progress = &MyApplyWorker->progress;
+	SpinLockAcquire(&progress->mutex);
+	progress->tables_done++;
+	SpinLockRelease(&progress->mutex);
+}
+
 /*
  * Returns the list of schema qualified name of replicated tables and sequences
  * from provider.
@@ -679,6 +796,7 @@ copy_tables_data(char *sub_name, const char *origin_dsn,
         List		*remoterels = NIL;
 		remoterels = pg_logical_get_remote_repset_table(origin_conn, rv,
 													   replication_sets);
+		sync_progress_add_tables(list_length(remoterels));
         foreach(lcr, remoterels)
         {
           SpockRemoteRel	*remoterel = lfirst(lcr);
@@ -720,6 +838,7 @@ copy_replication_sets_data(char *sub_name, const char *origin_dsn,
 	/* Get tables to copy from origin node. */
 	tables = pg_logical_get_remote_repset_tables(origin_conn,
 												 replication_sets);
+	sync_progress_add_tables(list_length(tables));
 
 	/* Connect to target node. */
 	target_conn = spock_connect(target_dsn, sub_name, "copy");
@@ -846,6 +965,7 @@ spock_sync_subscription(SpockSubscription *sub)
 		bool		use_failover_slot;
 
 		elog(INFO, "initializing subscriber %s", sub->name);
+		sync_progress_set_phase(SYNC_STATUS_INIT);
 
 		origin_conn = spock_connect(sub->origin_if->dsn,
 										sub->name, "snap");
@@ -898,6 +1018,7 @@ spock_sync_subscription(SpockSubscription *sub)
 					elog(INFO, "synchronizing structure");
 
 					status = SYNC_STATUS_STRUCTURE;
+					sync_progress_set_phase(status);
 					StartTransactionCommand();
 					set_subscription_sync_status(sub->id, status);
 					CommitTransactionCommand();
@@ -918,6 +1039,7 @@ spock_sync_subscription(SpockSubscription *sub)
 					elog(INFO, "synchronizing data");
 
 					status = SYNC_STATUS_DATA;
+					sync_progress_set_phase(status);
 					StartTransactionCommand();
 					set_subscription_sync_status(sub->id, status);
 					CommitTransactionCommand();
@@ -969,6 +1091,7 @@ spock_sync_subscription(SpockSubscription *sub)
 					elog(INFO, "synchronizing constraints");
 
 					status = SYNC_STATUS_CONSTAINTS;
+					sync_progress_set_phase(status);
 					StartTransactionCommand();
 					set_subscription_sync_status(sub->id, status);
 					CommitTransactionCommand();
@@ -1003,6 +1126,8 @@ spock_sync_subscription(SpockSubscription *sub)
 		elog(INFO, "finished synchronization of subscriber %s, ready to enter normal replication", sub->name);
 	}
 
+	sync_progress_set_phase(SYNC_STATUS_NONE);
+
 	MemoryContextDelete(myctx);
 }
 
@@ -1041,6 +1166,8 @@ spock_sync_table(SpockSubscription *sub, RangeVar *table,
 
 	CommitTransactionCommand();
 
+	sync_progress_set_phase(SYNC_STATUS_INIT);
+
 	origin_conn_repl = spock_connect_replica(sub->origin_if->dsn,
 												 sub->name, "copy");
 
@@ -1072,6 +1199,7 @@ spock_sync_table(SpockSubscription *sub, RangeVar *table,
 		CommitTransactionCommand();
 
 		/* Copy data. */
+		sync_progress_set_phase(SYNC_STATUS_DATA);
 		copy_tables_data(sub->name, sub->origin_if->dsn,sub->target_if->dsn,
 						 snapshot, list_make1(table), sub->replication_sets,
 						 sub->slot_name);
@@ -1110,7 +1238,7 @@ spock_sync_worker_finish(void)
 	 * In case there is apply process running, it might be waiting
 	 * for the table status change so tell it to check.
 	 */
-	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
 	apply = spock_apply_find(MySpockWorker->dboid,
 								 MyApplyWorker->subid);
 	if (spock_worker_running(apply))
@@ -1249,6 +1377,11 @@ spock_sync_main(Datum main_arg)
 								status_lsn, "all", NULL, tablename,
 								MySubscription->force_text_transfer);
 
+	SpinLockAcquire(&MyApplyWorker->progress.mutex);
+	MyApplyWorker->progress.catchup_start_lsn = status_lsn;
+	SpinLockRelease(&MyApplyWorker->progress.mutex);
+	sync_progress_set_phase(SYNC_STATUS_CATCHUP);
+
 	/* Leave it to standard apply code to do the replication. */
 	apply_work(streamConn);
 
@@ -1264,6 +1397,40 @@ spock_sync_main(Datum main_arg)
 
 /* Catalog access */
 
+static void
+sync_status_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			if (sync_status_changed)
+				ConditionVariableBroadcast(&SpockCtx->sync_status_cv);
+			sync_status_changed = false;
+			break;
+		case XACT_EVENT_ABORT:
+			sync_status_changed = false;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Wake up everybody waiting for a sync status change once the current
+ * transaction commits.
+ */
+static void
+sync_status_notify(void)
+{
+	if (!sync_xact_cb_installed)
+	{
+		RegisterXactCallback(sync_status_xact_callback, NULL);
+		sync_xact_cb_installed = true;
+	}
+
+	sync_status_changed = true;
+}
+
 /* Create subscription sync status record in catalog. */
 void
 create_local_sync_status(SpockSyncStatus *sync)
@@ -1302,6 +1469,7 @@ create_local_sync_status(SpockSyncStatus *sync)
 
 	/* Insert the tuple to the catalog. */
 	CatalogTupleInsert(rel, tup);
+	sync_status_notify();
 
 	/* Cleanup. */
 	heap_freetuple(tup);
@@ -1331,6 +1499,7 @@ drop_subscription_sync_status(Oid subid)
 	/* Remove the tuples. */
 	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
 		simple_heap_delete(rel, &tuple->t_self);
+	sync_status_notify();
 
 	/* Cleanup. */
 	systable_endscan(scan);
@@ -1469,6 +1638,7 @@ set_subscription_sync_status(Oid subid, char status)
 
 	/* Update the tuple in catalog. */
 	CatalogTupleUpdate(rel, &oldtup->t_self, newtup);
+	sync_status_notify();
 
 	/* Cleanup. */
 	heap_freetuple(newtup);
@@ -1503,6 +1673,7 @@ drop_table_sync_status(const char *nspname, const char *relname)
 	/* Remove the tuples. */
 	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
 		simple_heap_delete(rel, &tuple->t_self);
+	sync_status_notify();
 
 	/* Cleanup. */
 	systable_endscan(scan);
@@ -1541,6 +1712,7 @@ drop_table_sync_status_for_sub(Oid subid, const char *nspname,
 	/* Remove the tuples. */
 	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
 		simple_heap_delete(rel, &tuple->t_self);
+	sync_status_notify();
 
 	/* Cleanup. */
 	systable_endscan(scan);
@@ -1759,6 +1931,7 @@ set_table_sync_status(Oid subid, const char *nspname, const char *relname,
 
 	/* Update the tuple in catalog. */
 	CatalogTupleUpdate(rel, &oldtup->t_self, newtup);
+	sync_status_notify();
 
 	/* Cleanup. */
 	heap_freetuple(newtup);
@@ -1792,6 +1965,12 @@ wait_for_sync_status_change(Oid subid, const char *nspname, const char *relname,
 		SpockWorker		   *worker;
 		SpockSyncStatus	   *sync;
 
+		/*
+		 * Get on the wait list before looking at the status so that a commit
+		 * made after we looked still sets our latch.
+		 */
+		ConditionVariablePrepareToSleep(&SpockCtx->sync_status_cv);
+
 		StartTransactionCommand();
 		sync = get_table_sync_status(subid, nspname, relname, true);
 		if (!sync)
@@ -1810,23 +1989,27 @@ wait_for_sync_status_change(Oid subid, const char *nspname, const char *relname,
 		(void) MemoryContextSwitchTo(old_ctx);
 
 		/* Check if the worker is still alive - no point waiting if it died. */
-		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+		LWLockAcquire(SpockCtx->lock, LW_SHARED);
 		worker = spock_sync_find(MyDatabaseId, subid, nspname, relname);
 		LWLockRelease(SpockCtx->lock);
 		if (!worker)
 			break;
 
+		/* The timeout only guards against the worker dying silently. */
 		rc = WaitLatch(&MyProc->procLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
 					   60000L);
 
         ResetLatch(&MyProc->procLatch);
+		ConditionVariableCancelSleep();
 
 		/* emergency bailout if postmaster has died */
 		if (rc & WL_POSTMASTER_DEATH)
 			proc_exit(1);
 	}
 
+	ConditionVariableCancelSleep();
+
 	(void) MemoryContextSwitchTo(old_ctx);
 	return ret;
 }
@@ -20,6 +20,7 @@
 
 #include "commands/dbcommands.h"
 
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/proc.h"
 #include "storage/procsignal.h"
@@ -42,6 +43,44 @@ typedef struct signal_worker_item
 } signal_worker_item;
 static	List *signal_workers = NIL;
 
+/*
+ * Registry of worker slots in use. Managers have invalid subid, apply
+ * workers have empty relation name.
+ */
+typedef struct SpockWorkerKey
+{
+	Oid			dboid;
+	Oid			subid;
+	NameData	nspname;
+	NameData	relname;
+} SpockWorkerKey;
+
+typedef struct SpockWorkerEntry
+{
+	SpockWorkerKey	key;		/* hash key, must be first */
+	int				slot;
+} SpockWorkerEntry;
+
+static HTAB	   *SpockWorkerHash = NULL;
+
+/* SpockApplyCatchup of every subscription that had an apply worker. */
+static HTAB	   *SpockApplyCatchupHash = NULL;
+
+/*
+ * Registry of databases with a spock node, so that the supervisor only starts
+ * managers where they are needed. It's kept in a file to survive restarts.
+ */
+#define SPOCK_DATABASES_FILE		"pg_logical/spock_databases"
+#define SPOCK_DATABASES_TMPFILE		SPOCK_DATABASES_FILE ".tmp"
+#define SPOCK_DATABASES_MAGIC		0x53504442
+
+typedef struct SpockDatabaseEntry
+{
+	Oid			dboid;			/* hash key, must be first */
+} SpockDatabaseEntry;
+
+static HTAB	   *SpockDatabaseHash = NULL;
+
 volatile sig_atomic_t	got_SIGTERM = false;
 
 SpockContext	   *SpockCtx = NULL;
@@ -49,15 +88,19 @@ SpockWorker		   *MySpockWorker = NULL;
 static uint16			MySpockWorkerGeneration;
 
 static bool xacthook_signal_workers = false;
+static bool xacthook_register_database = false;
 static bool xact_cb_installed = false;
 
 
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
 static void spock_worker_detach(bool crash);
+static void worker_group_crashed(int group_slot);
 static void wait_for_worker_startup(SpockWorker *worker,
 									BackgroundWorkerHandle *handle);
 static void signal_worker_xact_callback(XactEvent event, void *arg);
+static bool database_registry_add(Oid dboid);
+static void databases_write(void);
 
 
 void
@@ -73,6 +116,148 @@ handle_sigterm(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
+static void
+worker_key_init(SpockWorkerKey *key, Oid dboid, Oid subid,
+				const char *nspname, const char *relname)
+{
+	memset(key, 0, sizeof(SpockWorkerKey));
+	key->dboid = dboid;
+	key->subid = subid;
+	if (nspname)
+		namestrcpy(&key->nspname, nspname);
+	if (relname)
+		namestrcpy(&key->relname, relname);
+}
+
+/*
+ * Build the registry key of a worker, returns false for worker types that
+ * are not registered.
+ */
+static bool
+worker_key_from_worker(SpockWorker *worker, SpockWorkerKey *key)
+{
+	switch (worker->worker_type)
+	{
+		case SPOCK_WORKER_MANAGER:
+			worker_key_init(key, worker->dboid, InvalidOid, NULL, NULL);
+			break;
+		case SPOCK_WORKER_APPLY:
+			worker_key_init(key, worker->dboid, worker->worker.apply.subid,
+							NULL, NULL);
+			break;
+		case SPOCK_WORKER_SYNC:
+			worker_key_init(key, worker->dboid, worker->worker.apply.subid,
+							NameStr(worker->worker.sync.nspname),
+							NameStr(worker->worker.sync.relname));
+			break;
+		case SPOCK_WORKER_APPLY_GROUP:
+			/* Found through the apply slots of its subscriptions. */
+			return false;
+		default:
+			elog(ERROR, "unknown spock worker type %d", worker->worker_type);
+	}
+
+	return true;
+}
+
+/*
+ * Look up worker in the registry.
+ *
+ * The caller needs to hold SpockCtx->lock in at least shared mode.
+ */
+static SpockWorker *
+worker_registry_find(SpockWorkerKey *key, SpockWorkerType type)
+{
+	SpockWorkerEntry   *entry;
+	SpockWorker		   *w;
+
+	Assert(LWLockHeldByMe(SpockCtx->lock));
+
+	entry = (SpockWorkerEntry *) hash_search(SpockWorkerHash, key,
+											 HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	w = &SpockCtx->workers[entry->slot];
+	if (w->worker_type != type)
+		return NULL;
+
+	return w;
+}
+
+/*
+ * Add worker in given slot to the registry.
+ *
+ * If another slot was registered for the same work, it's a leftover of a
+ * crashed worker and is released.
+ */
+static void
+worker_registry_add(int slot)
+{
+	SpockWorker		   *worker = &SpockCtx->workers[slot];
+	SpockWorkerKey		key;
+	SpockWorkerEntry   *entry;
+	bool				found;
+
+	Assert(LWLockHeldByMeInMode(SpockCtx->lock, LW_EXCLUSIVE));
+
+	if (!worker_key_from_worker(worker, &key))
+		return;
+
+	entry = (SpockWorkerEntry *) hash_search(SpockWorkerHash, &key,
+											 HASH_ENTER, &found);
+	if (found && entry->slot != slot)
+	{
+		SpockWorker	   *old = &SpockCtx->workers[entry->slot];
+
+		if (!spock_worker_running(old))
+		{
+			old->worker_type = SPOCK_WORKER_NONE;
+			old->dboid = InvalidOid;
+			old->crashed_at = 0;
+		}
+	}
+	entry->slot = slot;
+}
+
+/*
+ * Remove worker from the registry and mark its slot as unused.
+ */
+void
+spock_worker_forget(SpockWorker *worker)
+{
+	SpockWorkerKey		key;
+	SpockWorkerEntry   *entry;
+
+	Assert(LWLockHeldByMeInMode(SpockCtx->lock, LW_EXCLUSIVE));
+
+	if (worker->worker_type == SPOCK_WORKER_NONE)
+		return;
+
+	if (worker_key_from_worker(worker, &key))
+	{
+		entry = (SpockWorkerEntry *) hash_search(SpockWorkerHash, &key,
+												 HASH_FIND, NULL);
+		if (entry != NULL && entry->slot == worker - &SpockCtx->workers[0])
+			hash_search(SpockWorkerHash, &key, HASH_REMOVE, NULL);
+	}
+
+	worker->worker_type = SPOCK_WORKER_NONE;
+	worker->dboid = InvalidOid;
+	worker->crashed_at = 0;
+}
+
+/*
+ * Can the slot be given to a new worker for given database?
+ */
+static inline bool
+worker_slot_is_free(SpockWorker *worker, Oid dboid)
+{
+	return worker->worker_type == SPOCK_WORKER_NONE
+		|| (worker->crashed_at != 0
+			&& (worker->dboid == dboid || worker->dboid == InvalidOid));
+}
+
 /*
  * Find unused worker slot.
  *
@@ -87,10 +272,7 @@ find_empty_worker_slot(Oid dboid)
 
 	for (i = 0; i < SpockCtx->total_workers; i++)
 	{
-		if (SpockCtx->workers[i].worker_type == SPOCK_WORKER_NONE
-		    || (SpockCtx->workers[i].crashed_at != 0 
-                && (SpockCtx->workers[i].dboid == dboid
-                    || SpockCtx->workers[i].dboid == InvalidOid)))
+		if (worker_slot_is_free(&SpockCtx->workers[i], dboid))
 			return i;
 	}
 
@@ -98,31 +280,108 @@ find_empty_worker_slot(Oid dboid)
 }
 
 /*
- * Register the spock worker proccess.
+ * Count unused worker slots.
  *
- * Return the assigned slot number.
+ * The caller is responsible for locking.
  */
-int
-spock_worker_register(SpockWorker *worker)
+static int
+count_empty_worker_slots(Oid dboid)
 {
-	BackgroundWorker	bgw;
-	SpockWorker		*worker_shm;
-	BackgroundWorkerHandle *bgw_handle;
-	int					slot;
-	int					next_generation;
+	int	i;
+	int	count = 0;
 
-	Assert(worker->worker_type != SPOCK_WORKER_NONE);
+	Assert(LWLockHeldByMe(SpockCtx->lock));
 
-	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		if (worker_slot_is_free(&SpockCtx->workers[i], dboid))
+			count++;
+	}
 
-	slot = find_empty_worker_slot(worker->dboid);
-	if (slot == -1)
+	return count;
+}
+
+/*
+ * Get the catch-up state of a subscription, creating it when the
+ * subscription gets its first apply worker. Returns NULL if there is no room
+ * left, spock.wait_for_apply() then only sees the origin progress.
+ *
+ * The caller must hold SpockCtx->lock exclusively.
+ */
+static SpockApplyCatchup *
+apply_catchup_enter(Oid dboid, Oid subid)
+{
+	SpockApplyCatchup	key;
+	SpockApplyCatchup  *catchup;
+	bool				found;
+
+	Assert(LWLockHeldByMeInMode(SpockCtx->lock, LW_EXCLUSIVE));
+
+	memset(&key, 0, sizeof(key));
+	key.dboid = dboid;
+	key.subid = subid;
+	catchup = (SpockApplyCatchup *) hash_search(SpockApplyCatchupHash, &key,
+												HASH_ENTER_NULL, &found);
+	if (catchup != NULL && !found)
 	{
-		LWLockRelease(SpockCtx->lock);
-		elog(ERROR, "could not register spock worker: all background worker slots are already used");
+		pg_atomic_init_u64(&catchup->commit_time, 0);
+		pg_atomic_init_u64(&catchup->idle_lsn, InvalidXLogRecPtr);
+		catchup->dedicated = false;
 	}
 
-	worker_shm = &SpockCtx->workers[slot];
+	return catchup;
+}
+
+/*
+ * Find the catch-up state of a subscription.
+ *
+ * The caller must hold SpockCtx->lock.
+ */
+SpockApplyCatchup *
+spock_apply_catchup_find(Oid dboid, Oid subid)
+{
+	SpockApplyCatchup	key;
+
+	Assert(LWLockHeldByMe(SpockCtx->lock));
+
+	memset(&key, 0, sizeof(key));
+	key.dboid = dboid;
+	key.subid = subid;
+	return (SpockApplyCatchup *) hash_search(SpockApplyCatchupHash, &key,
+											 HASH_FIND, NULL);
+}
+
+/*
+ * Forget the catch-up state of a dropped subscription. Its apply worker must
+ * not be running anymore.
+ */
+void
+spock_apply_catchup_forget(Oid dboid, Oid subid)
+{
+	SpockApplyCatchup	key;
+
+	memset(&key, 0, sizeof(key));
+	key.dboid = dboid;
+	key.subid = subid;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	hash_search(SpockApplyCatchupHash, &key, HASH_REMOVE, NULL);
+	LWLockRelease(SpockCtx->lock);
+}
+
+/*
+ * Fill the slot with the new worker's info.
+ *
+ * The caller must hold SpockCtx->lock exclusively.
+ */
+static void
+worker_slot_init(int slot, SpockWorker *worker)
+{
+	SpockWorker	   *worker_shm = &SpockCtx->workers[slot];
+	int				next_generation;
+
+	/* Reusing the slot of a crashed worker. */
+	spock_worker_forget(worker_shm);
 
 	/*
 	 * Maintain a generation counter for worker registrations; see
@@ -138,6 +397,90 @@ spock_worker_register(SpockWorker *worker)
 	worker_shm->crashed_at = 0;
 	worker_shm->proc = NULL;
 	worker_shm->worker_type = worker->worker_type;
+	worker_registry_add(slot);
+
+	if (worker->worker_type == SPOCK_WORKER_APPLY ||
+		worker->worker_type == SPOCK_WORKER_SYNC)
+	{
+		spock_apply_stats_reset(&worker_shm->worker.apply.stats, true);
+		spock_sync_progress_init(&worker_shm->worker.apply.progress);
+		worker_shm->worker.apply.catchup = NULL;
+	}
+
+	if (worker->worker_type == SPOCK_WORKER_APPLY)
+		worker_shm->worker.apply.catchup =
+			apply_catchup_enter(worker->dboid, worker->worker.apply.subid);
+}
+
+/*
+ * Is the slot an apply slot of a subscription served by the multiplexed
+ * worker in group_slot, which it did not hand over yet?
+ */
+static inline bool
+worker_is_group_member(SpockWorker *worker, SpockWorker *group)
+{
+	return worker->worker_type == SPOCK_WORKER_APPLY
+		&& worker->dboid == group->dboid
+		&& worker->worker.apply.multiplexed
+		&& !worker->worker.apply.promoted
+		&& worker->worker.apply.group_slot == group - &SpockCtx->workers[0];
+}
+
+/*
+ * Register the spock worker proccess.
+ *
+ * Return the assigned slot number.
+ */
+int
+spock_worker_register(SpockWorker *worker)
+{
+	BackgroundWorker	bgw;
+	SpockWorker		*worker_shm;
+	BackgroundWorkerHandle *bgw_handle;
+	int					slot;
+	int					nslots = 1;
+
+	Assert(worker->worker_type != SPOCK_WORKER_NONE);
+
+	/* A multiplexed worker also needs a slot for each subscription. */
+	if (worker->worker_type == SPOCK_WORKER_APPLY_GROUP)
+	{
+		Assert(worker->worker.group.nsubs > 0 &&
+			   worker->worker.group.nsubs <= SPOCK_APPLY_GROUP_MAX_SUBS);
+		nslots += worker->worker.group.nsubs;
+	}
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+
+	if (count_empty_worker_slots(worker->dboid) < nslots)
+	{
+		LWLockRelease(SpockCtx->lock);
+		elog(ERROR, "could not register spock worker: all background worker slots are already used");
+	}
+
+	slot = find_empty_worker_slot(worker->dboid);
+	worker_shm = &SpockCtx->workers[slot];
+	worker_slot_init(slot, worker);
+
+	if (worker->worker_type == SPOCK_WORKER_APPLY_GROUP)
+	{
+		int			i;
+
+		for (i = 0; i < worker->worker.group.nsubs; i++)
+		{
+			SpockWorker	apply;
+
+			memset(&apply, 0, sizeof(SpockWorker));
+			apply.worker_type = SPOCK_WORKER_APPLY;
+			apply.dboid = worker->dboid;
+			apply.worker.apply.subid = worker->worker.group.subids[i];
+			apply.worker.apply.replay_stop_lsn = InvalidXLogRecPtr;
+			apply.worker.apply.multiplexed = true;
+			apply.worker.apply.group_slot = slot;
+
+			worker_slot_init(find_empty_worker_slot(worker->dboid), &apply);
+		}
+	}
 
 	LWLockRelease(SpockCtx->lock);
 
@@ -163,6 +506,13 @@ spock_worker_register(SpockWorker *worker)
 				 shorten_hash(NameStr(worker->worker.sync.relname), NAMEDATALEN - 37),
 				 worker->dboid, worker->worker.sync.apply.subid);
 	}
+	else if (worker->worker_type == SPOCK_WORKER_APPLY_GROUP)
+	{
+		snprintf(bgw.bgw_function_name, BGW_MAXLEN,
+				 "spock_apply_group_main");
+		snprintf(bgw.bgw_name, BGW_MAXLEN,
+				 "spock apply group %u:%d", worker->dboid, slot);
+	}
 	else
 	{
 		snprintf(bgw.bgw_function_name, BGW_MAXLEN,
@@ -179,6 +529,7 @@ spock_worker_register(SpockWorker *worker)
 	if (!RegisterDynamicBackgroundWorker(&bgw, &bgw_handle))
 	{
 		worker_shm->crashed_at = GetCurrentTimestamp();
+		worker_group_crashed(slot);
 		ereport(ERROR,
 				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
 				 errmsg("worker registration failed, you might want to increase max_worker_processes setting")));
@@ -260,6 +611,8 @@ wait_for_worker_startup(SpockWorker *worker,
 				elog(DEBUG2, "%s worker at slot %zu exited prematurely",
 					 spock_worker_type_name(worker->worker_type), (worker - &SpockCtx->workers[0]));
 				worker->crashed_at = GetCurrentTimestamp();
+				if (worker->worker_type == SPOCK_WORKER_APPLY_GROUP)
+					worker_group_crashed(worker - &SpockCtx->workers[0]);
 			}
 			else
 			{
@@ -286,6 +639,28 @@ wait_for_worker_startup(SpockWorker *worker,
 	}
 }
 
+/*
+ * Multiplexed worker died before attaching, mark the apply slots of its
+ * subscriptions crashed too so the manager restarts them.
+ */
+static void
+worker_group_crashed(int group_slot)
+{
+	SpockWorker *group = &SpockCtx->workers[group_slot];
+	int			i;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	for (i = 0; i < SpockCtx->total_workers; i++)
+	{
+		SpockWorker *w = &SpockCtx->workers[i];
+
+		if (worker_is_group_member(w, group) && w->proc == NULL &&
+			w->crashed_at == 0)
+			w->crashed_at = GetCurrentTimestamp();
+	}
+	LWLockRelease(SpockCtx->lock);
+}
+
 /*
  * Cleanup function.
  *
@@ -321,6 +696,21 @@ spock_worker_attach(int slot, SpockWorkerType type)
 	MySpockWorker->proc = MyProc;
 	MySpockWorkerGeneration = MySpockWorker->generation;
 
+	/* Multiplexed worker runs the apply slots of its subscriptions too. */
+	if (type == SPOCK_WORKER_APPLY_GROUP)
+	{
+		int			i;
+
+		for (i = 0; i < SpockCtx->total_workers; i++)
+		{
+			SpockWorker *w = &SpockCtx->workers[i];
+
+			if (worker_is_group_member(w, MySpockWorker) && w->proc == NULL &&
+				w->crashed_at == 0)
+				w->proc = MyProc;
+		}
+	}
+
 	elog(DEBUG2, "%s worker [%d] attaching to slot %d generation %hu",
 		 spock_worker_type_name(type), MyProcPid, slot,
 		 MySpockWorkerGeneration);
@@ -394,6 +784,43 @@ spock_worker_detach(bool crash)
 	VALGRIND_PRINTF("SPOCK: worker detaching, unclean=%d\n",
 		crash);
 
+	/*
+	 * Release the subscriptions of a multiplexed worker, except those it has
+	 * already handed over.
+	 */
+	if (MySpockWorker->worker_type == SPOCK_WORKER_APPLY_GROUP)
+	{
+		int			i;
+
+		for (i = 0; i < SpockCtx->total_workers; i++)
+		{
+			SpockWorker *w = &SpockCtx->workers[i];
+
+			if (!worker_is_group_member(w, MySpockWorker) ||
+				w->proc != MyProc)
+				continue;
+
+			w->proc = NULL;
+			if (crash)
+				w->crashed_at = GetCurrentTimestamp();
+			else
+				spock_worker_forget(w);
+		}
+	}
+
+	/* Apply worker exited, manager has to restart it. */
+	if (MySpockWorker->worker_type == SPOCK_WORKER_APPLY ||
+		MySpockWorker->worker_type == SPOCK_WORKER_APPLY_GROUP)
+	{
+		SpockWorker	   *manager = spock_manager_find(MySpockWorker->dboid);
+
+		if (spock_worker_running(manager))
+		{
+			manager->worker.manager.subscriptions_changed = true;
+			SetLatch(&manager->proc->procLatch);
+		}
+	}
+
 	/*
 	 * If we crashed we need to report it.
 	 *
@@ -416,8 +843,7 @@ spock_worker_detach(bool crash)
 	else
 	{
 		/* Worker has finished work, clean up its state from shmem. */
-		MySpockWorker->worker_type = SPOCK_WORKER_NONE;
-		MySpockWorker->dboid = InvalidOid;
+		spock_worker_forget(MySpockWorker);
 	}
 
 	MySpockWorker = NULL;
@@ -431,18 +857,11 @@ spock_worker_detach(bool crash)
 SpockWorker *
 spock_manager_find(Oid dboid)
 {
-	int i;
+	SpockWorkerKey	key;
 
-	Assert(LWLockHeldByMe(SpockCtx->lock));
+	worker_key_init(&key, dboid, InvalidOid, NULL, NULL);
 
-	for (i = 0; i < SpockCtx->total_workers; i++)
-	{
-		if (SpockCtx->workers[i].worker_type == SPOCK_WORKER_MANAGER &&
-			dboid == SpockCtx->workers[i].dboid)
-			return &SpockCtx->workers[i];
-	}
-
-	return NULL;
+	return worker_registry_find(&key, SPOCK_WORKER_MANAGER);
 }
 
 /*
@@ -451,21 +870,11 @@ spock_manager_find(Oid dboid)
 SpockWorker *
 spock_apply_find(Oid dboid, Oid subscriberid)
 {
-	int i;
-
-	Assert(LWLockHeldByMe(SpockCtx->lock));
-
-	for (i = 0; i < SpockCtx->total_workers; i++)
-	{
-		SpockWorker	   *w = &SpockCtx->workers[i];
+	SpockWorkerKey	key;
 
-		if (w->worker_type == SPOCK_WORKER_APPLY &&
-			dboid == w->dboid &&
-			subscriberid == w->worker.apply.subid)
-			return w;
-	}
+	worker_key_init(&key, dboid, subscriberid, NULL, NULL);
 
-	return NULL;
+	return worker_registry_find(&key, SPOCK_WORKER_APPLY);
 }
 
 /*
@@ -495,21 +904,11 @@ spock_apply_find_all(Oid dboid)
 SpockWorker *
 spock_sync_find(Oid dboid, Oid subscriberid, const char *nspname, const char *relname)
 {
-	int i;
+	SpockWorkerKey	key;
 
-	Assert(LWLockHeldByMe(SpockCtx->lock));
-
-	for (i = 0; i < SpockCtx->total_workers; i++)
-	{
-		SpockWorker *w = &SpockCtx->workers[i];
-		if (w->worker_type == SPOCK_WORKER_SYNC && dboid == w->dboid &&
-			subscriberid == w->worker.apply.subid &&
-			strcmp(NameStr(w->worker.sync.nspname), nspname) == 0 &&
-			strcmp(NameStr(w->worker.sync.relname), relname) == 0)
-			return w;
-	}
+	worker_key_init(&key, dboid, subscriberid, nspname, relname);
 
-	return NULL;
+	return worker_registry_find(&key, SPOCK_WORKER_SYNC);
 }
 
 
@@ -567,16 +966,55 @@ spock_worker_kill(SpockWorker *worker)
 	}
 }
 
+/*
+ * Hand a subscription served by the current multiplexed worker over to
+ * a dedicated apply worker.
+ */
+void
+spock_worker_release_subscription(SpockWorker *apply)
+{
+	SpockWorker	   *manager;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+
+	Assert(apply->worker.apply.multiplexed && apply->proc == MyProc);
+	apply->proc = NULL;
+	apply->worker.apply.promoted = true;
+
+	/* Remembered beyond the restart of the manager or the new worker. */
+	if (apply->worker.apply.catchup != NULL)
+		apply->worker.apply.catchup->dedicated = true;
+
+	manager = spock_manager_find(apply->dboid);
+	if (spock_worker_running(manager))
+	{
+		manager->worker.manager.subscriptions_changed = true;
+		SetLatch(&manager->proc->procLatch);
+	}
+
+	LWLockRelease(SpockCtx->lock);
+}
+
 static void
 signal_worker_xact_callback(XactEvent event, void *arg)
 {
+	if (event == XACT_EVENT_ABORT)
+		xacthook_register_database = false;
+
 	if (event == XACT_EVENT_COMMIT && xacthook_signal_workers)
 	{
 		SpockWorker	   *w;
 		ListCell	   *l;
+		bool			write_databases = false;
 
 		LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
 
+		if (xacthook_register_database)
+		{
+			write_databases = database_registry_add(MyDatabaseId);
+			xacthook_register_database = false;
+		}
+
 		foreach (l, signal_workers)
 		{
 			signal_worker_item *item = (signal_worker_item *) lfirst(l);
@@ -596,7 +1034,10 @@ signal_worker_xact_callback(XactEvent event, void *arg)
 		/* Signal the manager worker, if there's one */
 		w = spock_manager_find(MyDatabaseId);
 		if (spock_worker_running(w))
+		{
+			w->worker.manager.subscriptions_changed = true;
 			SetLatch(&w->proc->procLatch);
+		}
 
 		/* and signal the supervisor, for good measure */
 		if (SpockCtx->supervisor)
@@ -604,6 +1045,9 @@ signal_worker_xact_callback(XactEvent event, void *arg)
 
 		LWLockRelease(SpockCtx->lock);
 
+		if (write_databases)
+			databases_write();
+
 		list_free_deep(signal_workers);
 		signal_workers = NIL;
 
@@ -642,11 +1086,270 @@ spock_subscription_changed(Oid subid, bool kill)
 	xacthook_signal_workers = true;
 }
 
+/*
+ * Remember at COMMIT that the current database has a spock node.
+ */
+void
+spock_local_node_created(void)
+{
+	spock_subscription_changed(InvalidOid, false);
+	xacthook_register_database = true;
+}
+
+/*
+ * Write the database registry to disk.
+ *
+ * Only the list of databases is copied under SpockCtx->lock, the file is
+ * written without holding it. Writers are serialized and each one takes its
+ * copy after the previous one finished, so the last write always has the
+ * latest state.
+ *
+ * Failure is not fatal, we'll just start more managers than needed after
+ * a restart, so only LOG it.
+ */
+static void
+databases_write(void)
+{
+	FILE			   *file;
+	HASH_SEQ_STATUS		status;
+	SpockDatabaseEntry *entry;
+	uint32				magic = SPOCK_DATABASES_MAGIC;
+	int32				count;
+	Oid				   *dboids;
+	int32				i;
+	bool				failed = false;
+
+	Assert(!LWLockHeldByMe(SpockCtx->lock));
+
+	LWLockAcquire(SpockCtx->databases_lock, LW_EXCLUSIVE);
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	count = hash_get_num_entries(SpockDatabaseHash);
+	dboids = (Oid *) palloc(sizeof(Oid) * Max(count, 1));
+	i = 0;
+	hash_seq_init(&status, SpockDatabaseHash);
+	while ((entry = (SpockDatabaseEntry *) hash_seq_search(&status)) != NULL)
+		dboids[i++] = entry->dboid;
+	LWLockRelease(SpockCtx->lock);
+
+	file = AllocateFile(SPOCK_DATABASES_TMPFILE, PG_BINARY_W);
+	if (file == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m",
+						SPOCK_DATABASES_TMPFILE)));
+		LWLockRelease(SpockCtx->databases_lock);
+		pfree(dboids);
+		return;
+	}
+
+	if (fwrite(&magic, sizeof(magic), 1, file) != 1 ||
+		fwrite(&count, sizeof(count), 1, file) != 1 ||
+		(count > 0 && fwrite(dboids, sizeof(Oid), count, file) != count))
+		failed = true;
+
+	if (fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+		failed = true;
+
+	if (FreeFile(file) != 0)
+		failed = true;
+
+	if (failed)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m",
+						SPOCK_DATABASES_TMPFILE)));
+		unlink(SPOCK_DATABASES_TMPFILE);
+	}
+	else
+		(void) durable_rename(SPOCK_DATABASES_TMPFILE, SPOCK_DATABASES_FILE,
+							  LOG);
+
+	LWLockRelease(SpockCtx->databases_lock);
+	pfree(dboids);
+}
+
+/*
+ * Add database to the registry. Returns true if the registry file needs to
+ * be written, which the caller does once it released the lock.
+ *
+ * The caller must hold SpockCtx->lock exclusively.
+ */
+static bool
+database_registry_add(Oid dboid)
+{
+	SpockDatabaseEntry *entry;
+	bool				found;
+
+	entry = (SpockDatabaseEntry *) hash_search(SpockDatabaseHash, &dboid,
+											   HASH_ENTER_NULL, &found);
+
+	/* Out of space, fall back to starting managers everywhere. */
+	if (entry == NULL)
+	{
+		elog(WARNING, "too many spock databases, managers will be started in all databases");
+		SpockCtx->databases_known = false;
+		return false;
+	}
+
+	return !found;
+}
+
+/*
+ * Remember that the database has a spock node.
+ */
+void
+spock_database_register(Oid dboid)
+{
+	bool		found;
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	hash_search(SpockDatabaseHash, &dboid, HASH_FIND, &found);
+	LWLockRelease(SpockCtx->lock);
+
+	if (found)
+		return;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	found = !database_registry_add(dboid);
+	LWLockRelease(SpockCtx->lock);
+
+	if (!found)
+		databases_write();
+}
+
+/*
+ * Forget the database, it has no spock node anymore.
+ */
+void
+spock_database_unregister(Oid dboid)
+{
+	bool		found;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	hash_search(SpockDatabaseHash, &dboid, HASH_REMOVE, &found);
+	LWLockRelease(SpockCtx->lock);
+
+	if (found)
+		databases_write();
+}
+
+/*
+ * Should the supervisor start a manager for the database?
+ */
+bool
+spock_database_needs_manager(Oid dboid)
+{
+	bool		found;
+
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	hash_search(SpockDatabaseHash, &dboid, HASH_FIND, &found);
+	found = found || !SpockCtx->databases_known;
+	LWLockRelease(SpockCtx->lock);
+
+	return found;
+}
+
+/*
+ * Read the database registry from disk.
+ *
+ * Called by the supervisor at startup. If there's no usable file, the
+ * registry stays unknown until the first scan of all databases.
+ */
+void
+spock_databases_load(void)
+{
+	FILE	   *file;
+	uint32		magic;
+	int32		count;
+	Oid		   *dboids;
+	int32		i;
+
+	file = AllocateFile(SPOCK_DATABASES_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m",
+							SPOCK_DATABASES_FILE)));
+		return;
+	}
+
+	if (fread(&magic, sizeof(magic), 1, file) != 1 ||
+		magic != SPOCK_DATABASES_MAGIC ||
+		fread(&count, sizeof(count), 1, file) != 1 ||
+		count < 0 || count > SpockCtx->total_workers)
+		goto corrupt;
+
+	dboids = (Oid *) palloc(sizeof(Oid) * Max(count, 1));
+	if (count > 0 && fread(dboids, sizeof(Oid), count, file) != count)
+		goto corrupt;
+	FreeFile(file);
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+	for (i = 0; i < count; i++)
+		hash_search(SpockDatabaseHash, &dboids[i], HASH_ENTER, NULL);
+	SpockCtx->databases_known = true;
+	LWLockRelease(SpockCtx->lock);
+
+	pfree(dboids);
+	return;
+
+corrupt:
+	ereport(LOG,
+			(errmsg("ignoring invalid spock database registry file \"%s\"",
+					SPOCK_DATABASES_FILE)));
+	FreeFile(file);
+}
+
+/*
+ * Called by the supervisor after going through all existing databases,
+ * given in the list. Dropped databases are forgotten. The registry becomes
+ * complete after the first scan, because the managers it started register
+ * their databases themselves.
+ */
+void
+spock_databases_scanned(List *dboids)
+{
+	HASH_SEQ_STATUS		status;
+	SpockDatabaseEntry *entry;
+	bool				changed = false;
+
+	LWLockAcquire(SpockCtx->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, SpockDatabaseHash);
+	while ((entry = (SpockDatabaseEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (!list_member_oid(dboids, entry->dboid))
+		{
+			hash_search(SpockDatabaseHash, &entry->dboid, HASH_REMOVE, NULL);
+			changed = true;
+		}
+	}
+
+	if (!SpockCtx->databases_known)
+	{
+		SpockCtx->databases_known = true;
+		changed = true;
+	}
+
+	LWLockRelease(SpockCtx->lock);
+
+	if (changed)
+		databases_write();
+}
+
 static size_t
 worker_shmem_size(int nworkers)
 {
 	return offsetof(SpockContext, workers) +
-		sizeof(SpockWorker) * nworkers;
+		sizeof(SpockWorker) * nworkers +
+		hash_estimate_size(nworkers, sizeof(SpockWorkerEntry)) +
+		hash_estimate_size(nworkers, sizeof(SpockDatabaseEntry)) +
+		hash_estimate_size(nworkers, sizeof(SpockApplyCatchup));
 }
 
 /*
@@ -657,6 +1360,7 @@ spock_worker_shmem_startup(void)
 {
 	bool        found;
 	int			nworkers;
+	HASHCTL		info;
 
 	if (prev_shmem_startup_hook != NULL)
 		prev_shmem_startup_hook();
@@ -666,17 +1370,41 @@ spock_worker_shmem_startup(void)
 
 	/* Init signaling context for the various processes. */
 	SpockCtx = ShmemInitStruct("spock_context",
-								   worker_shmem_size(nworkers), &found);
+							   offsetof(SpockContext, workers) +
+							   sizeof(SpockWorker) * nworkers, &found);
 
 	if (!found)
 	{
-		SpockCtx->lock = &(GetNamedLWLockTranche("spock"))->lock;
+		SpockCtx->lock = &(GetNamedLWLockTranche("spock"))[0].lock;
+		SpockCtx->databases_lock = &(GetNamedLWLockTranche("spock"))[1].lock;
 		SpockCtx->supervisor = NULL;
 		SpockCtx->subscriptions_changed = false;
+		SpockCtx->databases_known = false;
+		ConditionVariableInit(&SpockCtx->sync_status_cv);
+		ConditionVariableInit(&SpockCtx->apply_commit_cv);
 		SpockCtx->total_workers = nworkers;
 		memset(SpockCtx->workers, 0,
 			   sizeof(SpockWorker) * SpockCtx->total_workers);
 	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(SpockWorkerKey);
+	info.entrysize = sizeof(SpockWorkerEntry);
+	SpockWorkerHash = ShmemInitHash("spock workers", nworkers, nworkers,
+									&info, HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(SpockDatabaseEntry);
+	SpockDatabaseHash = ShmemInitHash("spock databases", nworkers, nworkers,
+									  &info, HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = offsetof(SpockApplyCatchup, commit_time);
+	info.entrysize = sizeof(SpockApplyCatchup);
+	SpockApplyCatchupHash = ShmemInitHash("spock apply catchup", nworkers,
+										  nworkers, &info,
+										  HASH_ELEM | HASH_BLOBS);
 }
 
 /*
@@ -697,9 +1425,10 @@ spock_worker_shmem_init(void)
 	/*
 	 * We'll need to be able to take exclusive locks so only one per-db backend
 	 * tries to allocate or free blocks from this array at once.  There won't
-	 * be enough contention to make anything fancier worth doing.
+	 * be enough contention to make anything fancier worth doing. The second
+	 * lock serializes writes of the database registry file.
 	 */
-	RequestNamedLWLockTranche("spock", 1);
+	RequestNamedLWLockTranche("spock", 2);
 
 	/*
 	 * Whether this is a first startup or crash recovery, we'll be re-initing
@@ -721,6 +1450,56 @@ spock_worker_type_name(SpockWorkerType type)
 		case SPOCK_WORKER_MANAGER: return "manager";
 		case SPOCK_WORKER_APPLY: return "apply";
 		case SPOCK_WORKER_SYNC: return "sync";
+		case SPOCK_WORKER_APPLY_GROUP: return "apply group";
 		default: Assert(false); return NULL;
 	}
 }
+
+/*
+ * Zero all the apply statistics counters.
+ *
+ * When init is true the counters are set up for the first time, which is
+ * only allowed while nobody else can access them.
+ */
+void
+spock_apply_stats_reset(SpockApplyStats *stats, bool init)
+{
+	pg_atomic_uint64   *counters = (pg_atomic_uint64 *) stats;
+	int					i;
+
+	/* The struct is nothing but counters. */
+	StaticAssertStmt(sizeof(SpockApplyStats) % sizeof(pg_atomic_uint64) == 0,
+					 "SpockApplyStats must only contain pg_atomic_uint64");
+
+	for (i = 0; i < sizeof(SpockApplyStats) / sizeof(pg_atomic_uint64); i++)
+	{
+		if (init)
+			pg_atomic_init_u64(&counters[i], 0);
+		else
+			pg_atomic_write_u64(&counters[i], 0);
+	}
+
+	pg_atomic_write_u64(&stats->stats_reset, (uint64) GetCurrentTimestamp());
+}
+
+/*
+ * Set up empty synchronization progress for a newly registered worker.
+ */
+void
+spock_sync_progress_init(SpockSyncProgress *progress)
+{
+	SpinLockInit(&progress->mutex);
+	progress->phase = '\0';
+	progress->phase_start = 0;
+	MemSet(&progress->nspname, 0, sizeof(NameData));
+	MemSet(&progress->relname, 0, sizeof(NameData));
+	progress->table_start = 0;
+	progress->tables_total = 0;
+	progress->tables_done = 0;
+	progress->table_size = 0;
+	progress->table_rows = 0;
+	progress->catchup_start_lsn = InvalidXLogRecPtr;
+	pg_atomic_init_u64(&progress->bytes_copied, 0);
+	pg_atomic_init_u64(&progress->rows_copied, 0);
+	pg_atomic_init_u64(&progress->total_bytes_copied, 0);
+}
@@ -13,7 +13,11 @@
 #ifndef SPOCK_WORKER_H
 #define SPOCK_WORKER_H
 
+#include "port/atomics.h"
+
+#include "storage/condition_variable.h"
 #include "storage/lock.h"
+#include "storage/spin.h"
 
 #include "spock.h"
 
@@ -21,15 +25,142 @@ typedef enum {
 	SPOCK_WORKER_NONE,		/* Unused slot. */
 	SPOCK_WORKER_MANAGER,	/* Manager. */
 	SPOCK_WORKER_APPLY,		/* Apply. */
-	SPOCK_WORKER_SYNC		/* Special type of Apply that synchronizes
+	SPOCK_WORKER_SYNC,		/* Special type of Apply that synchronizes
 								 * one table. */
+	SPOCK_WORKER_APPLY_GROUP	/* Applies several subscriptions in one
+								 * process. */
 } SpockWorkerType;
 
+/* Maximum number of subscriptions served by one multiplexed apply worker. */
+#define SPOCK_APPLY_GROUP_MAX_SUBS	32
+
+typedef struct SpockManagerWorker
+{
+	uint64		queue_pruned;		/* Rows removed from the queue table. */
+	bool		subscriptions_changed;	/* Apply workers need checking. */
+} SpockManagerWorker;
+
+/* Must match SpockConflictType and SpockConflictResolution. */
+#define SPOCK_STAT_CONFLICT_TYPES	4
+#define SPOCK_STAT_RESOLUTIONS		3
+
+/*
+ * Phases of apply timed when spock.track_apply_timing is enabled. The
+ * conflict phase is a part of the execute phase.
+ */
+typedef enum SpockApplyPhase
+{
+	SPOCK_APPLY_PHASE_RECEIVE,		/* waiting for data from the connection */
+	SPOCK_APPLY_PHASE_DECODE,		/* parsing tuples in the messages */
+	SPOCK_APPLY_PHASE_EXECUTE,		/* heap/index writes and row triggers */
+	SPOCK_APPLY_PHASE_CONFLICT,		/* looking up existing local tuples */
+	SPOCK_APPLY_PHASE_COMMIT,		/* local commit including WAL flush */
+	SPOCK_APPLY_NUM_PHASES
+} SpockApplyPhase;
+
+/*
+ * Histogram of transaction apply times, bucket i counts transactions that
+ * took less than 2^(i+1) microseconds, the last bucket counts the rest.
+ */
+#define SPOCK_APPLY_LATENCY_BUCKETS	24
+
+/*
+ * Log-linear histogram of replication lag in microseconds. Values below
+ * SPOCK_LAG_HIST_SUB have their own bucket, every higher power of two is
+ * split into SPOCK_LAG_HIST_SUB buckets, so the relative error is at most
+ * 1/SPOCK_LAG_HIST_SUB. The last bucket also counts everything above it.
+ */
+#define SPOCK_LAG_HIST_SUB_BITS		4
+#define SPOCK_LAG_HIST_SUB			(1 << SPOCK_LAG_HIST_SUB_BITS)
+#define SPOCK_LAG_HIST_BUCKETS		512
+
+typedef struct SpockLagHistogram
+{
+	pg_atomic_uint64	buckets[SPOCK_LAG_HIST_BUCKETS];
+	pg_atomic_uint64	max;
+} SpockLagHistogram;
+
+/*
+ * Apply statistics. Only the apply worker itself updates the counters,
+ * other backends read them and may reset them.
+ */
+typedef struct SpockApplyStats
+{
+	pg_atomic_uint64	xact_commits;
+	pg_atomic_uint64	inserts;
+	pg_atomic_uint64	updates;
+	pg_atomic_uint64	deletes;
+	pg_atomic_uint64	multi_inserts;		/* Number of multi-insert batches. */
+	pg_atomic_uint64	noop_updates;		/* UPDATEs that changed nothing. */
+	pg_atomic_uint64	conflicts[SPOCK_STAT_CONFLICT_TYPES];
+	pg_atomic_uint64	resolutions[SPOCK_STAT_RESOLUTIONS];
+	pg_atomic_uint64	apply_errors;	/* Changes put to spock.apply_errors. */
+	pg_atomic_uint64	bytes_received;
+	pg_atomic_uint64	last_commit_lsn;	/* Remote end lsn of last commit. */
+	pg_atomic_uint64	last_commit_time;	/* Remote commit timestamp. */
+	pg_atomic_uint64	last_apply_time;	/* Local time it was applied. */
+	pg_atomic_uint64	phase_time[SPOCK_APPLY_NUM_PHASES];	/* usec */
+	pg_atomic_uint64	xact_latency[SPOCK_APPLY_LATENCY_BUCKETS];
+	SpockLagHistogram	commit_lag;		/* origin commit to local commit */
+	SpockLagHistogram	flush_lag;		/* origin commit to local flush */
+	pg_atomic_uint64	stats_reset;
+} SpockApplyStats;
+
+/*
+ * Progress of initial subscription or table synchronization. The mutex
+ * protects everything except the atomic counters, which the worker bumps
+ * for every row copied.
+ */
+typedef struct SpockSyncProgress
+{
+	slock_t		mutex;
+	char		phase;			/* SYNC_STATUS_* of current step, 0 if idle. */
+	TimestampTz	phase_start;
+	NameData	nspname;		/* Table currently being copied. */
+	NameData	relname;
+	TimestampTz	table_start;
+	int			tables_total;
+	int			tables_done;
+	int64		table_size;		/* Origin's size estimate in bytes. */
+	int64		table_rows;		/* Origin's size estimate in rows. */
+	XLogRecPtr	catchup_start_lsn;	/* Where catch-up replay started. */
+	pg_atomic_uint64	bytes_copied;	/* COPY data of current table. */
+	pg_atomic_uint64	rows_copied;
+	pg_atomic_uint64	total_bytes_copied;
+} SpockSyncProgress;
+
+/*
+ * How far the subscription got in applying its origin's changes, for
+ * spock.wait_for_apply(). Unlike the apply slot it outlives the worker, so a
+ * restarted worker doesn't start over from nothing. For the same reason it
+ * also remembers if the subscription outgrew multiplexed apply.
+ */
+typedef struct SpockApplyCatchup
+{
+	Oid			dboid;				/* hash key, must be first */
+	Oid			subid;
+	pg_atomic_uint64	commit_time;	/* Origin commit time of the last
+										 * applied transaction. */
+	pg_atomic_uint64	idle_lsn;		/* Origin position at which nothing
+										 * received was left to apply. */
+	bool		dedicated;			/* Released by a multiplexed worker, only
+									 * start dedicated ones. Protected by
+									 * SpockCtx->lock. */
+} SpockApplyCatchup;
+
 typedef struct SpockApplyWorker
 {
 	Oid			subid;				/* Subscription id for apply worker. */
 	bool		sync_pending;		/* Is there new synchronization info pending?. */
 	XLogRecPtr	replay_stop_lsn;	/* Replay should stop here if defined. */
+	SpockApplyStats	stats;			/* Apply statistics. */
+	SpockSyncProgress	progress;	/* Synchronization progress. */
+	SpockApplyCatchup  *catchup;	/* NULL for sync workers or when the
+									 * catch-up table is full. */
+	bool		multiplexed;		/* Applied by a multiplexed worker? */
+	int			group_slot;			/* Slot of that worker. */
+	bool		promoted;			/* Released by the multiplexed worker, needs
+									 * a dedicated one. */
 } SpockApplyWorker;
 
 typedef struct SpockSyncWorker
@@ -39,6 +170,16 @@ typedef struct SpockSyncWorker
 	NameData	relname;	/* Name of the table to copy if any. */
 } SpockSyncWorker;
 
+/*
+ * Multiplexed apply worker. Each of its subscriptions has its own apply slot
+ * (with multiplexed set) which the group process attaches to as well.
+ */
+typedef struct SpockApplyGroupWorker
+{
+	int			nsubs;
+	Oid			subids[SPOCK_APPLY_GROUP_MAX_SUBS];
+} SpockApplyGroupWorker;
+
 typedef struct SpockWorker {
 	SpockWorkerType	worker_type;
 
@@ -57,8 +198,10 @@ typedef struct SpockWorker {
 	/* Type-specific worker info */
 	union
 	{
+		SpockManagerWorker manager;
 		SpockApplyWorker apply;
 		SpockSyncWorker sync;
+		SpockApplyGroupWorker group;
 	} worker;
 
 } SpockWorker;
@@ -67,12 +210,27 @@ typedef struct SpockContext {
 	/* Write lock. */
 	LWLock	   *lock;
 
+	/* Serializes writes of the database registry file. */
+	LWLock	   *databases_lock;
+
 	/* Supervisor process. */
 	PGPROC	   *supervisor;
 
 	/* Signal that subscription info have changed. */
 	bool		subscriptions_changed;
 
+	/*
+	 * Is the registry of databases with a spock node complete? If not, the
+	 * supervisor starts a manager in every database.
+	 */
+	bool		databases_known;
+
+	/* Broadcast when committed sync status of any table changes. */
+	ConditionVariable	sync_status_cv;
+
+	/* Broadcast when any apply worker commits a remote transaction. */
+	ConditionVariable	apply_commit_cv;
+
 	/* Background workers. */
 	int			total_workers;
 	SpockWorker  workers[FLEXIBLE_ARRAY_MEMBER];
@@ -104,8 +262,23 @@ extern List *spock_sync_find_all(Oid dboid, Oid subscriberid);
 
 extern SpockWorker *spock_get_worker(int slot);
 extern bool spock_worker_running(SpockWorker *w);
+extern void spock_worker_forget(SpockWorker *worker);
 extern void spock_worker_kill(SpockWorker *worker);
+extern void spock_worker_release_subscription(SpockWorker *apply);
+
+extern SpockApplyCatchup *spock_apply_catchup_find(Oid dboid, Oid subid);
+extern void spock_apply_catchup_forget(Oid dboid, Oid subid);
+
+extern void spock_local_node_created(void);
+extern void spock_database_register(Oid dboid);
+extern void spock_database_unregister(Oid dboid);
+extern bool spock_database_needs_manager(Oid dboid);
+extern void spock_databases_load(void);
+extern void spock_databases_scanned(List *dboids);
 
 extern const char * spock_worker_type_name(SpockWorkerType type);
 
+extern void spock_apply_stats_reset(SpockApplyStats *stats, bool init);
+extern void spock_sync_progress_init(SpockSyncProgress *progress);
+
 #endif /* SPOCK_WORKER_H */
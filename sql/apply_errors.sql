@@ -0,0 +1,59 @@
+-- spock.isolate_apply_errors: failing changes are skipped and recorded
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.apply_errors_tbl (
+    id integer PRIMARY KEY,
+    v integer NOT NULL
+);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'apply_errors_tbl');
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+-- Only the subscriber rejects large values.
+ALTER TABLE public.apply_errors_tbl ADD CONSTRAINT apply_errors_tbl_v_check CHECK (v < 100);
+
+ALTER SYSTEM SET spock.isolate_apply_errors = on;
+SELECT pg_reload_conf();
+-- The apply worker reads the setting when it starts.
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+-- The failing row comes first, the rows after it use the same relation.
+BEGIN;
+INSERT INTO apply_errors_tbl VALUES (1, 1000);
+INSERT INTO apply_errors_tbl VALUES (2, 2);
+INSERT INTO apply_errors_tbl VALUES (3, 3);
+UPDATE apply_errors_tbl SET v = 30 WHERE id = 3;
+COMMIT;
+
+INSERT INTO apply_errors_tbl VALUES (4, 4);
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT * FROM apply_errors_tbl ORDER BY id;
+
+SELECT action, nspname, relname, error_sqlstate, error_message
+FROM spock.apply_errors ORDER BY logged_at;
+
+SELECT apply_errors FROM spock.stat_subscription
+WHERE sub_name = 'test_subscription';
+
+ALTER SYSTEM RESET spock.isolate_apply_errors;
+SELECT pg_reload_conf();
+SELECT spock.alter_subscription_disable('test_subscription', true);
+SELECT spock.alter_subscription_enable('test_subscription', true);
+TRUNCATE spock.apply_errors;
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.apply_errors_tbl CASCADE;
+$$);
@@ -0,0 +1,62 @@
+-- UPDATEs which don't change the local row
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.noop_tbl (
+    id integer PRIMARY KEY,
+    v text NOT NULL
+);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'noop_tbl');
+
+INSERT INTO noop_tbl VALUES (1, 'a'), (2, 'a');
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT spock.reset_subscription_stats('test_subscription');
+
+SELECT xmin AS noop_xmin FROM noop_tbl WHERE id = 1
+\gset
+
+\c :provider_dsn
+-- The local row came from the provider, nothing to write.
+UPDATE noop_tbl SET v = 'a' WHERE id = 1;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT xmin::text = :'noop_xmin' AS same_row_version FROM noop_tbl WHERE id = 1;
+
+SELECT noop_updates FROM spock.stat_subscription
+WHERE sub_name = 'test_subscription';
+
+-- A local change which the provider then makes too.
+UPDATE noop_tbl SET v = 'b' WHERE id = 2;
+
+SELECT xmin AS noop_xmin FROM noop_tbl WHERE id = 2
+\gset
+
+\c :provider_dsn
+UPDATE noop_tbl SET v = 'b' WHERE id = 2;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+-- The remote change is newer than the local row, so it must be written to
+-- record its origin even though the values are the same.
+SELECT id, v, xmin::text = :'noop_xmin' AS same_row_version,
+       (spock.xact_commit_timestamp_origin(xmin)).roident <> 0 AS remote_origin
+FROM noop_tbl WHERE id = 2;
+
+SELECT noop_updates FROM spock.stat_subscription
+WHERE sub_name = 'test_subscription';
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.noop_tbl CASCADE;
+$$);
@@ -0,0 +1,23 @@
+-- spock.queue_pruned_rows() and spock.queue_min_retention
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.queue_prune_tbl (id integer PRIMARY KEY);
+$$);
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+-- Decoded by every slot, but younger than spock.queue_min_retention.
+SHOW spock.queue_min_retention;
+
+SELECT count(*) > 0 AS kept FROM spock.queue
+WHERE message::text LIKE '%queue_prune_tbl%';
+
+SELECT spock.queue_pruned_rows();
+
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.queue_prune_tbl;
+$$);
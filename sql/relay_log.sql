@@ -0,0 +1,90 @@
+-- spock.relay_log
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.relay_log_tbl (
+    id integer PRIMARY KEY,
+    v text
+);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'relay_log_tbl');
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+
+ALTER SYSTEM SET spock.relay_log = on;
+
+SELECT pg_reload_conf();
+
+-- The apply worker reads the setting when it starts.
+SELECT spock.alter_subscription_disable('test_subscription', true);
+
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+\c :provider_dsn
+
+INSERT INTO relay_log_tbl SELECT g, 'relayed' FROM generate_series(1, 3) g;
+
+SELECT pg_current_wal_lsn() AS relayed_lsn
+\gset
+
+\c :subscriber_dsn
+
+-- Confirming the slot only means the changes were relayed, wait for the apply.
+SELECT spock.wait_for_apply('test_provider', target_lsn := :'relayed_lsn', timeout := 60000);
+
+SELECT * FROM relay_log_tbl ORDER BY id;
+
+SELECT count(*) FROM pg_ls_dir('pg_logical/spock_relay', true, false) d
+WHERE d = (SELECT sub_id::text FROM spock.subscription
+           WHERE sub_name = 'test_subscription');
+
+ALTER SYSTEM RESET spock.relay_log;
+
+SELECT pg_reload_conf();
+
+SELECT spock.alter_subscription_disable('test_subscription', true);
+
+SELECT spock.alter_subscription_enable('test_subscription', true);
+
+-- The drained relay log is removed after the restart.
+DO $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        PERFORM 1 FROM pg_ls_dir('pg_logical/spock_relay', true, false) d
+         WHERE d = (SELECT sub_id::text FROM spock.subscription
+                    WHERE sub_name = 'test_subscription');
+        EXIT WHEN NOT FOUND;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END;
+$$;
+
+SELECT count(*) FROM pg_ls_dir('pg_logical/spock_relay', true, false) d
+WHERE d = (SELECT sub_id::text FROM spock.subscription
+           WHERE sub_name = 'test_subscription');
+
+\c :provider_dsn
+
+INSERT INTO relay_log_tbl VALUES (4, 'direct');
+
+SELECT pg_current_wal_lsn() AS direct_lsn
+\gset
+
+\c :subscriber_dsn
+
+SELECT spock.wait_for_apply('test_provider', target_lsn := :'direct_lsn', timeout := 60000);
+
+SELECT * FROM relay_log_tbl ORDER BY id;
+
+\c :provider_dsn
+
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.relay_log_tbl CASCADE;
+$$);
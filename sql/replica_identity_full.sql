@@ -0,0 +1,61 @@
+-- UPDATEs and DELETEs of tables with REPLICA IDENTITY FULL
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.rifull_tbl (
+    id integer,
+    code text,
+    v integer
+);
+ALTER TABLE public.rifull_tbl REPLICA IDENTITY FULL;
+CREATE TABLE public.rifull_noidx (
+    id integer,
+    v text
+);
+ALTER TABLE public.rifull_noidx REPLICA IDENTITY FULL;
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'rifull_tbl');
+SELECT * FROM spock.replication_set_add_table('default', 'rifull_noidx');
+
+\c :subscriber_dsn
+-- Indexes only on the subscriber, none of them a REPLICA IDENTITY index.
+-- The partial one must never be used.
+CREATE INDEX rifull_tbl_id_idx ON rifull_tbl (id);
+CREATE INDEX rifull_tbl_code_idx ON rifull_tbl (code) WHERE v > 100;
+
+\c :provider_dsn
+INSERT INTO rifull_tbl VALUES (1, 'a', 1), (2, 'b', 2), (3, NULL, 3),
+    (4, 'd', 4), (4, 'd', 4), (NULL, 'n', 5);
+INSERT INTO rifull_noidx VALUES (1, 'a'), (2, 'b'), (2, 'b');
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+-- Found through the index on id, NULL in a column outside of it.
+UPDATE rifull_tbl SET v = 10 WHERE id = 1;
+UPDATE rifull_tbl SET v = 30 WHERE id = 3;
+-- NULL key, the index can't be used and the table is scanned.
+UPDATE rifull_tbl SET v = 50 WHERE id IS NULL;
+-- Only one of two identical rows goes away.
+DELETE FROM rifull_tbl WHERE ctid = (SELECT ctid FROM rifull_tbl WHERE id = 4 LIMIT 1);
+DELETE FROM rifull_tbl WHERE id = 2;
+
+-- No index at all, both identical rows change.
+UPDATE rifull_noidx SET v = 'c' WHERE id = 1;
+UPDATE rifull_noidx SET v = 'x' WHERE id = 2;
+DELETE FROM rifull_noidx WHERE ctid = (SELECT ctid FROM rifull_noidx WHERE id = 2 LIMIT 1);
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+SELECT * FROM rifull_tbl ORDER BY id, v;
+SELECT * FROM rifull_noidx ORDER BY id, v;
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.rifull_tbl CASCADE;
+	DROP TABLE public.rifull_noidx CASCADE;
+$$);
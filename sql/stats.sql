@@ -0,0 +1,55 @@
+-- Apply statistics, per-relation statistics and replication lag
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.stats_tbl (
+    id integer PRIMARY KEY,
+    v text
+);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'stats_tbl');
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT spock.reset_relation_stats('stats_tbl');
+
+\c :subscriber_dsn
+SELECT spock.reset_subscription_stats('test_subscription');
+
+SELECT spock.reset_relation_stats('stats_tbl');
+
+\c :provider_dsn
+INSERT INTO stats_tbl VALUES (1, 'a'), (2, 'b'), (3, 'c');
+UPDATE stats_tbl SET v = 'bb' WHERE id = 2;
+DELETE FROM stats_tbl WHERE id = 3;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+-- Decoded and sent by the provider.
+SELECT relname, changes_decoded, changes_filtered, bytes_sent > 0 AS sent
+FROM spock.stat_relation WHERE relname = 'stats_tbl';
+
+\c :subscriber_dsn
+-- Applied by the subscriber.
+SELECT relname, inserts, updates, deletes, conflicts, apply_time >= 0 AS timed
+FROM spock.stat_relation WHERE relname = 'stats_tbl';
+
+-- Other transactions, like sequence updates, may be counted too.
+SELECT xact_commits >= 3 AS commits, inserts >= 3 AS inserts,
+       updates >= 1 AS updates, deletes >= 1 AS deletes,
+       apply_errors, last_commit_lsn IS NOT NULL AS has_commit_lsn,
+       stats_reset IS NOT NULL AS has_reset
+FROM spock.stat_subscription WHERE sub_name = 'test_subscription';
+
+SELECT commit_count >= 3 AS commits, commit_lag_p50 <= commit_lag_max AS ordered,
+       commit_lag_max >= 0 AS nonneg
+FROM spock.stat_subscription_lag WHERE sub_name = 'test_subscription';
+
+\c :provider_dsn
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.stats_tbl CASCADE;
+$$);
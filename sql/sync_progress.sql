@@ -0,0 +1,63 @@
+-- spock.sync_progress while a table is being synchronized
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.sync_progress_tbl (
+    id integer PRIMARY KEY,
+    v text
+);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'sync_progress_tbl');
+
+INSERT INTO sync_progress_tbl SELECT g, 'v' || g FROM generate_series(1, 10) g;
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+\c :subscriber_dsn
+
+-- Nothing is being synchronized once the subscription is ready.
+SELECT count(*) FROM spock.sync_progress WHERE sub_name = 'test_subscription';
+
+SELECT * FROM spock.alter_subscription_resynchronize_table('test_subscription', 'sync_progress_tbl');
+
+-- Hold the table lock so the sync worker stops in front of the data copy.
+BEGIN;
+LOCK TABLE sync_progress_tbl IN ACCESS EXCLUSIVE MODE;
+
+DO $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        PERFORM 1 FROM spock.sync_progress
+         WHERE relname = 'sync_progress_tbl' AND phase = 'data';
+        EXIT WHEN FOUND;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END;
+$$;
+
+SELECT sub_name, worker_type, phase, nspname, relname, tables_done,
+       tables_total, rows_copied
+  FROM spock.sync_progress
+ WHERE relname = 'sync_progress_tbl';
+
+COMMIT;
+
+BEGIN;
+SET statement_timeout = '30s';
+
+SELECT spock.wait_for_table_sync_complete('test_subscription', 'sync_progress_tbl');
+
+COMMIT;
+
+SELECT count(*) FROM sync_progress_tbl;
+
+\c :provider_dsn
+
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.sync_progress_tbl CASCADE;
+$$);
@@ -0,0 +1,47 @@
+-- spock.wait_for_apply()
+SELECT * FROM pglogical_regress_variables()
+\gset
+
+\c :provider_dsn
+
+SELECT spock.replicate_ddl_command($$
+CREATE TABLE public.wait_apply_tbl (
+    id integer PRIMARY KEY
+);
+$$);
+
+SELECT * FROM spock.replication_set_add_table('default', 'wait_apply_tbl');
+
+SELECT spock.wait_slot_confirm_lsn(NULL, NULL);
+
+SELECT now() AS before_insert
+\gset
+
+INSERT INTO wait_apply_tbl VALUES (1);
+
+SELECT pg_current_wal_lsn() AS after_insert
+\gset
+
+\c :subscriber_dsn
+
+SELECT spock.wait_for_apply('test_provider', target_lsn := :'after_insert', timeout := 60000);
+
+SELECT * FROM wait_apply_tbl;
+
+SELECT spock.wait_for_apply('test_provider', target_time := :'before_insert', timeout := 60000);
+
+-- Nothing commits on the provider a day from now.
+SELECT spock.wait_for_apply('test_provider', target_time := now() + interval '1 day', timeout := 100);
+
+SELECT spock.wait_for_apply('test_provider');
+
+SELECT spock.wait_for_apply('test_provider', target_time := now(), timeout := -1);
+
+SELECT spock.wait_for_apply('test_subscriber', target_time := now());
+
+\c :provider_dsn
+
+\set VERBOSITY terse
+SELECT spock.replicate_ddl_command($$
+	DROP TABLE public.wait_apply_tbl CASCADE;
+$$);